@@ -69,24 +69,14 @@ done
 find "${GADGET_FUNCTIONS_PATH}" -maxdepth 1 -mindepth 1 -type d | while read FUNCTION_DIR
 do
     if [ -e "${FUNCTION_DIR}/streaming" ]; then
-        if [ -e "${FUNCTION_DIR}/streaming/uncompressed" ]; then
-            UNCOMPRESSED=$(find "${FUNCTION_DIR}/streaming/uncompressed/" -maxdepth 1 -mindepth 1 -type d)
-            if [ -e "${UNCOMPRESSED}" ]; then
-                find "${UNCOMPRESSED}" -maxdepth 1 -mindepth 1 -type d | while read DIR
+        for FORMAT in uncompressed mjpeg framebased
+        do
+            if [ -e "${FUNCTION_DIR}/streaming/${FORMAT}" ]; then
+                find "${FUNCTION_DIR}/streaming/${FORMAT}/" -maxdepth 2 -mindepth 2 -type d | while read DIR
                 do
                     echo "INFO: UVC streaming format: ${DIR}"
                 done
             fi
-        fi
-        
-        if [ -e "${FUNCTION_DIR}/streaming/mjpeg" ]; then
-            MJPEG=$(find "${FUNCTION_DIR}/streaming/mjpeg/" -maxdepth 1 -mindepth 1 -type d)
-            if [ -e "${MJPEG}" ]; then
-                find "${MJPEG}" -maxdepth 1 -mindepth 1 -type d | while read DIR
-                do
-                    echo "INFO: UVC streaming format: ${DIR}"
-                done
-            fi
-        fi
+        done
     fi
 done
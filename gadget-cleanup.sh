@@ -85,35 +85,23 @@ find "${GADGET_FUNCTIONS_PATH}" -maxdepth 1 -mindepth 1 -type d | while read FUN
 do
     # Cleanup UVC
     if [ -e "${FUNCTION_DIR}/streaming" ]; then
-        # Cleanup UVC functions streaming uncompressed
-        if [ -e "${FUNCTION_DIR}/streaming/uncompressed" ]; then
-            UNCOMPRESSED=$(find "${FUNCTION_DIR}/streaming/uncompressed/" -maxdepth 1 -mindepth 1 -type d)
-            if [ -e "${UNCOMPRESSED}" ]; then
-                find "${UNCOMPRESSED}" -maxdepth 1 -mindepth 1 -type d | while read DIR
+        # Cleanup UVC functions streaming formats
+        for FORMAT in uncompressed mjpeg framebased
+        do
+            if [ -e "${FUNCTION_DIR}/streaming/${FORMAT}" ]; then
+                find "${FUNCTION_DIR}/streaming/${FORMAT}/" -maxdepth 1 -mindepth 1 -type d | while read FORMAT_DIR
                 do
-                    echo "INFO: UVC Remove uncompressed streaming frame format: ${DIR}"
-                    rmdir "${DIR}"
+                    find "${FORMAT_DIR}" -maxdepth 1 -mindepth 1 -type d | while read DIR
+                    do
+                        echo "INFO: UVC Remove ${FORMAT} streaming frame format: ${DIR}"
+                        rmdir "${DIR}"
+                    done
+
+                    echo "INFO: UVC Remove ${FORMAT} format: ${FORMAT_DIR}"
+                    rmdir "${FORMAT_DIR}"
                 done
-
-                echo "INFO: UVC Remove uncompressed format: ${UNCOMPRESSED}"
-                rmdir "${UNCOMPRESSED}"
             fi
-        fi
-        
-        # Cleanup UVC functions streaming mjpeg
-        if [ -e "${FUNCTION_DIR}/streaming/mjpeg" ]; then
-            MJPEG=$(find "${FUNCTION_DIR}/streaming/mjpeg/" -maxdepth 1 -mindepth 1 -type d)
-            if [ -e "${MJPEG}" ]; then
-                find "${MJPEG}" -maxdepth 1 -mindepth 1 -type d | while read DIR
-                do
-                    echo "INFO: UVC Remove mjpeg streaming frame format: ${DIR}"
-                    rmdir "${DIR}"
-                done
-
-                echo "INFO: UVC Remove mjpeg format: ${MJPEG}"
-                rmdir "${MJPEG}"
-            fi
-        fi
+        done
     fi
 done
 
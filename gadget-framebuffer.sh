@@ -56,18 +56,42 @@ mkdir "${GADGET_PATH}/functions/acm.usb0"
 
 echo 2048 > "${FUNCTIONS_UVC}/streaming_maxpacket"
 
-FRAMEDIR="${FUNCTIONS_UVC}/streaming/uncompressed/u/${FB_WIDTH}x${FB_HEIGHT}p"
-mkdir -p "${FRAMEDIR}"
-
-echo $FB_WIDTH  > "${FRAMEDIR}/wWidth"
-echo $FB_HEIGHT > "${FRAMEDIR}/wHeight"
-echo 1000000    > "${FRAMEDIR}/dwDefaultFrameInterval"
-echo $(($FB_WIDTH * $FB_HEIGHT * 80))  > "${FRAMEDIR}/dwMinBitRate"
-echo $(($FB_WIDTH * $FB_HEIGHT * 160)) > "${FRAMEDIR}/dwMaxBitRate"
-echo $(($FB_WIDTH * $FB_HEIGHT * 2))   > "${FRAMEDIR}/dwMaxVideoFrameBufferSize"
-cat <<EOF > "${FRAMEDIR}/dwFrameInterval"
+config_frame () {
+    FORMAT=$1
+    NAME=$2
+    WIDTH=$3
+    HEIGHT=$4
+
+    FRAMEDIR="${FUNCTIONS_UVC}/streaming/${FORMAT}/${NAME}/${WIDTH}x${HEIGHT}p"
+    mkdir -p "${FRAMEDIR}"
+
+    echo $WIDTH     > "${FRAMEDIR}/wWidth"
+    echo $HEIGHT    > "${FRAMEDIR}/wHeight"
+    echo 1000000    > "${FRAMEDIR}/dwDefaultFrameInterval"
+    echo $(($WIDTH * $HEIGHT * 80))  > "${FRAMEDIR}/dwMinBitRate"
+    echo $(($WIDTH * $HEIGHT * 160)) > "${FRAMEDIR}/dwMaxBitRate"
+    echo $(($WIDTH * $HEIGHT * 2))   > "${FRAMEDIR}/dwMaxVideoFrameBufferSize"
+    cat <<EOF > "${FRAMEDIR}/dwFrameInterval"
 1000000
 EOF
+}
+
+# Full framebuffer size and a half size frame, uvc-gadget scales the framebuffer
+# to the frame size selected by the host
+FB_HALF_WIDTH=$((FB_WIDTH / 4 * 2))
+FB_HALF_HEIGHT=$((FB_HEIGHT / 4 * 2))
+
+config_frame uncompressed u $FB_WIDTH $FB_HEIGHT
+config_frame uncompressed u $FB_HALF_WIDTH $FB_HALF_HEIGHT
+config_frame mjpeg m $FB_WIDTH $FB_HEIGHT
+config_frame mjpeg m $FB_HALF_WIDTH $FB_HALF_HEIGHT
+config_frame uncompressed n $FB_WIDTH $FB_HEIGHT
+config_frame uncompressed n $FB_HALF_WIDTH $FB_HALF_HEIGHT
+
+# NV12 format, 12 bits per pixel
+printf '\116\126\061\062\000\000\020\000\200\000\000\252\000\070\233\161' \
+    > "${FUNCTIONS_UVC}/streaming/uncompressed/n/guidFormat"
+echo 12 > "${FUNCTIONS_UVC}/streaming/uncompressed/n/bBitsPerPixel"
 
 echo "INFO: Initialize configs and functions"
 
@@ -75,6 +99,8 @@ mkdir    "${FUNCTIONS_UVC}/streaming/header/h"
 mkdir -p "${FUNCTIONS_UVC}/control/header/h"
 ln -s    "${FUNCTIONS_UVC}/control/header/h"         "${FUNCTIONS_UVC}/control/class/fs/h"
 ln -s    "${FUNCTIONS_UVC}/streaming/uncompressed/u" "${FUNCTIONS_UVC}/streaming/header/h"
+ln -s    "${FUNCTIONS_UVC}/streaming/mjpeg/m"        "${FUNCTIONS_UVC}/streaming/header/h"
+ln -s    "${FUNCTIONS_UVC}/streaming/uncompressed/n" "${FUNCTIONS_UVC}/streaming/header/h"
 ln -s    "${FUNCTIONS_UVC}/streaming/header/h"       "${FUNCTIONS_UVC}/streaming/class/fs"
 ln -s    "${FUNCTIONS_UVC}/streaming/header/h"       "${FUNCTIONS_UVC}/streaming/class/hs"
 ln -s    "${FUNCTIONS_UVC}"                          "${GADGET_PATH}/configs/c.2/uvc.usb0"
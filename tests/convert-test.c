@@ -0,0 +1,306 @@
+/*
+ * Conversion kernel tests, run by make check
+ *
+ * Every vectorized RGB to YUYV kernel the CPU supports has to produce the
+ * same bytes as the scalar reference for all widths up to 130 pixels and some
+ * frame widths, at all source and destination alignments within 32 bytes and
+ * for random lines, edge values and equal pixel pairs. Guard bytes after the
+ * line catch kernels writing past it.
+ *
+ * The kernel the conversion stage picks for an RGB capture fourcc has to
+ * convert lines written in the memory layout V4L2 documents for it.
+ */
+
+#define main uvc_main
+#include "../uvc-gadget.c"
+#undef main
+
+#define TEST_ALIGN 32
+#define TEST_GUARD 64
+#define TEST_MAX_WIDTH 4096
+
+enum test_pattern {
+    PATTERN_RANDOM,
+    PATTERN_ZERO,
+    PATTERN_FULL,
+    PATTERN_ALTERNATE,
+    PATTERN_GRADIENT,
+    PATTERN_PAIRS,
+    PATTERN_COUNT
+};
+
+static const char * test_pattern_name[PATTERN_COUNT] = {
+    "random", "zero", "full", "alternate", "gradient", "pairs"
+};
+
+static const unsigned int test_frame_widths[] = {
+    255, 256, 257, 320, 511, 640, 1021, 1280, 1920, TEST_MAX_WIDTH
+};
+
+static unsigned int tests_run;
+static unsigned int tests_failed;
+
+/* Byte offsets of the channels as documented for V4L2, RGB565 is packed */
+struct test_rgb_layout {
+    unsigned int format;
+    unsigned int bytes_per_pixel;
+    unsigned int red;
+    unsigned int green;
+    unsigned int blue;
+};
+
+static const struct test_rgb_layout test_rgb_layouts[] = {
+    { V4L2_PIX_FMT_XBGR32, 4, 2, 1, 0 },
+    { V4L2_PIX_FMT_ABGR32, 4, 2, 1, 0 },
+    { V4L2_PIX_FMT_BGR32,  4, 2, 1, 0 },
+    { V4L2_PIX_FMT_RGBX32, 4, 0, 1, 2 },
+    { V4L2_PIX_FMT_RGBA32, 4, 0, 1, 2 },
+    { V4L2_PIX_FMT_BGR24,  3, 2, 1, 0 },
+    { V4L2_PIX_FMT_RGB24,  3, 0, 1, 2 },
+    { V4L2_PIX_FMT_RGB565, 2, 0, 0, 0 },
+};
+
+/* Pixel pairs, exact in RGB565 as well */
+static const uint8_t test_rgb_colors[][6] = {
+    { 0xf8, 0x00, 0x00,   0x00, 0xfc, 0x00 },
+    { 0x00, 0x00, 0xf8,   0xf8, 0x00, 0x00 },
+    { 0x80, 0x40, 0x20,   0x08, 0x9c, 0xe0 },
+    { 0xf8, 0xfc, 0xf8,   0x00, 0x00, 0x00 },
+};
+
+static void test_fill(uint8_t * src, unsigned int size, unsigned int bytes_per_pixel,
+    enum test_pattern pattern, unsigned int * seed)
+{
+    unsigned int i;
+
+    for (i = 0; i < size; i++) {
+        switch (pattern) {
+        case PATTERN_RANDOM:
+            *seed = *seed * 1103515245 + 12345;
+            src[i] = *seed >> 16;
+            break;
+
+        case PATTERN_ZERO:
+            src[i] = 0x00;
+            break;
+
+        case PATTERN_FULL:
+            src[i] = 0xff;
+            break;
+
+        case PATTERN_ALTERNATE:
+            src[i] = (i & 1) ? 0xff : 0x00;
+            break;
+
+        case PATTERN_GRADIENT:
+            src[i] = i * 7;
+            break;
+
+        case PATTERN_PAIRS:
+            /* the same pixel pair repeated, the scalar kernels reuse the last result */
+            src[i] = ((i % (bytes_per_pixel * 2)) * 37 + (i / (bytes_per_pixel * 16)) * 101) & 0xff;
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static void test_kernel(const char * set, const char * name, rgb2yuyv_line_fn kernel,
+    rgb2yuyv_line_fn reference, unsigned int bytes_per_pixel, unsigned int width)
+{
+    static uint8_t src[TEST_MAX_WIDTH * 4 + TEST_ALIGN * 2];
+    static uint8_t expected[TEST_MAX_WIDTH * 2 + TEST_ALIGN + TEST_GUARD];
+    static uint8_t result[TEST_MAX_WIDTH * 2 + TEST_ALIGN + TEST_GUARD];
+    uint8_t * line = (uint8_t *) (((uintptr_t) src + TEST_ALIGN - 1) & ~(uintptr_t) (TEST_ALIGN - 1));
+    unsigned int seed = 0x12345678 + width;
+    unsigned int src_offset;
+    unsigned int dst_offset;
+    enum test_pattern pattern;
+
+    for (pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+        for (src_offset = 0; src_offset < TEST_ALIGN; src_offset++) {
+            dst_offset = (src_offset * 7) % TEST_ALIGN;
+
+            test_fill(line + src_offset, width * bytes_per_pixel, bytes_per_pixel, pattern, &seed);
+            memset(expected, 0xa5, sizeof(expected));
+            memset(result, 0xa5, sizeof(result));
+
+            reference(expected + dst_offset, line + src_offset, width);
+            kernel(result + dst_offset, line + src_offset, width);
+
+            tests_run++;
+            if (memcmp(expected, result, sizeof(result))) {
+                tests_failed++;
+                printf("FAIL: %s %s width %u, %s line, source offset %u, destination offset %u\n",
+                    set, name, width, test_pattern_name[pattern], src_offset, dst_offset);
+            }
+        }
+    }
+}
+
+static void test_kernels(const struct rgb2yuyv_kernels * kernels)
+{
+    const struct rgb2yuyv_kernels * c = &rgb2yuyv_kernels_c;
+    unsigned int width;
+    unsigned int i;
+
+    for (i = 0; i <= 130 + ARRAY_SIZE(test_frame_widths); i++) {
+        width = (i <= 130) ? i : test_frame_widths[i - 131];
+
+        test_kernel(kernels->name, "line16", kernels->line16, c->line16, 2, width);
+        test_kernel(kernels->name, "line24", kernels->line24, c->line24, 3, width);
+        test_kernel(kernels->name, "line32", kernels->line32, c->line32, 4, width);
+        test_kernel(kernels->name, "line24_bgr", kernels->line24_bgr, c->line24_bgr, 3, width);
+        test_kernel(kernels->name, "line32_bgr", kernels->line32_bgr, c->line32_bgr, 4, width);
+    }
+    printf("%s: compared with scalar reference\n", kernels->name);
+}
+
+static void test_rgb_pixel(const struct test_rgb_layout * layout, uint8_t * pixel, const uint8_t * rgb)
+{
+    unsigned int rgb565 = ((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3);
+
+    if (layout->format == V4L2_PIX_FMT_RGB565) {
+        pixel[0] = rgb565 & 0xff;
+        pixel[1] = rgb565 >> 8;
+        return;
+    }
+
+    /* padding and alpha must not leak into the result */
+    memset(pixel, 0x55, layout->bytes_per_pixel);
+    pixel[layout->red]   = rgb[0];
+    pixel[layout->green] = rgb[1];
+    pixel[layout->blue]  = rgb[2];
+}
+
+static void test_rgb_format(const struct test_rgb_layout * layout)
+{
+    const unsigned int width = 34;
+    uint8_t src[34 * 4];
+    uint8_t result[34 * 2];
+    uint8_t expected[34 * 2];
+    rgb2yuyv_line_fn rgb;
+    unsigned int yuyv;
+    unsigned int i;
+    unsigned int x;
+
+    v4l2_convert_line_kernel(layout->format, &rgb);
+
+    tests_run++;
+    if (!rgb) {
+        tests_failed++;
+        printf("FAIL: %s %c%c%c%c has no conversion kernel\n", rgb2yuyv.name, pixfmtstr(layout->format));
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(test_rgb_colors); i++) {
+        const uint8_t * c = test_rgb_colors[i];
+
+        yuyv = rgb2yuyv_pair(c[0], c[1], c[2], c[3], c[4], c[5]);
+        for (x = 0; x < width; x += 2) {
+            test_rgb_pixel(layout, src + x * layout->bytes_per_pixel, c);
+            test_rgb_pixel(layout, src + (x + 1) * layout->bytes_per_pixel, c + 3);
+            memcpy(expected + x * 2, &yuyv, 4);
+        }
+
+        memset(result, 0, sizeof(result));
+        rgb(result, src, width);
+
+        tests_run++;
+        if (memcmp(expected, result, sizeof(result))) {
+            tests_failed++;
+            printf("FAIL: %s %c%c%c%c converts %02x%02x%02x,%02x%02x%02x to %02x %02x %02x %02x, expected %02x %02x %02x %02x\n",
+                rgb2yuyv.name, pixfmtstr(layout->format), c[0], c[1], c[2], c[3], c[4], c[5],
+                result[0], result[1], result[2], result[3], expected[0], expected[1], expected[2], expected[3]);
+        }
+    }
+}
+
+/* YUYV is Y0 Cb Y1 Cr: red has Cr above and Cb below neutral, blue the opposite */
+static void test_yuyv_order()
+{
+    unsigned int red = rgb2yuyv_pair(0xff, 0x00, 0x00, 0xff, 0x00, 0x00);
+    unsigned int blue = rgb2yuyv_pair(0x00, 0x00, 0xff, 0x00, 0x00, 0xff);
+    uint8_t r[4];
+    uint8_t b[4];
+
+    memcpy(r, &red, 4);
+    memcpy(b, &blue, 4);
+
+    tests_run++;
+    if (r[1] >= 128 || r[3] <= 128 || b[1] <= 128 || b[3] >= 128) {
+        tests_failed++;
+        printf("FAIL: red converts to Cb %u Cr %u, blue to Cb %u Cr %u\n", r[1], r[3], b[1], b[3]);
+    }
+}
+
+static void test_rgb_formats()
+{
+    rgb2yuyv_line_fn rgb;
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < ARRAY_SIZE(test_rgb_layouts); i++) {
+        test_rgb_format(&test_rgb_layouts[i]);
+    }
+
+    /* a new RGB capture format needs its layout above */
+    for (i = 0; i < ARRAY_SIZE(v4l2_convert_formats); i++) {
+        v4l2_convert_line_kernel(v4l2_convert_formats[i], &rgb);
+
+        for (j = 0; rgb && j < ARRAY_SIZE(test_rgb_layouts); j++) {
+            if (test_rgb_layouts[j].format == v4l2_convert_formats[i]) {
+                break;
+            }
+        }
+
+        tests_run++;
+        if (rgb && j == ARRAY_SIZE(test_rgb_layouts)) {
+            tests_failed++;
+            printf("FAIL: %c%c%c%c has no layout in the test\n", pixfmtstr(v4l2_convert_formats[i]));
+        }
+    }
+    printf("%s: RGB capture formats checked\n", rgb2yuyv.name);
+}
+
+int main()
+{
+    bool vectorized = false;
+
+    test_yuyv_order();
+    rgb2yuyv = rgb2yuyv_kernels_c;
+    test_rgb_formats();
+    rgb2yuyv_init();
+    test_rgb_formats();
+
+#ifdef RGB2YUYV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        test_kernels(&rgb2yuyv_kernels_sse2);
+        vectorized = true;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        test_kernels(&rgb2yuyv_kernels_avx2);
+        vectorized = true;
+    }
+#endif
+
+#ifdef RGB2YUYV_NEON
+#ifdef __arm__
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    {
+        test_kernels(&rgb2yuyv_kernels_neon);
+        vectorized = true;
+    }
+#endif
+
+    if (!vectorized) {
+        printf("No vectorized kernels for this CPU\n");
+    }
+
+    printf("%u tests, %u failed\n", tests_run, tests_failed);
+    return (tests_failed) ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Wakeup latency of the processing loop
+ *
+ * Models the two processing loop designs of uvc-gadget and measures how long
+ * an event (a dequeued frame or a UVC control request) waits before the loop
+ * handles it:
+ *
+ *   select - the loop before the epoll rework: 1 ms nanosleep on every pass,
+ *            then select() on the event fd and the UVC fd for write events.
+ *            A videobuf2 queue that is not streaming reports an error, so the
+ *            UVC fd is always ready; a pipe write end stands in for it.
+ *   epoll  - the current loop: epoll_wait() on the event fd only, the UVC
+ *            data events are watched only while a buffer can be dequeued.
+ *
+ * A producer thread writes a timestamp to an eventfd at random intervals
+ * between 2 and 20 ms, the loop reads it and records the delay.
+ *
+ * Usage: loop-latency [events]
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct loop_stats {
+    double * latency;
+    unsigned int count;
+    unsigned long long wakeups;
+    double cpu_time;
+};
+
+static int event_fd;
+static unsigned int events;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cpu_time_ms()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-3;
+}
+
+static void * producer_thread(void * arg)
+{
+    unsigned int seed = 1;
+    unsigned int i;
+    uint64_t stamp;
+    (void) arg;
+
+    for (i = 0; i < events; i++) {
+        long delay = 2000000L + (rand_r(&seed) % 18000000L);
+        nanosleep((const struct timespec[]) { {0, delay} }, NULL);
+
+        /* the eventfd counter adds up, the loop reads the stamp from here */
+        stamp = now_ns();
+        if (write(event_fd, &stamp, sizeof stamp) != sizeof stamp) {
+            printf("PRODUCER: write failed: %s (%d).\n", strerror(errno), errno);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool loop_event(struct loop_stats * stats)
+{
+    uint64_t stamp;
+
+    if (read(event_fd, &stamp, sizeof stamp) != sizeof stamp) {
+        return false;
+    }
+    stats->latency[stats->count++] = (now_ns() - stamp) / 1e3;
+    return true;
+}
+
+static void loop_select(struct loop_stats * stats)
+{
+    int uvc_fds[2];
+    int nfds;
+    fd_set rfds, wfds;
+
+    if (pipe(uvc_fds) < 0) {
+        printf("SELECT: pipe failed: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+    nfds = (event_fd > uvc_fds[1]) ? event_fd : uvc_fds[1];
+
+    while (stats->count < events) {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(event_fd, &rfds);
+        FD_SET(uvc_fds[1], &wfds);
+
+        nanosleep((const struct timespec[]) { {0, 1000000L} }, NULL);
+
+        if (select(nfds + 1, &rfds, &wfds, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        stats->wakeups++;
+
+        if (FD_ISSET(event_fd, &rfds)) {
+            loop_event(stats);
+        }
+    }
+
+    close(uvc_fds[0]);
+    close(uvc_fds[1]);
+}
+
+static void loop_epoll(struct loop_stats * stats)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = event_fd };
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, event_fd, &event) < 0) {
+        printf("EPOLL: setup failed: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+
+    while (stats->count < events) {
+        if (epoll_wait(epfd, &event, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        stats->wakeups++;
+
+        if (event.events & EPOLLIN) {
+            loop_event(stats);
+        }
+    }
+
+    close(epfd);
+}
+
+static int compare_double(const void * a, const void * b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int loop_run(const char * name, void (*loop)(struct loop_stats *))
+{
+    struct loop_stats stats = { 0 };
+    pthread_t producer;
+    uint64_t start;
+    double cpu_start;
+    double sum = 0;
+    unsigned int i;
+
+    stats.latency = calloc(events, sizeof stats.latency[0]);
+    event_fd = eventfd(0, EFD_CLOEXEC);
+    if (!stats.latency || event_fd < 0) {
+        printf("%s: setup failed\n", name);
+        return -1;
+    }
+
+    start = now_ns();
+    cpu_start = cpu_time_ms();
+    pthread_create(&producer, NULL, producer_thread, NULL);
+    loop(&stats);
+    stats.cpu_time = cpu_time_ms() - cpu_start;
+    pthread_join(producer, NULL);
+
+    if (stats.count < events) {
+        printf("%s: loop ended after %u of %u events\n", name, stats.count, events);
+        return -1;
+    }
+
+    qsort(stats.latency, stats.count, sizeof stats.latency[0], compare_double);
+    for (i = 0; i < stats.count; i++) {
+        sum += stats.latency[i];
+    }
+
+    printf("%-7s latency us: avg %7.1f  p50 %7.1f  p99 %7.1f  max %7.1f  "
+        "wakeups/s %6.0f  loop cpu %5.1f ms/s\n", name,
+        sum / stats.count, stats.latency[stats.count / 2],
+        stats.latency[stats.count * 99 / 100], stats.latency[stats.count - 1],
+        stats.wakeups / ((now_ns() - start) / 1e9),
+        stats.cpu_time / ((now_ns() - start) / 1e9));
+
+    close(event_fd);
+    free(stats.latency);
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 500;
+
+    if (count < 1) {
+        printf("Usage: %s [events]\n", argv[0]);
+        return 1;
+    }
+    events = count;
+
+    printf("%u events, 2-20 ms apart\n", events);
+
+    if (loop_run("select", loop_select) < 0 || loop_run("epoll", loop_epoll) < 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -34,15 +34,25 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  */
 
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -58,14 +68,54 @@
 #include <linux/videodev2.h>
 #include <linux/fb.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RGB2YUYV_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RGB2YUYV_NEON
+#endif
+
+#if defined(__arm__) && defined(RGB2YUYV_NEON)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<drm/drm.h>) && __has_include(<drm/drm_fourcc.h>)
+#include <drm/drm.h>
+#include <drm/drm_fourcc.h>
+#include <linux/dma-buf.h>
+#ifdef DRM_IOCTL_MODE_GETFB2
+#define DRM_CAPTURE
+#endif
+#endif
+#endif
+
 #include "uvc-gadget.h"
 
 volatile sig_atomic_t terminate = 0;
 
-void term(int signum)
+static double monotonic_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static unsigned long long elapsed_ns(struct timespec * start, struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+/* Counts a processed buffer for -x, the pipeline threads count concurrently with the printer */
+static void uvc_count_buffer(unsigned long long process_time_ns)
 {
-    (void)(signum); /* avoid warning: unused parameter 'signum' */
-    terminate = 1;
+    __atomic_fetch_add(&gadget->uvc_dev.buffers_processed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&gadget->uvc_dev.process_time_ns, process_time_ns, __ATOMIC_RELAXED);
 }
 
 static int sys_gpio_write(unsigned int type, char pin[], char value[])
@@ -142,26 +192,26 @@ static int sys_led_write(unsigned int type, char value[])
 static void streaming_status_enable()
 {
     int ret;
-    if (!settings.streaming_status_enabled && settings.streaming_status_pin) {
-        ret = sys_gpio_write(GPIO_EXPORT, settings.streaming_status_pin, NULL);
+    if (!gadget->settings.streaming_status_enabled && gadget->settings.streaming_status_pin) {
+        ret = sys_gpio_write(GPIO_EXPORT, gadget->settings.streaming_status_pin, NULL);
         if (ret < 0) {
             return;
         }
 
-        ret = sys_gpio_write(GPIO_DIRECTION, settings.streaming_status_pin, GPIO_DIRECTION_OUT);
+        ret = sys_gpio_write(GPIO_DIRECTION, gadget->settings.streaming_status_pin, GPIO_DIRECTION_OUT);
         if (ret < 0) {
             return;
         }
 
-        ret = sys_gpio_write(GPIO_VALUE, settings.streaming_status_pin, GPIO_VALUE_OFF);
+        ret = sys_gpio_write(GPIO_VALUE, gadget->settings.streaming_status_pin, GPIO_VALUE_OFF);
         if (ret < 0) {
             return;
         }
 
-        settings.streaming_status_enabled = true;
+        gadget->settings.streaming_status_enabled = true;
     }
 
-    if (settings.streaming_status_onboard) {
+    if (gadget->settings.streaming_status_onboard) {
         ret = sys_led_write(LED_TRIGGER, LED_TRIGGER_NONE);
         if (ret < 0) {
             return;
@@ -171,7 +221,7 @@ static void streaming_status_enable()
         if (ret < 0) {
             return;
         }
-        settings.streaming_status_onboard_enabled = true;
+        gadget->settings.streaming_status_onboard_enabled = true;
     }
     return;
 }
@@ -181,11 +231,11 @@ static void streaming_status_value(bool state)
     char * gpio_value = (state) ? GPIO_VALUE_ON : GPIO_VALUE_OFF;
     char * led_value = (state) ? LED_BRIGHTNESS_HIGH : LED_BRIGHTNESS_LOW;
 
-    if (settings.streaming_status_enabled) {
-        sys_gpio_write(GPIO_VALUE, settings.streaming_status_pin, gpio_value);
+    if (gadget->settings.streaming_status_enabled) {
+        sys_gpio_write(GPIO_VALUE, gadget->settings.streaming_status_pin, gpio_value);
     }
 
-    if (settings.streaming_status_onboard_enabled) {
+    if (gadget->settings.streaming_status_onboard_enabled) {
         sys_led_write(LED_BRIGHTNESS, led_value);
     }
 }
@@ -273,6 +323,12 @@ static unsigned int get_frame_size(int pixelformat, int width, int height)
     case V4L2_PIX_FMT_MJPEG:
         return width * height;
         break;
+
+    case V4L2_PIX_FMT_NV12:
+        return width * height * 3 / 2;
+
+    case V4L2_PIX_FMT_H264:
+        return width * height;
     }
 
     return width * height;
@@ -285,13 +341,13 @@ static int v4l2_open(char * devname, unsigned int nbufs)
 
     printf("%s: Opening %s device\n", type_name, devname);
 
-    v4l2_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (v4l2_dev.fd == -1) {
+    gadget->v4l2_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (gadget->v4l2_dev.fd == -1) {
         printf("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
         return -EINVAL;
     }
 
-    if (ioctl(v4l2_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
         printf("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
         goto err;
     }
@@ -308,16 +364,16 @@ static int v4l2_open(char * devname, unsigned int nbufs)
 
     printf("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
 
-    v4l2_dev.device_type      = DEVICE_TYPE_UVC;
-    v4l2_dev.device_type_name = type_name;
-    v4l2_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_dev.memory_type      = V4L2_MEMORY_MMAP;
-    v4l2_dev.nbufs            = nbufs;
+    gadget->v4l2_dev.device_type      = DEVICE_TYPE_UVC;
+    gadget->v4l2_dev.device_type_name = type_name;
+    gadget->v4l2_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    gadget->v4l2_dev.memory_type      = V4L2_MEMORY_MMAP;
+    gadget->v4l2_dev.nbufs            = nbufs;
     return 1;
 
 err:
-    close(v4l2_dev.fd);
-    v4l2_dev.fd = -1;
+    close(gadget->v4l2_dev.fd);
+    gadget->v4l2_dev.fd = -1;
     return -EINVAL;
 }
 
@@ -328,13 +384,13 @@ static int uvc_open( char * devname, unsigned int nbufs)
 
     printf("%s: Opening %s device\n", type_name, devname);
 
-    uvc_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (uvc_dev.fd == -1) {
+    gadget->uvc_dev.fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (gadget->uvc_dev.fd == -1) {
         printf("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
         return -EINVAL;
     }
 
-    if (ioctl(uvc_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
+    if (ioctl(gadget->uvc_dev.fd, VIDIOC_QUERYCAP, &cap) < 0) {
         printf("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
         goto err;
     }
@@ -346,25 +402,26 @@ static int uvc_open( char * devname, unsigned int nbufs)
 
     printf("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
 
-    uvc_dev.device_type      = DEVICE_TYPE_UVC;
-    uvc_dev.device_type_name = type_name;
-    uvc_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    uvc_dev.memory_type      = V4L2_MEMORY_USERPTR;
-    uvc_dev.nbufs            = nbufs;
+    gadget->uvc_dev.device_type      = DEVICE_TYPE_UVC;
+    gadget->uvc_dev.device_type_name = type_name;
+    gadget->uvc_dev.buffer_type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    gadget->uvc_dev.memory_type      = V4L2_MEMORY_USERPTR;
+    gadget->uvc_dev.nbufs            = nbufs;
     return 1;
 
 err:
-    close(uvc_dev.fd);
-    uvc_dev.fd = -1;
+    close(gadget->uvc_dev.fd);
+    gadget->uvc_dev.fd = -1;
     return -EINVAL;
 }
 
 static void fb_show_info()
 {
-    printf("FB: Resolution: %dx%d\n", fb_dev.fb_width, fb_dev.fb_height);
-    printf("FB: Bits per pixel: %d\n", fb_dev.fb_bpp);
-    printf("FB: Line length: %d\n", fb_dev.fb_line_length);
-    printf("FB: Memory size: %d\n", fb_dev.fb_mem_size);
+    printf("FB: Resolution: %dx%d\n", gadget->fb_dev.fb_width, gadget->fb_dev.fb_height);
+    printf("FB: Bits per pixel: %d\n", gadget->fb_dev.fb_bpp);
+    printf("FB: Virtual height: %d\n", gadget->fb_dev.fb_yres_virtual);
+    printf("FB: Line length: %d\n", gadget->fb_dev.fb_line_length);
+    printf("FB: Memory size: %d\n", gadget->fb_dev.fb_mem_size);
 }
 
 static int fb_get_settings()
@@ -372,22 +429,26 @@ static int fb_get_settings()
     struct fb_var_screeninfo fb_info;
     struct fb_fix_screeninfo mode_info;
 
-    if (ioctl(fb_dev.fd, FBIOGET_VSCREENINFO, &fb_info) < 0) {
+    if (ioctl(gadget->fb_dev.fd, FBIOGET_VSCREENINFO, &fb_info) < 0) {
         printf("FB: Can't get framebuffer info: %s (%d).\n", strerror(errno), errno);
         return -EINVAL;
     }
 
-    if (ioctl(fb_dev.fd, FBIOGET_FSCREENINFO, &mode_info)) {
+    if (ioctl(gadget->fb_dev.fd, FBIOGET_FSCREENINFO, &mode_info)) {
         printf("FB: Can't get framebuffer screen info: %s (%d).\n", strerror(errno), errno);
         return -EINVAL;
     }
 
-    fb_dev.fb_screen_size = fb_info.xres * fb_info.yres * fb_info.bits_per_pixel / 8;
-    fb_dev.fb_mem_size    = mode_info.smem_len;
-    fb_dev.fb_bpp         = fb_info.bits_per_pixel;
-    fb_dev.fb_line_length = mode_info.line_length;
-    fb_dev.fb_width       = fb_info.xres;
-    fb_dev.fb_height      = fb_info.yres;
+    gadget->fb_dev.fb_screen_size = fb_info.xres * fb_info.yres * fb_info.bits_per_pixel / 8;
+    gadget->fb_dev.fb_mem_size    = mode_info.smem_len;
+    gadget->fb_dev.fb_bpp         = fb_info.bits_per_pixel;
+    gadget->fb_dev.fb_line_length = mode_info.line_length;
+    gadget->fb_dev.fb_width       = fb_info.xres;
+    gadget->fb_dev.fb_height      = fb_info.yres;
+    gadget->fb_dev.fb_yres_virtual = fb_info.yres_virtual;
+
+    /* little-endian pixels: blue in the low bits puts it in byte 0 */
+    gadget->fb_dev.fb_bgr = fb_info.bits_per_pixel >= 24 && fb_info.blue.offset < fb_info.red.offset;
 
     fb_show_info();
     return 1;
@@ -397,13 +458,13 @@ static int fb_open(char * devname)
 {
     printf("FB: Opening %s device\n", devname);
 
-    fb_dev.fd = open(devname, O_RDWR);
-    if (fb_dev.fd < 0) {
+    gadget->fb_dev.fd = open(devname, O_RDWR);
+    if (gadget->fb_dev.fd < 0) {
         printf("FB: Device open failed: %s (%d).\n", strerror(errno), errno);
         goto err;
     }
 
-    fb_dev.device_type = DEVICE_TYPE_FRAMEBUFFER;
+    gadget->fb_dev.device_type = DEVICE_TYPE_FRAMEBUFFER;
 
     if (fb_get_settings() < 0) {
         goto err;
@@ -412,845 +473,5672 @@ static int fb_open(char * devname)
     return 1;
 
 err:
-    close(fb_dev.fd);
-    fb_dev.fd = -1;
+    close(gadget->fb_dev.fd);
+    gadget->fb_dev.fd = -1;
     return -EINVAL;
 }
 
-static int fb_mmap_open() 
-{
-    fb_dev.fb_memory = mmap(0,
-        fb_dev.fb_mem_size, PROT_READ | PROT_WRITE,
-        MAP_SHARED,
-        fb_dev.fd,
-        0
-    );
-    if (fb_dev.fb_memory == MAP_FAILED) {
-        printf("FB: Can't get framebuffer mmap: %s (%d).\n", strerror(errno), errno);
-        fb_dev.fb_memory = NULL;
-        return -EINVAL;
-    }
-
-    return 1;
-}
-
-static void fb_mmap_close() 
-{
-    if (fb_dev.fb_memory) {
-        munmap(fb_dev.fb_memory, 0);
-        fb_dev.fb_memory = NULL;
-    }
-}
-
 /* ---------------------------------------------------------------------------
- * V4L2 streaming related
+ * DRM/KMS screen capture
+ *
+ * The framebuffer scanned out by the first active CRTC is exported as a
+ * dma-buf and frames are converted straight from its mapping. Geometry and
+ * pixel format are published in fb_dev, so the conversion path is shared
+ * with the fbdev source.
  */
 
-static void v4l2_uninit_device()
+#ifdef DRM_CAPTURE
+
+struct drm_pixel_format {
+    uint32_t fourcc;
+    unsigned int bpp;
+    bool bgr;
+    const char * name;
+};
+
+static const struct drm_pixel_format drm_pixel_formats[] = {
+    { DRM_FORMAT_XRGB8888, 32, true,  "XRGB8888" },
+    { DRM_FORMAT_ARGB8888, 32, true,  "ARGB8888" },
+    { DRM_FORMAT_XBGR8888, 32, false, "XBGR8888" },
+    { DRM_FORMAT_ABGR8888, 32, false, "ABGR8888" },
+    { DRM_FORMAT_BGR888,   24, false, "BGR888" },
+    { DRM_FORMAT_RGB888,   24, true,  "RGB888" },
+    { DRM_FORMAT_RGB565,   16, false, "RGB565" },
+};
+
+static const struct drm_pixel_format * drm_get_pixel_format(uint32_t fourcc)
 {
     unsigned int i;
-    if (!v4l2_dev.mem) {
-        return;
-    }
-    printf("%s: Uninit device\n", v4l2_dev.device_type_name);
 
-    for (i = 0; i < v4l2_dev.nbufs; ++i) {
-        if (munmap(v4l2_dev.mem[i].start, v4l2_dev.mem[i].length) < 0) {
-            printf("%s: munmap failed\n", v4l2_dev.device_type_name);
-            return;
+    for (i = 0; i < ARRAY_SIZE(drm_pixel_formats); i++) {
+        if (drm_pixel_formats[i].fourcc == fourcc) {
+            return &drm_pixel_formats[i];
         }
     }
-    free(v4l2_dev.mem);
-    v4l2_dev.mem = NULL;
+    return NULL;
 }
 
-static void uvc_uninit_device()
+static int drm_find_crtc()
 {
+    struct drm_mode_card_res res;
+    struct drm_mode_crtc crtc;
+    uint32_t * crtc_ids = NULL;
     unsigned int i;
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER && uvc_dev.dummy_buf) {
-        printf("%s: Uninit device\n", uvc_dev.device_type_name);
+    int ret = -EINVAL;
 
-        for (i = 0; i < uvc_dev.nbufs; ++i) {
-            free(uvc_dev.dummy_buf[i].start);
-            uvc_dev.dummy_buf[i].start = NULL;
-        }
-        free(uvc_dev.dummy_buf);
-        uvc_dev.dummy_buf = NULL;
+    CLEAR(res);
+    if (ioctl(gadget->fb_dev.fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+        printf("DRM: Can't get resources: %s (%d).\n", strerror(errno), errno);
+        return -EINVAL;
     }
-}
 
-static int v4l2_video_stream_control(struct v4l2_device * dev, enum video_stream_action action)
-{
-    int type = dev->buffer_type;
-    int ret;
+    crtc_ids = calloc(res.count_crtcs, sizeof(* crtc_ids));
+    if (!crtc_ids) {
+        return -ENOMEM;
+    }
 
-    if (action == STREAM_ON) {
-        ret = ioctl(dev->fd, VIDIOC_STREAMON, &type);
-        if (ret < 0) {
-            printf("%s: STREAM ON failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
-            return ret;
-        }
+    res.count_fbs        = 0;
+    res.count_connectors = 0;
+    res.count_encoders   = 0;
+    res.crtc_id_ptr      = (uintptr_t) crtc_ids;
 
-        printf("%s: STREAM ON success\n", dev->device_type_name);
-        dev->is_streaming = 1;
-        uvc_shutdown_requested = false;
+    if (ioctl(gadget->fb_dev.fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+        printf("DRM: Can't get CRTCs: %s (%d).\n", strerror(errno), errno);
+        goto done;
+    }
 
-    } else if (dev->is_streaming) {
-        ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &type);
-        if (ret < 0) {
-            printf("%s: STREAM OFF failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
-            return ret;
+    for (i = 0; i < res.count_crtcs; i++) {
+        CLEAR(crtc);
+        crtc.crtc_id = crtc_ids[i];
+
+        if (ioctl(gadget->fb_dev.fd, DRM_IOCTL_MODE_GETCRTC, &crtc) < 0) {
+            continue;
         }
 
-        printf("%s: STREAM OFF success\n", dev->device_type_name);
-        dev->is_streaming = 0;
+        if (crtc.mode_valid && crtc.fb_id) {
+            gadget->drm_capture.crtc_id    = crtc.crtc_id;
+            gadget->drm_capture.crtc_index = i;
+            printf("DRM: Capturing CRTC %u (%s)\n", crtc.crtc_id, crtc.mode.name);
+            ret = 0;
+            goto done;
+        }
     }
-    return 0;
+    printf("DRM: No active CRTC found\n");
+
+done:
+    free(crtc_ids);
+    return ret;
 }
 
-static int v4l2_video_stream(enum video_stream_action action)
+static int drm_get_framebuffer(uint32_t fb_id, struct drm_mode_fb_cmd2 * fb)
 {
-    return v4l2_video_stream_control(&v4l2_dev, action);
+    CLEAR(* fb);
+    fb->fb_id = fb_id;
+
+    if (ioctl(gadget->fb_dev.fd, DRM_IOCTL_MODE_GETFB2, fb) < 0) {
+        printf("DRM: Can't get framebuffer %u: %s (%d).\n", fb_id, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    if (!fb->handles[0]) {
+        printf("DRM: No buffer handle for framebuffer %u, run as root\n", fb_id);
+        return -EINVAL;
+    }
+    return 0;
 }
 
-static int uvc_video_stream(enum video_stream_action action)
+static void drm_close_handle(uint32_t handle)
 {
-    return v4l2_video_stream_control(&uvc_dev, action);
+    struct drm_gem_close gem_close;
+
+    CLEAR(gem_close);
+    gem_close.handle = handle;
+    ioctl(gadget->fb_dev.fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
 }
 
-static int v4l2_init_buffers(struct v4l2_device * dev, struct v4l2_requestbuffers * req,
-    unsigned int count)
+static uint32_t drm_get_scanout_fb()
 {
-    int ret;
-    req->count  = count;
-    req->type   = dev->buffer_type;
-    req->memory = dev->memory_type;
-
-    ret = ioctl(dev->fd, VIDIOC_REQBUFS, req);
-    if (ret < 0) {
-        if (ret == -EINVAL) {
-            printf("%s: Does not support %s\n", dev->device_type_name,
-                (dev->memory_type == V4L2_MEMORY_USERPTR) ? "user pointer i/o" : "memory mapping");
+    struct drm_mode_crtc crtc;
 
-        } else {
-            printf("%s: VIDIOC_REQBUFS error: %s (%d).\n",
-                dev->device_type_name, strerror(errno), errno);
+    CLEAR(crtc);
+    crtc.crtc_id = gadget->drm_capture.crtc_id;
 
-        }
-        return ret;
+    if (ioctl(gadget->fb_dev.fd, DRM_IOCTL_MODE_GETCRTC, &crtc) < 0) {
+        return 0;
     }
-    return count;
+    return crtc.fb_id;
 }
 
-static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffers req)
+static int drm_get_settings()
 {
-    int ret;
-    unsigned int i = 0;
+    const struct drm_pixel_format * format;
+    struct drm_mode_fb_cmd2 fb;
+    int ret = -EINVAL;
 
-    /* Map the buffers. */
-    dev->mem = calloc(req.count, sizeof dev->mem[0]);
-    if (!dev->mem) {
-        printf("%s: Out of memory\n", dev->device_type_name);
-        ret = -ENOMEM;
-        goto err;
+    if (drm_find_crtc() < 0) {
+        return -EINVAL;
     }
 
-    for (i = 0; i < req.count; ++i) {
-        CLEAR(dev->mem[i].buf);
+    if (drm_get_framebuffer(drm_get_scanout_fb(), &fb) < 0) {
+        return -EINVAL;
+    }
 
-        dev->mem[i].buf.type   = dev->buffer_type;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index  = i;
+    format = drm_get_pixel_format(fb.pixel_format);
+    if (!format) {
+        printf("DRM: Unsupported pixel format %c%c%c%c\n", pixfmtstr(fb.pixel_format));
+        goto done;
+    }
 
-        ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf("%s: VIDIOC_QUERYBUF failed for buf %d: %s (%d).\n",
-                dev->device_type_name, i, strerror(errno), errno);
+    if ((fb.flags & DRM_MODE_FB_MODIFIERS) && fb.modifier[0] != DRM_FORMAT_MOD_LINEAR) {
+        printf("DRM: Tiled framebuffer (modifier 0x%llx) not supported\n",
+            (unsigned long long) fb.modifier[0]);
+        goto done;
+    }
 
-            ret = -EINVAL;
-            goto err_free;
-        }
+    gadget->drm_capture.pixel_format = fb.pixel_format;
 
-        dev->mem[i].start =
-            mmap(NULL /* start anywhere */,
-                dev->mem[i].buf.length,
-                PROT_READ | PROT_WRITE /* required */,
-                MAP_SHARED /* recommended */,
-                dev->fd, dev->mem[i].buf.m.offset
-            );
+    gadget->fb_dev.fb_bpp          = format->bpp;
+    gadget->fb_dev.fb_bgr          = format->bgr;
+    gadget->fb_dev.fb_width        = fb.width;
+    gadget->fb_dev.fb_height       = fb.height;
+    gadget->fb_dev.fb_yres_virtual = fb.height;
+    gadget->fb_dev.fb_line_length  = fb.pitches[0];
+    gadget->fb_dev.fb_screen_size  = fb.pitches[0] * fb.height;
+    gadget->fb_dev.fb_mem_size     = gadget->fb_dev.fb_screen_size;
 
-        if (MAP_FAILED == dev->mem[i].start) {
-            printf("%s: Unable to map buffer %u: %s (%d).\n",
-                dev->device_type_name, i, strerror(errno), errno);
+    printf("DRM: Pixel format: %s\n", format->name);
+    fb_show_info();
+    ret = 0;
 
-            dev->mem[i].length = 0;
-            ret = -EINVAL;
-            goto err_free;
-        }
+done:
+    drm_close_handle(fb.handles[0]);
+    return ret;
+}
 
-        dev->mem[i].length = dev->mem[i].buf.length;
-        printf("%s: Buffer %u mapped at address %p, length %d.\n",
-            dev->device_type_name, i, dev->mem[i].start, dev->mem[i].length);
+static void drm_unmap_buffer(struct drm_scanout_buffer * buffer)
+{
+    if (buffer->memory) {
+        munmap(buffer->memory, buffer->size);
     }
-
-    return 0;
-
-err_free:
-    free(dev->mem);
-err:
-    return ret;
+    if (buffer->dmabuf_fd >= 0) {
+        close(buffer->dmabuf_fd);
+    }
+    CLEAR(* buffer);
+    buffer->dmabuf_fd = -1;
 }
 
-static int v4l2_reqbufs_userptr(struct v4l2_device * dev, struct v4l2_requestbuffers req)
+static void drm_unmap_buffers()
 {
-    unsigned int payload_size;
     unsigned int i;
 
-    if (dev->device_type == DEVICE_TYPE_UVC && settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        /* Allocate buffers to hold dummy data pattern. */
-        dev->dummy_buf = calloc(req.count, sizeof dev->dummy_buf[0]);
-        if (!dev->dummy_buf) {
-            printf("%s: Out of memory\n", dev->device_type_name);
-            return -ENOMEM;
-        }
-
-        payload_size = fb_dev.fb_width * fb_dev.fb_height * 2;
-
-        for (i = 0; i < req.count; ++i) {
-            dev->dummy_buf[i].length = payload_size;
-            dev->dummy_buf[i].start  = malloc(payload_size);
-            if (!dev->dummy_buf[i].start) {
-                printf("%s: Out of memory\n", dev->device_type_name);
-                return -ENOMEM;
-            }
-        }
-
-        dev->mem = dev->dummy_buf;
-
+    for (i = 0; i < DRM_MAX_SCANOUT_BUFFERS; i++) {
+        drm_unmap_buffer(&gadget->drm_capture.buffers[i]);
     }
-    return 0;
+    gadget->drm_capture.next_buffer = 0;
+    gadget->drm_capture.current = NULL;
 }
 
-static int v4l2_reqbufs(struct v4l2_device * dev, int nbufs)
+/*
+ * Page flipping clients scan out a few framebuffers in turn, the mappings
+ * of the last DRM_MAX_SCANOUT_BUFFERS ones are kept.
+ */
+static struct drm_scanout_buffer * drm_map_buffer(uint32_t fb_id)
 {
-    int ret = 0;
-    struct v4l2_requestbuffers req;
-    CLEAR(req);
+    struct drm_scanout_buffer * buffer;
+    struct drm_prime_handle prime;
+    struct drm_mode_fb_cmd2 fb;
+    off_t size;
+    unsigned int i;
 
-    dev->dqbuf_count = 0;
-    dev->qbuf_count = 0;
+    for (i = 0; i < DRM_MAX_SCANOUT_BUFFERS; i++) {
+        if (gadget->drm_capture.buffers[i].fb_id == fb_id && gadget->drm_capture.buffers[i].memory) {
+            return &gadget->drm_capture.buffers[i];
+        }
+    }
 
-    ret = v4l2_init_buffers(dev, &req, nbufs);
-    if (ret < 1) {
-        return ret;
+    if (drm_get_framebuffer(fb_id, &fb) < 0) {
+        return NULL;
     }
 
-    if (!req.count) {
-        return 0;
+    if (fb.width != gadget->fb_dev.fb_width || fb.height != gadget->fb_dev.fb_height ||
+        fb.pixel_format != gadget->drm_capture.pixel_format || fb.pitches[0] != gadget->fb_dev.fb_line_length
+    ) {
+        printf("DRM: Framebuffer %u geometry changed, frame skipped\n", fb_id);
+        drm_close_handle(fb.handles[0]);
+        return NULL;
     }
 
-    if (dev->memory_type == V4L2_MEMORY_MMAP) {
-        if (req.count < 2) {
-            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
-            return -EINVAL;
-        }
+    buffer = &gadget->drm_capture.buffers[gadget->drm_capture.next_buffer];
+    gadget->drm_capture.next_buffer = (gadget->drm_capture.next_buffer + 1) % DRM_MAX_SCANOUT_BUFFERS;
+    drm_unmap_buffer(buffer);
 
-        ret = v4l2_reqbufs_mmap(dev, req);
-        if (ret < 0) {
-            return -EINVAL;
-        }
+    CLEAR(prime);
+    prime.handle = fb.handles[0];
+    prime.flags  = DRM_CLOEXEC;
+
+    if (ioctl(gadget->fb_dev.fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime) < 0) {
+        printf("DRM: Can't export framebuffer %u: %s (%d).\n", fb_id, strerror(errno), errno);
+        drm_close_handle(fb.handles[0]);
+        return NULL;
     }
+    drm_close_handle(fb.handles[0]);
+    buffer->dmabuf_fd = prime.fd;
 
-    if (dev->memory_type == V4L2_MEMORY_USERPTR && settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        if (req.count < 2) {
-            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
-            return -EINVAL;
-        }
+    size = lseek(prime.fd, 0, SEEK_END);
+    if (size < (off_t) (fb.offsets[0] + gadget->fb_dev.fb_screen_size)) {
+        printf("DRM: Framebuffer %u dma-buf too small\n", fb_id);
+        goto err;
+    }
 
-        ret = v4l2_reqbufs_userptr(dev, req);
-        if (ret < 0) {
-            return -EINVAL;
-        }
+    buffer->memory = mmap(0, size, PROT_READ, MAP_SHARED, prime.fd, 0);
+    if (buffer->memory == MAP_FAILED) {
+        printf("DRM: Can't map framebuffer %u: %s (%d).\n", fb_id, strerror(errno), errno);
+        buffer->memory = NULL;
+        goto err;
     }
 
-    dev->nbufs = req.count;
-    printf("%s: %u buffers allocated.\n", dev->device_type_name, req.count);
+    buffer->fb_id  = fb_id;
+    buffer->size   = size;
+    buffer->offset = fb.offsets[0];
+    return buffer;
 
-    return ret;
+err:
+    drm_unmap_buffer(buffer);
+    return NULL;
 }
 
-static int v4l2_request_bufs(int nbufs)
+/* Returns the pixels of the framebuffer being scanned out, NULL to skip the frame */
+static const uint8_t * drm_scanout_memory()
 {
-    return v4l2_reqbufs(&v4l2_dev, nbufs);
+    struct drm_scanout_buffer * buffer;
+    struct dma_buf_sync sync;
+    uint32_t fb_id = drm_get_scanout_fb();
+
+    if (!fb_id) {
+        return NULL;
+    }
+
+    buffer = drm_map_buffer(fb_id);
+    if (!buffer) {
+        return NULL;
+    }
+
+    CLEAR(sync);
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    ioctl(buffer->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    gadget->drm_capture.current = buffer;
+    return (const uint8_t *) buffer->memory + buffer->offset;
 }
 
-static int uvc_request_bufs(int nbufs)
+static void drm_scanout_done()
 {
-    return v4l2_reqbufs(&uvc_dev, nbufs);
+    struct dma_buf_sync sync;
+
+    if (!gadget->drm_capture.current) {
+        return;
+    }
+
+    CLEAR(sync);
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(gadget->drm_capture.current->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    gadget->drm_capture.current = NULL;
 }
 
-static int uvc_video_qbuf()
+/* With 'event' the call returns at once and the vblank is read from the fd later */
+static int drm_wait_vblank(bool event)
 {
-    unsigned int i;
-    int ret;
+    union drm_wait_vblank vblank;
+
+    CLEAR(vblank);
+    vblank.request.type = _DRM_VBLANK_RELATIVE | ((event) ? _DRM_VBLANK_EVENT : 0);
+    if (gadget->drm_capture.crtc_index == 1) {
+        vblank.request.type |= _DRM_VBLANK_SECONDARY;
+    } else if (gadget->drm_capture.crtc_index > 1) {
+        vblank.request.type |= (gadget->drm_capture.crtc_index << _DRM_VBLANK_HIGH_CRTC_SHIFT) &
+            _DRM_VBLANK_HIGH_CRTC_MASK;
+    }
+    vblank.request.sequence = 1;
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        for (i = 0; i < uvc_dev.nbufs; ++i) {
-            struct v4l2_buffer buf;
+    return ioctl(gadget->fb_dev.fd, DRM_IOCTL_WAIT_VBLANK, &vblank);
+}
 
-            CLEAR(buf);
-            buf.type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-            buf.memory    = V4L2_MEMORY_USERPTR;
-            buf.m.userptr = (unsigned long) uvc_dev.dummy_buf[i].start;
-            buf.length    = uvc_dev.dummy_buf[i].length;
-            buf.index     = i;
+/* Returns 1 when a vblank event was read, 0 for none */
+static int drm_read_vblank()
+{
+    uint8_t events[1024];
+    struct drm_event * event;
+    ssize_t size;
+    ssize_t offset;
+    int ret = 0;
 
-            ret = ioctl(uvc_dev.fd, VIDIOC_QBUF, &buf);
-            if (ret < 0) {
-                printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
-                return ret;
-            }
+    size = read(gadget->fb_dev.fd, events, sizeof events);
+    if (size < 0) {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
 
-            uvc_dev.qbuf_count++;
+    for (offset = 0; offset + (ssize_t) sizeof * event <= size; offset += event->length) {
+        event = (struct drm_event *) (events + offset);
+        if (event->type == DRM_EVENT_VBLANK) {
+            ret = 1;
+        }
+        if (!event->length) {
+            break;
         }
     }
-    return 0;
+    return ret;
 }
 
-static int v4l2_qbuf_mmap(struct v4l2_device * dev)
+static int drm_open(char * devname)
 {
     unsigned int i;
-    int ret;
-
-    for (i = 0; i < dev->nbufs; ++i) {
-        CLEAR(dev->mem[i].buf);
 
-        dev->mem[i].buf.type   = dev->buffer_type;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index  = i;
+    printf("DRM: Opening %s device\n", devname);
 
-        ret = ioctl(dev->fd, VIDIOC_QBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf("%s: VIDIOC_QBUF failed : %s (%d).\n",
-                dev->device_type_name, strerror(errno), errno);
+    CLEAR(gadget->drm_capture);
+    for (i = 0; i < DRM_MAX_SCANOUT_BUFFERS; i++) {
+        gadget->drm_capture.buffers[i].dmabuf_fd = -1;
+    }
 
-            return ret;
-        }
-        dev->qbuf_count++;
+    gadget->fb_dev.fd = open(devname, O_RDWR | O_CLOEXEC);
+    if (gadget->fb_dev.fd < 0) {
+        printf("DRM: Device open failed: %s (%d).\n", strerror(errno), errno);
+        goto err;
     }
-    return 0;
-}
 
-static void v4l2_uvc_video_process()
-{
-    struct v4l2_buffer vbuf;
-    struct v4l2_buffer ubuf;
+    gadget->fb_dev.device_type = DEVICE_TYPE_DRM;
 
-    if (uvc_dev.is_streaming && v4l2_dev.dqbuf_count >= v4l2_dev.qbuf_count) {
-        return;
+    if (drm_get_settings() < 0) {
+        goto err;
     }
 
-    /* Dequeue spent buffer from V4L2 domain. */
-    CLEAR(vbuf);
-    vbuf.type   = v4l2_dev.buffer_type;
-    vbuf.memory = v4l2_dev.memory_type;
+    return 1;
+
+err:
+    close(gadget->fb_dev.fd);
+    gadget->fb_dev.fd = -1;
+    return -EINVAL;
+}
+
+#else
+
+static int drm_open(char * devname)
+{
+    printf("DRM: Can't open %s, built without DRM headers\n", devname);
+    return -EINVAL;
+}
+
+#endif /* DRM_CAPTURE */
+
+static int fb_mmap_open() 
+{
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        /* scanout buffers are mapped on first use */
+        gadget->fb_damage.valid = false;
+        return 1;
+    }
+
+    gadget->fb_dev.fb_memory = mmap(0,
+        gadget->fb_dev.fb_mem_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        gadget->fb_dev.fd,
+        0
+    );
+    if (gadget->fb_dev.fb_memory == MAP_FAILED) {
+        printf("FB: Can't get framebuffer mmap: %s (%d).\n", strerror(errno), errno);
+        gadget->fb_dev.fb_memory = NULL;
+        return -EINVAL;
+    }
+
+    gadget->fb_damage.valid = false;
+    return 1;
+}
+
+static void fb_mmap_close() 
+{
+#ifdef DRM_CAPTURE
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        drm_unmap_buffers();
+        return;
+    }
+#endif
+
+    if (gadget->fb_dev.fb_memory) {
+        munmap(gadget->fb_dev.fb_memory, 0);
+        gadget->fb_dev.fb_memory = NULL;
+    }
+}
+
+static int fb_vsync_ioctl()
+{
+    __u32 crtc = 0;
+
+#ifdef DRM_CAPTURE
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        return drm_wait_vblank(false);
+    }
+#endif
+    return ioctl(gadget->fb_dev.fd, FBIO_WAITFORVSYNC, &crtc);
+}
+
+/* Waits for every requested vsync of a framebuffer device, reports it on the eventfd */
+static void * fb_vsync_thread(void * arg)
+{
+    uint64_t value;
+
+    gadget = arg;
+
+    while (read(gadget->fb_vsync.request_fd, &value, sizeof value) == sizeof value &&
+        !__atomic_load_n(&gadget->fb_vsync.stop, __ATOMIC_ACQUIRE)
+    ) {
+        gadget->fb_vsync.error = (fb_vsync_ioctl() < 0) ? errno : 0;
+
+        value = 1;
+        if (write(gadget->fb_vsync.fd, &value, sizeof value) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void fb_vsync_uninit()
+{
+    uint64_t value = 1;
+
+    if (gadget->fb_vsync.started) {
+        __atomic_store_n(&gadget->fb_vsync.stop, true, __ATOMIC_RELEASE);
+        if (write(gadget->fb_vsync.request_fd, &value, sizeof value) < 0) {
+            printf("FB: Unable to stop vsync thread: %s (%d)\n", strerror(errno), errno);
+        }
+        pthread_join(gadget->fb_vsync.thread, NULL);
+        gadget->fb_vsync.started = false;
+    }
+
+    if (gadget->fb_vsync.request_fd >= 0) {
+        close(gadget->fb_vsync.request_fd);
+    }
+
+    /* the DRM device fd is closed with the device */
+    if (gadget->fb_vsync.fd >= 0 && gadget->fb_vsync.fd != gadget->fb_dev.fd) {
+        close(gadget->fb_vsync.fd);
+    }
+
+    gadget->fb_vsync.fd = -1;
+    gadget->fb_vsync.request_fd = -1;
+    gadget->fb_vsync.pending = false;
+}
+
+static void fb_vsync_init()
+{
+    int ret;
+
+    gadget->fb_dev.fb_vsync = false;
+    gadget->fb_vsync.fd = -1;
+    gadget->fb_vsync.request_fd = -1;
+    gadget->fb_vsync.pending = false;
+    gadget->fb_vsync.started = false;
+    gadget->fb_vsync.stop = false;
+
+    if (!gadget->settings.fb_vsync) {
+        return;
+    }
+
+    if (fb_vsync_ioctl() < 0) {
+        printf("FB: Wait for vsync not supported: %s (%d), using timer.\n",
+            strerror(errno), errno);
+        return;
+    }
+
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        gadget->fb_vsync.fd = gadget->fb_dev.fd;
+
+    } else {
+        gadget->fb_vsync.request_fd = eventfd(0, EFD_CLOEXEC);
+        gadget->fb_vsync.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (gadget->fb_vsync.request_fd < 0 || gadget->fb_vsync.fd < 0) {
+            printf("FB: Unable to create eventfd: %s (%d), using timer.\n", strerror(errno), errno);
+            fb_vsync_uninit();
+            return;
+        }
+
+        ret = pthread_create(&gadget->fb_vsync.thread, NULL, fb_vsync_thread, gadget);
+        if (ret) {
+            printf("FB: Unable to start vsync thread: %s (%d), using timer.\n", strerror(ret), ret);
+            fb_vsync_uninit();
+            return;
+        }
+        gadget->fb_vsync.started = true;
+    }
+
+    gadget->fb_dev.fb_vsync = true;
+    printf("FB: Capture aligned to vsync%s\n",
+        (gadget->fb_dev.fb_yres_virtual > gadget->fb_dev.fb_height) ? ", following panned page" : "");
+}
+
+static int fb_vsync_send_request()
+{
+    uint64_t value = 1;
+
+#ifdef DRM_CAPTURE
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        return drm_wait_vblank(true);
+    }
+#endif
+    return (write(gadget->fb_vsync.request_fd, &value, sizeof value) == sizeof value) ? 0 : -1;
+}
+
+static int fb_vsync_read_reply()
+{
+    uint64_t value;
+
+#ifdef DRM_CAPTURE
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        return drm_read_vblank();
+    }
+#endif
+    if (read(gadget->fb_vsync.fd, &value, sizeof value) != sizeof value) {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+
+    if (gadget->fb_vsync.error) {
+        errno = gadget->fb_vsync.error;
+        return -1;
+    }
+    return 1;
+}
+
+/* Asks for the next vsync, LOOP_VSYNC becomes readable when it happened */
+static int fb_vsync_request()
+{
+    if (gadget->fb_vsync.pending) {
+        return 0;
+    }
+
+    if (fb_vsync_send_request() < 0) {
+        printf("FB: Wait for vsync failed: %s (%d), using timer.\n", strerror(errno), errno);
+        gadget->fb_dev.fb_vsync = false;
+        return -EINVAL;
+    }
+    gadget->fb_vsync.pending = true;
+    return 0;
+}
+
+/*
+ * Reads the vsync reported on LOOP_VSYNC. Returns 1 when it happened, 0 when
+ * nothing was reported and -EINVAL when the wait failed, the timer paces the
+ * frames from then on.
+ */
+static int fb_vsync_complete()
+{
+    int ret = fb_vsync_read_reply();
+
+    if (ret == 0) {
+        return 0;
+    }
+    gadget->fb_vsync.pending = false;
+
+    if (ret < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        printf("FB: Wait for vsync failed: %s (%d), using timer.\n", strerror(errno), errno);
+        gadget->fb_dev.fb_vsync = false;
+        return -EINVAL;
+    }
+    return 1;
+}
+
+/*
+ * With panning double buffering the visible page is the one at the
+ * current x/y offset, read it instead of the start of the framebuffer.
+ */
+static const uint8_t * fb_scanout_memory()
+{
+    struct fb_var_screeninfo fb_info;
+    unsigned int offset;
+
+#ifdef DRM_CAPTURE
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        return drm_scanout_memory();
+    }
+#endif
+
+    if (gadget->fb_dev.fb_yres_virtual <= gadget->fb_dev.fb_height) {
+        return gadget->fb_dev.fb_memory;
+    }
+
+    if (ioctl(gadget->fb_dev.fd, FBIOGET_VSCREENINFO, &fb_info) < 0) {
+        return gadget->fb_dev.fb_memory;
+    }
+
+    offset = fb_info.yoffset * gadget->fb_dev.fb_line_length + fb_info.xoffset * (gadget->fb_dev.fb_bpp / 8);
+    if (offset + gadget->fb_dev.fb_height * gadget->fb_dev.fb_line_length > gadget->fb_dev.fb_mem_size) {
+        return gadget->fb_dev.fb_memory;
+    }
+
+    return (const uint8_t *) gadget->fb_dev.fb_memory + offset;
+}
+
+static void fb_scanout_done()
+{
+#ifdef DRM_CAPTURE
+    if (gadget->fb_dev.device_type == DEVICE_TYPE_DRM) {
+        drm_scanout_done();
+    }
+#endif
+}
+
+static int fb_damage_init()
+{
+    gadget->fb_damage.tiles_x = (gadget->fb_dev.fb_width + FB_TILE_WIDTH - 1) / FB_TILE_WIDTH;
+    gadget->fb_damage.tiles_y = (gadget->fb_dev.fb_height + FB_TILE_HEIGHT - 1) / FB_TILE_HEIGHT;
+    gadget->fb_damage.shadow  = malloc(gadget->fb_dev.fb_width * gadget->fb_dev.fb_height * (gadget->fb_dev.fb_bpp / 8));
+    gadget->fb_damage.yuyv    = malloc(gadget->fb_dev.fb_width * gadget->fb_dev.fb_height * 2);
+
+    if (!gadget->fb_damage.shadow || !gadget->fb_damage.yuyv) {
+        printf("FB: Out of memory for damage tracking\n");
+        free(gadget->fb_damage.shadow);
+        free(gadget->fb_damage.yuyv);
+        gadget->fb_damage.shadow = NULL;
+        gadget->fb_damage.yuyv = NULL;
+        return -ENOMEM;
+    }
+
+    gadget->fb_damage.enabled = true;
+    gadget->fb_damage.valid = false;
+
+    printf("FB: Damage tracking with %ux%u tiles of %ux%u pixels\n",
+        gadget->fb_damage.tiles_x, gadget->fb_damage.tiles_y, FB_TILE_WIDTH, FB_TILE_HEIGHT);
+    return 0;
+}
+
+static void fb_damage_uninit()
+{
+    gadget->fb_damage.enabled = false;
+    free(gadget->fb_damage.shadow);
+    free(gadget->fb_damage.yuyv);
+    gadget->fb_damage.shadow = NULL;
+    gadget->fb_damage.yuyv = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Single-producer/single-consumer rings
+ */
+
+/* Producer side, wakes the consumer thread through its eventfd */
+static bool pipeline_push(struct pipeline_ring * ring, unsigned int index, unsigned int value)
+{
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint64_t wake = 1;
+
+    if (head - tail == PIPELINE_RING_SIZE) {
+        return false;
+    }
+
+    ring->items[head % PIPELINE_RING_SIZE].index = index;
+    ring->items[head % PIPELINE_RING_SIZE].value = value;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (write(ring->wakefd, &wake, sizeof wake) < 0) {
+        printf("PIPELINE: Unable to wake thread: %s (%d)\n", strerror(errno), errno);
+    }
+    return true;
+}
+
+static bool pipeline_pop(struct pipeline_ring * ring, struct pipeline_item * item)
+{
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head) {
+        return false;
+    }
+
+    *item = ring->items[tail % PIPELINE_RING_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* ---------------------------------------------------------------------------
+ * V4L2 streaming related
+ */
+
+static void v4l2_dmabuf_close(struct v4l2_device * dev)
+{
+    unsigned int i;
+
+    if (!dev->dmabuf_exported) {
+        return;
+    }
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        if (dev->mem[i].dmabuf_fd >= 0) {
+            close(dev->mem[i].dmabuf_fd);
+            dev->mem[i].dmabuf_fd = -1;
+        }
+    }
+    dev->dmabuf_exported = false;
+}
+
+static int v4l2_dmabuf_export_buffer(struct v4l2_device * dev, unsigned int i)
+{
+    struct v4l2_exportbuffer expbuf;
+
+    CLEAR(expbuf);
+    expbuf.type  = dev->buffer_type;
+    expbuf.index = i;
+    expbuf.flags = O_CLOEXEC | O_RDONLY;
+
+    if (ioctl(dev->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+        printf("%s: Unable to export buffer %u as DMABUF: %s (%d).\n",
+            dev->device_type_name, i, strerror(errno), errno);
+
+        return -EINVAL;
+    }
+
+    dev->mem[i].dmabuf_fd = expbuf.fd;
+    return 0;
+}
+
+/*
+ * Exports mapped buffers as DMABUF file descriptors, so they can be queued to
+ * the UVC device without pinning user pages on every VIDIOC_QBUF.
+ */
+static void v4l2_dmabuf_export(struct v4l2_device * dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        if (v4l2_dmabuf_export_buffer(dev, i) < 0) {
+            dev->dmabuf_exported = true;
+            v4l2_dmabuf_close(dev);
+            return;
+        }
+    }
+
+    dev->dmabuf_exported = true;
+    printf("%s: %u buffers exported as DMABUF\n", dev->device_type_name, dev->nbufs);
+}
+
+static void v4l2_uninit_buffers(struct v4l2_device * dev)
+{
+    unsigned int i;
+    if (!dev->mem) {
+        return;
+    }
+    printf("%s: Uninit device\n", dev->device_type_name);
+
+    v4l2_dmabuf_close(dev);
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        if (munmap(dev->mem[i].start, dev->mem[i].length) < 0) {
+            printf("%s: munmap failed\n", dev->device_type_name);
+            return;
+        }
+    }
+    free(dev->mem);
+    dev->mem = NULL;
+}
+
+static void v4l2_uninit_device()
+{
+    v4l2_uninit_buffers(&gadget->v4l2_dev);
+}
+
+/* UVC buffers are allocated here, unless capture buffers are passed through */
+static bool uvc_owns_buffers()
+{
+    return gadget->settings.source_device != DEVICE_TYPE_V4L2 || gadget->v4l2_convert.enabled;
+}
+
+static void uvc_uninit_device()
+{
+    unsigned int i;
+    if (uvc_owns_buffers() && gadget->uvc_dev.memory_type == V4L2_MEMORY_MMAP && gadget->uvc_dev.mem) {
+        printf("%s: Uninit device\n", gadget->uvc_dev.device_type_name);
+
+        for (i = 0; i < gadget->uvc_dev.nbufs; ++i) {
+            if (munmap(gadget->uvc_dev.mem[i].start, gadget->uvc_dev.mem[i].length) < 0) {
+                printf("%s: munmap failed\n", gadget->uvc_dev.device_type_name);
+            }
+        }
+        free(gadget->uvc_dev.mem);
+        gadget->uvc_dev.mem = NULL;
+    }
+
+    if (uvc_owns_buffers() && gadget->uvc_dev.dummy_buf) {
+        printf("%s: Uninit device\n", gadget->uvc_dev.device_type_name);
+
+        for (i = 0; i < gadget->uvc_dev.nbufs; ++i) {
+            free(gadget->uvc_dev.dummy_buf[i].start);
+            gadget->uvc_dev.dummy_buf[i].start = NULL;
+        }
+        free(gadget->uvc_dev.dummy_buf);
+        gadget->uvc_dev.dummy_buf = NULL;
+        gadget->uvc_dev.mem = NULL;
+    }
+}
+
+static int v4l2_video_stream_control(struct v4l2_device * dev, enum video_stream_action action)
+{
+    int type = dev->buffer_type;
+    int ret;
+
+    if (action == STREAM_ON) {
+        ret = ioctl(dev->fd, VIDIOC_STREAMON, &type);
+        if (ret < 0) {
+            printf("%s: STREAM ON failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
+            return ret;
+        }
+
+        printf("%s: STREAM ON success\n", dev->device_type_name);
+        dev->is_streaming = 1;
+        gadget->uvc_shutdown_requested = false;
+        dev->frames_dropped = 0;
+
+    } else if (dev->is_streaming) {
+        ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &type);
+        if (ret < 0) {
+            printf("%s: STREAM OFF failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
+            return ret;
+        }
+
+        printf("%s: STREAM OFF success\n", dev->device_type_name);
+        dev->is_streaming = 0;
+
+        if (gadget->settings.latest_frame && dev->frames_dropped) {
+            printf("%s: Stale frames dropped: %llu\n", dev->device_type_name, dev->frames_dropped);
+        }
+    }
+    return 0;
+}
+
+static int v4l2_video_stream(enum video_stream_action action)
+{
+    return v4l2_video_stream_control(&gadget->v4l2_dev, action);
+}
+
+/* Asks the encoder for an IDR frame, so the host can start decoding immediately */
+static void v4l2_request_keyframe(struct v4l2_device * dev)
+{
+    struct v4l2_control control;
+
+    CLEAR(control);
+    control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+
+    if (ioctl(dev->fd, VIDIOC_S_CTRL, &control) < 0) {
+        printf("%s: Unable to request key frame: %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    printf("%s: Key frame requested\n", dev->device_type_name);
+}
+
+static int uvc_video_stream(enum video_stream_action action)
+{
+    int ret = v4l2_video_stream_control(&gadget->uvc_dev, action);
+
+    /* the UVC device is started with the first frame queued */
+    if (ret == 0 && action == STREAM_ON && gadget->v4l2_standby.streamon_time) {
+        printf("%s: First frame %.2f ms after STREAMON event (%s start)\n", gadget->uvc_dev.device_type_name,
+            monotonic_ms() - gadget->v4l2_standby.streamon_time, (gadget->v4l2_standby.warm_start) ? "warm" : "cold");
+        gadget->v4l2_standby.streamon_time = 0;
+    }
+    return ret;
+}
+
+static int v4l2_init_buffers(struct v4l2_device * dev, struct v4l2_requestbuffers * req,
+    unsigned int count)
+{
+    int ret;
+    req->count  = count;
+    req->type   = dev->buffer_type;
+    req->memory = dev->memory_type;
+
+    ret = ioctl(dev->fd, VIDIOC_REQBUFS, req);
+    if (ret < 0) {
+        if (ret == -EINVAL) {
+            printf("%s: Does not support %s\n", dev->device_type_name,
+                (dev->memory_type == V4L2_MEMORY_USERPTR) ? "user pointer i/o" :
+                (dev->memory_type == V4L2_MEMORY_DMABUF) ? "dmabuf i/o" : "memory mapping");
+
+        } else {
+            printf("%s: VIDIOC_REQBUFS error: %s (%d).\n",
+                dev->device_type_name, strerror(errno), errno);
+
+        }
+        return ret;
+    }
+    return count;
+}
+
+static int v4l2_mmap_buffer(struct v4l2_device * dev, unsigned int i)
+{
+    CLEAR(dev->mem[i].buf);
+
+    dev->mem[i].dmabuf_fd  = -1;
+    dev->mem[i].buf.type   = dev->buffer_type;
+    dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
+    dev->mem[i].buf.index  = i;
+
+    if (ioctl(dev->fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf)) < 0) {
+        printf("%s: VIDIOC_QUERYBUF failed for buf %d: %s (%d).\n",
+            dev->device_type_name, i, strerror(errno), errno);
+
+        return -EINVAL;
+    }
+
+    dev->mem[i].start =
+        mmap(NULL /* start anywhere */,
+            dev->mem[i].buf.length,
+            PROT_READ | PROT_WRITE /* required */,
+            MAP_SHARED /* recommended */,
+            dev->fd, dev->mem[i].buf.m.offset
+        );
+
+    if (MAP_FAILED == dev->mem[i].start) {
+        printf("%s: Unable to map buffer %u: %s (%d).\n",
+            dev->device_type_name, i, strerror(errno), errno);
+
+        dev->mem[i].length = 0;
+        return -EINVAL;
+    }
+
+    dev->mem[i].length = dev->mem[i].buf.length;
+    printf("%s: Buffer %u mapped at address %p, length %d.\n",
+        dev->device_type_name, i, dev->mem[i].start, dev->mem[i].length);
+
+    return 0;
+}
+
+static int v4l2_reqbufs_mmap(struct v4l2_device * dev, struct v4l2_requestbuffers req)
+{
+    struct v4l2_requestbuffers release;
+    int ret;
+    unsigned int i = 0;
+
+    /* Map the buffers. */
+    dev->mem = calloc(req.count, sizeof dev->mem[0]);
+    if (!dev->mem) {
+        printf("%s: Out of memory\n", dev->device_type_name);
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < req.count; ++i) {
+        ret = v4l2_mmap_buffer(dev, i);
+        if (ret < 0) {
+            goto err_free;
+        }
+    }
+
+    return 0;
+
+err_free:
+    /* mapped buffers keep the queue busy, another memory type could not be requested */
+    while (i-- > 0) {
+        munmap(dev->mem[i].start, dev->mem[i].length);
+    }
+    free(dev->mem);
+    dev->mem = NULL;
+err:
+    CLEAR(release);
+    v4l2_init_buffers(dev, &release, 0);
+    dev->nbufs = 0;
+    return ret;
+}
+
+static int v4l2_reqbufs_userptr(struct v4l2_device * dev, struct v4l2_requestbuffers req)
+{
+    unsigned int payload_size;
+    unsigned int i;
+
+    if (dev->device_type == DEVICE_TYPE_UVC && uvc_owns_buffers()) {
+        /* Allocate buffers to hold dummy data pattern. */
+        dev->dummy_buf = calloc(req.count, sizeof dev->dummy_buf[0]);
+        if (!dev->dummy_buf) {
+            printf("%s: Out of memory\n", dev->device_type_name);
+            return -ENOMEM;
+        }
+
+        if (dev->width && dev->height) {
+            payload_size = dev->width * dev->height * 2;
+        } else {
+            payload_size = gadget->fb_dev.fb_width * gadget->fb_dev.fb_height * 2;
+        }
+        /* like the MMAP buffers, large enough for the largest still image */
+        payload_size = max(payload_size, dev->min_sizeimage);
+
+        for (i = 0; i < req.count; ++i) {
+            dev->dummy_buf[i].length = payload_size;
+            dev->dummy_buf[i].start  = malloc(payload_size);
+            if (!dev->dummy_buf[i].start) {
+                printf("%s: Out of memory\n", dev->device_type_name);
+                return -ENOMEM;
+            }
+        }
+
+        dev->mem = dev->dummy_buf;
+
+    }
+    return 0;
+}
+
+static int v4l2_reqbufs(struct v4l2_device * dev, int nbufs)
+{
+    int ret = 0;
+    struct v4l2_requestbuffers req;
+    CLEAR(req);
+
+    dev->dqbuf_count = 0;
+    dev->qbuf_count = 0;
+
+    ret = v4l2_init_buffers(dev, &req, nbufs);
+    if (ret < 1) {
+        return ret;
+    }
+
+    if (!req.count) {
+        return 0;
+    }
+
+    if (dev->memory_type == V4L2_MEMORY_MMAP) {
+        if (req.count < 2) {
+            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+            return -EINVAL;
+        }
+
+        ret = v4l2_reqbufs_mmap(dev, req);
+        if (ret < 0) {
+            return -EINVAL;
+        }
+    }
+
+    if (dev->memory_type == V4L2_MEMORY_USERPTR && dev->device_type == DEVICE_TYPE_UVC && uvc_owns_buffers()) {
+        if (req.count < 2) {
+            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+            return -EINVAL;
+        }
+
+        ret = v4l2_reqbufs_userptr(dev, req);
+        if (ret < 0) {
+            return -EINVAL;
+        }
+    }
+
+    dev->nbufs = req.count;
+    printf("%s: %u buffers allocated.\n", dev->device_type_name, req.count);
+
+    return ret;
+}
+
+static int v4l2_request_bufs(int nbufs)
+{
+    return v4l2_reqbufs(&gadget->v4l2_dev, nbufs);
+}
+
+static int uvc_request_bufs(int nbufs)
+{
+    return v4l2_reqbufs(&gadget->uvc_dev, nbufs);
+}
+
+static int v4l2_qbuf_mmap(struct v4l2_device * dev)
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < dev->nbufs; ++i) {
+        CLEAR(dev->mem[i].buf);
+
+        dev->mem[i].buf.type   = dev->buffer_type;
+        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
+        dev->mem[i].buf.index  = i;
+
+        ret = ioctl(dev->fd, VIDIOC_QBUF, &(dev->mem[i].buf));
+        if (ret < 0) {
+            printf("%s: VIDIOC_QBUF failed : %s (%d).\n",
+                dev->device_type_name, strerror(errno), errno);
+
+            return ret;
+        }
+        dev->qbuf_count++;
+    }
+    return 0;
+}
+
+static int uvc_video_qbuf()
+{
+    unsigned int i;
+    int ret;
+
+    if (gadget->settings.source_device != DEVICE_TYPE_V4L2 && gadget->uvc_dev.memory_type == V4L2_MEMORY_MMAP) {
+        return v4l2_qbuf_mmap(&gadget->uvc_dev);
+    }
+
+    if (gadget->settings.source_device != DEVICE_TYPE_V4L2) {
+        for (i = 0; i < gadget->uvc_dev.nbufs; ++i) {
+            struct v4l2_buffer buf;
+
+            CLEAR(buf);
+            buf.type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            buf.memory    = V4L2_MEMORY_USERPTR;
+            buf.m.userptr = (unsigned long) gadget->uvc_dev.dummy_buf[i].start;
+            buf.length    = gadget->uvc_dev.dummy_buf[i].length;
+            buf.index     = i;
+
+            ret = ioctl(gadget->uvc_dev.fd, VIDIOC_QBUF, &buf);
+            if (ret < 0) {
+                printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+                return ret;
+            }
+
+            gadget->uvc_dev.qbuf_count++;
+        }
+    }
+    return 0;
+}
+
+/* Adds one mapped buffer to a streaming capture device and queues it */
+static int v4l2_create_buffer(struct v4l2_device * dev)
+{
+    struct v4l2_create_buffers create;
+    struct v4l2_buffer buf;
+    struct buffer * mem;
+    unsigned int i;
+
+    CLEAR(create);
+    create.count       = 1;
+    create.memory      = V4L2_MEMORY_MMAP;
+    create.format.type = dev->buffer_type;
+
+    if (ioctl(dev->fd, VIDIOC_G_FMT, &create.format) < 0) {
+        printf("%s: Unable to get format: %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    if (ioctl(dev->fd, VIDIOC_CREATE_BUFS, &create) < 0 || !create.count) {
+        printf("%s: VIDIOC_CREATE_BUFS failed: %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    i = create.index;
+    mem = realloc(dev->mem, (i + 1) * sizeof dev->mem[0]);
+    if (!mem) {
+        printf("%s: Out of memory\n", dev->device_type_name);
+        return -ENOMEM;
+    }
+    dev->mem = mem;
+
+    if (v4l2_mmap_buffer(dev, i) < 0) {
+        return -EINVAL;
+    }
+    dev->nbufs = i + 1;
+
+    /* the UVC device already takes DMABUF, the new buffer has to match */
+    if (dev->dmabuf_exported && v4l2_dmabuf_export_buffer(dev, i) < 0) {
+        return -EINVAL;
+    }
+
+    CLEAR(buf);
+    buf.type   = dev->buffer_type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index  = i;
+
+    if (ioctl(dev->fd, VIDIOC_QBUF, &buf) < 0) {
+        printf("%s: VIDIOC_QBUF failed : %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return -EINVAL;
+    }
+    dev->qbuf_count++;
+
+    printf("%s: Buffer %u created, %u buffers in use\n", dev->device_type_name, i, dev->nbufs);
+    return 0;
+}
+
+static void v4l2_adaptive_start()
+{
+    gadget->v4l2_adaptive.enabled = gadget->settings.nbufs_adaptive && !gadget->settings.pipeline_threads &&
+        !gadget->v4l2_convert.enabled && !gadget->v4l2_m2m.enabled;
+    if (!gadget->v4l2_adaptive.enabled) {
+        return;
+    }
+
+    if (!gadget->v4l2_adaptive.count) {
+        gadget->v4l2_adaptive.count = gadget->settings.nbufs;
+    }
+
+    gadget->v4l2_adaptive.have_sequence = false;
+    gadget->v4l2_adaptive.underruns     = 0;
+    gadget->v4l2_adaptive.grown         = 0;
+    gadget->v4l2_adaptive.last_grow     = 0;
+    gadget->v4l2_adaptive.last_underrun = 0;
+    gadget->v4l2_adaptive.last_dequeue  = 0;
+    gadget->v4l2_adaptive.interval      = 0;
+    gadget->v4l2_adaptive.jitter        = 0;
+    gadget->v4l2_adaptive.started       = monotonic_ms();
+}
+
+/*
+ * A gap in the capture sequence while at most one buffer was queued means the
+ * camera had nowhere to put a frame, every other buffer was still held by the
+ * UVC device. One buffer is added per interval, the UVC device got slots for
+ * V4L2_ADAPTIVE_MAX_BUFFERS at stream on.
+ */
+static void v4l2_adaptive_captured(struct v4l2_buffer * vbuf, unsigned long long queued)
+{
+    bool lost;
+    double now;
+
+    if (!gadget->v4l2_adaptive.enabled) {
+        return;
+    }
+
+    lost = gadget->v4l2_adaptive.have_sequence && vbuf->sequence - gadget->v4l2_adaptive.last_sequence > 1;
+    gadget->v4l2_adaptive.last_sequence = vbuf->sequence;
+    gadget->v4l2_adaptive.have_sequence = true;
+
+    if (!lost || queued > 1) {
+        return;
+    }
+
+    now = monotonic_ms();
+    gadget->v4l2_adaptive.underruns++;
+    gadget->v4l2_adaptive.last_underrun = now;
+
+    if (now - gadget->v4l2_adaptive.last_grow < V4L2_ADAPTIVE_GROW_INTERVAL ||
+        gadget->v4l2_dev.nbufs >= min(gadget->uvc_dev.nbufs, V4L2_ADAPTIVE_MAX_BUFFERS)
+    ) {
+        return;
+    }
+
+    gadget->v4l2_adaptive.last_grow = now;
+    if (v4l2_create_buffer(&gadget->v4l2_dev) == 0) {
+        gadget->v4l2_adaptive.grown++;
+    }
+}
+
+/* Running average of the interval between UVC dequeues and its deviation */
+static void v4l2_adaptive_dequeued()
+{
+    double now;
+    double interval;
+    double deviation;
+
+    if (!gadget->v4l2_adaptive.enabled) {
+        return;
+    }
+
+    now = monotonic_ms();
+    if (gadget->v4l2_adaptive.last_dequeue) {
+        interval  = now - gadget->v4l2_adaptive.last_dequeue;
+        deviation = interval - gadget->v4l2_adaptive.interval;
+        if (deviation < 0) {
+            deviation = -deviation;
+        }
+
+        gadget->v4l2_adaptive.interval += (interval - gadget->v4l2_adaptive.interval) / 16;
+        gadget->v4l2_adaptive.jitter   += (deviation - gadget->v4l2_adaptive.jitter) / 16;
+    }
+    gadget->v4l2_adaptive.last_dequeue = now;
+}
+
+/*
+ * Called at stream off. The count reached is kept for the next stream unless
+ * the end of this one was free of underruns and the host dequeued steadily,
+ * then one buffer is given back.
+ */
+static void v4l2_adaptive_stop()
+{
+    double now;
+    bool stable;
+
+    if (!gadget->v4l2_adaptive.enabled) {
+        return;
+    }
+
+    now = monotonic_ms();
+    stable = now - max(gadget->v4l2_adaptive.started, gadget->v4l2_adaptive.last_underrun) >= V4L2_ADAPTIVE_STABLE_TIME &&
+        gadget->v4l2_adaptive.jitter <= gadget->v4l2_adaptive.interval / 4;
+
+    gadget->v4l2_adaptive.count = gadget->v4l2_dev.nbufs;
+    if (stable && gadget->v4l2_adaptive.count > gadget->settings.nbufs) {
+        gadget->v4l2_adaptive.count--;
+    }
+
+    printf("%s: Adaptive buffers: %u grown, %llu underruns, next stream uses %u buffers\n",
+        gadget->v4l2_dev.device_type_name, gadget->v4l2_adaptive.grown, gadget->v4l2_adaptive.underruns, gadget->v4l2_adaptive.count);
+
+    gadget->v4l2_dev.nbufs = gadget->settings.nbufs;
+    gadget->uvc_dev.nbufs = gadget->settings.nbufs;
+    gadget->v4l2_adaptive.enabled = false;
+}
+
+/*
+ * Latest-frame mode: keeps dequeuing while the capture device has more frames
+ * ready and requeues the older one right away, so only the newest frame is
+ * forwarded.
+ */
+static void v4l2_dqbuf_latest(struct v4l2_buffer * vbuf)
+{
+    struct v4l2_buffer next;
+
+    if (!gadget->settings.latest_frame) {
+        return;
+    }
+
+    for (;;) {
+        CLEAR(next);
+        next.type   = gadget->v4l2_dev.buffer_type;
+        next.memory = gadget->v4l2_dev.memory_type;
+
+        if (ioctl(gadget->v4l2_dev.fd, VIDIOC_DQBUF, &next) < 0) {
+            return;
+        }
+
+        gadget->v4l2_dev.dqbuf_count++;
+        gadget->v4l2_dev.frames_dropped++;
+
+        if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QBUF, vbuf) < 0) {
+            printf("%s: Unable to queue buffer: %s (%d).\n",
+                gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+        } else {
+            gadget->v4l2_dev.qbuf_count++;
+        }
+
+        *vbuf = next;
+    }
+}
+
+/* Paces the capture device running at input interval to the committed output interval */
+static void v4l2_pacing_start(unsigned int input, unsigned int output)
+{
+    CLEAR(gadget->v4l2_pacing);
+
+    /* within 1 % the host copes with the difference */
+    if (!input || !output || (unsigned long long) max(input, output) * 100 <= (unsigned long long) min(input, output) * 101) {
+        return;
+    }
+
+    gadget->v4l2_pacing.enabled = true;
+    gadget->v4l2_pacing.input   = input;
+    gadget->v4l2_pacing.output  = output;
+    gadget->v4l2_pacing.phase   = output;
+
+    printf("PACING: Capture interval %u, committed interval %u, frames are %s evenly\n",
+        input, output, (input < output) ? "dropped" : "duplicated");
+}
+
+static void v4l2_pacing_stop()
+{
+    if (!gadget->v4l2_pacing.enabled) {
+        return;
+    }
+
+    printf("PACING: Frames dropped: %llu, duplicated: %llu\n", gadget->v4l2_pacing.dropped, gadget->v4l2_pacing.duplicated);
+    gadget->v4l2_pacing.enabled = false;
+}
+
+/*
+ * Returns how many times the captured frame is sent, at most max_copies. 0
+ * drops the frame. Duplicates are counted by the caller, which may run out of
+ * buffers for them.
+ */
+static unsigned int v4l2_pacing_frames(unsigned int max_copies)
+{
+    unsigned int copies;
+
+    if (!gadget->v4l2_pacing.enabled) {
+        return 1;
+    }
+
+    gadget->v4l2_pacing.phase += gadget->v4l2_pacing.input;
+    copies = gadget->v4l2_pacing.phase / gadget->v4l2_pacing.output;
+    gadget->v4l2_pacing.phase -= (unsigned long long) copies * gadget->v4l2_pacing.output;
+
+    if (!copies) {
+        gadget->v4l2_pacing.dropped++;
+    }
+    return min(copies, max_copies);
+}
+
+/* Gives a spent UVC buffer back to the capture device, indices are shared */
+static void v4l2_video_requeue(unsigned int index)
+{
+    struct v4l2_buffer vbuf;
+
+    CLEAR(vbuf);
+    vbuf.type   = gadget->v4l2_dev.buffer_type;
+    vbuf.memory = gadget->v4l2_dev.memory_type;
+    vbuf.index  = index;
+
+    if (vbuf.memory == V4L2_MEMORY_USERPTR) {
+        vbuf.m.userptr = (unsigned long) gadget->v4l2_dev.mem[index].start;
+        vbuf.length    = gadget->v4l2_dev.mem[index].length;
+    }
+
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QBUF, &vbuf) < 0) {
+        printf("%s: Unable to queue buffer: %s (%d).\n",
+            gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    gadget->v4l2_dev.qbuf_count++;
+}
+
+/* Queues a captured buffer to UVC domain */
+static void v4l2_uvc_video_queue(unsigned int index, unsigned int bytesused)
+{
+    struct v4l2_buffer ubuf;
+
+    CLEAR(ubuf);
+    ubuf.type      = gadget->uvc_dev.buffer_type;
+    ubuf.memory    = gadget->uvc_dev.memory_type;
+    ubuf.length    = gadget->v4l2_dev.mem[index].length;
+    ubuf.index     = index;
+    ubuf.bytesused = bytesused;
+
+    if (gadget->uvc_dev.memory_type == V4L2_MEMORY_DMABUF) {
+        ubuf.m.fd = gadget->v4l2_dev.mem[index].dmabuf_fd;
+    } else {
+        ubuf.m.userptr = (unsigned long) gadget->v4l2_dev.mem[index].start;
+    }
+
+    if (ioctl(gadget->uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
+        /* Check for a USB disconnect/shutdown event. */
+        if (errno == ENODEV) {
+            gadget->uvc_shutdown_requested = true;
+            printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n");
+        }
+        return;
+    }
+
+    gadget->uvc_dev.qbuf_count++;
+
+    if (!gadget->uvc_dev.is_streaming) {
+        uvc_video_stream(STREAM_ON);
+        gadget->settings.blink_on_startup = 0;
+        streaming_status_value(gadget->uvc_dev.is_streaming);
+    }
+}
+
+/* Queues a captured buffer to the UVC devices of all streaming tee members */
+static void v4l2_tee_queue(unsigned int index, unsigned int bytesused)
+{
+    struct uvc_gadget * owner = gadget;
+    struct v4l2_tee * tee = &owner->tee;
+    struct buffer * mem = &owner->v4l2_dev.mem[index];
+    struct v4l2_buffer ubuf;
+    unsigned int i;
+
+    for (i = 0; i < tee->nmembers; i++) {
+        gadget = tee->members[i];
+        if (!gadget->tee.streaming || gadget->uvc_shutdown_requested) {
+            continue;
+        }
+
+        CLEAR(ubuf);
+        ubuf.type      = gadget->uvc_dev.buffer_type;
+        ubuf.memory    = gadget->uvc_dev.memory_type;
+        ubuf.length    = mem->length;
+        ubuf.index     = index;
+        ubuf.bytesused = bytesused;
+
+        if (gadget->uvc_dev.memory_type == V4L2_MEMORY_DMABUF) {
+            ubuf.m.fd = mem->dmabuf_fd;
+        } else {
+            ubuf.m.userptr = (unsigned long) mem->start;
+        }
+
+        if (ioctl(gadget->uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
+            if (errno == ENODEV) {
+                gadget->uvc_shutdown_requested = true;
+                printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n");
+            }
+            continue;
+        }
+
+        gadget->uvc_dev.qbuf_count++;
+        gadget->tee.held |= 1u << index;
+        tee->refcount[index]++;
+        tee->queued++;
+
+        if (!gadget->uvc_dev.is_streaming) {
+            uvc_video_stream(STREAM_ON);
+            gadget->settings.blink_on_startup = 0;
+            streaming_status_value(gadget->uvc_dev.is_streaming);
+        }
+    }
+
+    gadget = owner;
+    tee->frames++;
+
+    /* no member took the frame */
+    if (!tee->refcount[index]) {
+        v4l2_video_requeue(index);
+    }
+}
+
+/* The last member done with a shared capture buffer gives it back to the camera */
+static void v4l2_tee_release(unsigned int index)
+{
+    struct uvc_gadget * member = gadget;
+    struct uvc_gadget * owner = gadget->tee.owner;
+
+    if (index >= V4L2_TEE_MAX_BUFFERS || !(member->tee.held & (1u << index))) {
+        return;
+    }
+
+    member->tee.held &= ~(1u << index);
+    if (--owner->tee.refcount[index]) {
+        return;
+    }
+
+    gadget = owner;
+    v4l2_video_requeue(index);
+    gadget = member;
+}
+
+static void v4l2_uvc_video_process()
+{
+    struct v4l2_buffer vbuf;
+
+    if (gadget->uvc_dev.is_streaming && gadget->v4l2_dev.dqbuf_count >= gadget->v4l2_dev.qbuf_count) {
+        return;
+    }
+
+    /* Dequeue spent buffer from V4L2 domain. */
+    CLEAR(vbuf);
+    vbuf.type   = gadget->v4l2_dev.buffer_type;
+    vbuf.memory = gadget->v4l2_dev.memory_type;
+
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_DQBUF, &vbuf) < 0) {
+        printf("%s: Unable to dequeue buffer: %s (%d).\n",
+            gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    gadget->v4l2_dev.dqbuf_count++;
+    v4l2_adaptive_captured(&vbuf, gadget->v4l2_dev.qbuf_count - gadget->v4l2_dev.dqbuf_count + 1);
+    v4l2_dqbuf_latest(&vbuf);
+
+    /* the buffer is shared with the UVC device, it can't be sent twice */
+    if (!v4l2_pacing_frames(1)) {
+        v4l2_video_requeue(vbuf.index);
+        return;
+    }
+
+    if (gadget->pipeline.enabled) {
+        pipeline_push(&gadget->pipeline.ready, vbuf.index, vbuf.bytesused);
+        return;
+    }
+
+    if (gadget->tee.owner) {
+        v4l2_tee_queue(vbuf.index, vbuf.bytesused);
+        return;
+    }
+
+    v4l2_uvc_video_queue(vbuf.index, vbuf.bytesused);
+}
+
+/*
+ * Keeps the capture buffers of a stopped stream. With STANDBY_STREAMING the
+ * buffers the UVC device held go back to the sensor, which keeps streaming.
+ * mem2mem streams and -n auto are always released.
+ */
+static bool v4l2_standby_possible()
+{
+    return gadget->settings.standby != STANDBY_OFF && gadget->v4l2_dev.mem &&
+        !gadget->v4l2_m2m.enabled && !gadget->v4l2_adaptive.enabled;
+}
+
+static void v4l2_standby_park()
+{
+    struct v4l2_buffer buf;
+    unsigned int i;
+
+    if (gadget->settings.standby == STANDBY_STREAMING && gadget->v4l2_dev.is_streaming) {
+        for (i = 0; i < gadget->v4l2_dev.nbufs; ++i) {
+            CLEAR(buf);
+            buf.type   = gadget->v4l2_dev.buffer_type;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index  = i;
+
+            if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QUERYBUF, &buf) < 0 ||
+                (buf.flags & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE))
+            ) {
+                continue;
+            }
+
+            if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QBUF, &buf) < 0) {
+                printf("%s: VIDIOC_QBUF failed : %s (%d).\n",
+                    gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+            }
+        }
+        gadget->v4l2_standby.parked = true;
+
+    } else {
+        v4l2_video_stream(STREAM_OFF);
+    }
+
+    gadget->v4l2_standby.warm = true;
+
+    printf("%s: Warm standby with %u buffers%s\n", gadget->v4l2_dev.device_type_name, gadget->v4l2_dev.nbufs,
+        (gadget->v4l2_standby.parked) ? ", sensor streaming" : "");
+}
+
+/*
+ * Picks up the parked buffers. A streaming sensor has filled them while no
+ * host was watching, those stale frames are given back before anything is
+ * forwarded.
+ */
+static int v4l2_standby_resume()
+{
+    struct v4l2_buffer buf;
+    unsigned int stale = 0;
+
+    gadget->v4l2_standby.warm = false;
+
+    if (gadget->v4l2_standby.parked) {
+        gadget->v4l2_standby.parked = false;
+
+        for (;;) {
+            CLEAR(buf);
+            buf.type   = gadget->v4l2_dev.buffer_type;
+            buf.memory = V4L2_MEMORY_MMAP;
+
+            if (ioctl(gadget->v4l2_dev.fd, VIDIOC_DQBUF, &buf) < 0 || ioctl(gadget->v4l2_dev.fd, VIDIOC_QBUF, &buf) < 0) {
+                break;
+            }
+            stale++;
+        }
+
+        gadget->v4l2_dev.dqbuf_count = 0;
+        gadget->v4l2_dev.qbuf_count  = gadget->v4l2_dev.nbufs;
+
+        printf("%s: Resumed from warm standby, %u stale frames dropped\n",
+            gadget->v4l2_dev.device_type_name, stale);
+        return 0;
+    }
+
+    gadget->v4l2_dev.dqbuf_count = 0;
+    gadget->v4l2_dev.qbuf_count  = 0;
+
+    if (v4l2_qbuf_mmap(&gadget->v4l2_dev) < 0) {
+        return -EINVAL;
+    }
+
+    printf("%s: Resumed from warm standby\n", gadget->v4l2_dev.device_type_name);
+    return v4l2_video_stream(STREAM_ON);
+}
+
+static void v4l2_standby_release()
+{
+    if (!gadget->v4l2_standby.warm) {
+        return;
+    }
+
+    gadget->v4l2_standby.warm   = false;
+    gadget->v4l2_standby.parked = false;
+
+    v4l2_video_stream(STREAM_OFF);
+    v4l2_uninit_device();
+    v4l2_request_bufs(0);
+
+    printf("%s: Warm standby released\n", gadget->v4l2_dev.device_type_name);
+}
+
+/* ---------------------------------------------------------------------------
+ * V4L2 generic stuff
+ */
+
+static int v4l2_get_format(struct v4l2_device * dev)
+{
+    struct v4l2_format fmt;
+    int ret;
+
+    CLEAR(fmt);
+    fmt.type = dev->buffer_type;
+
+    ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    printf("%s: Getting current format: %c%c%c%c %ux%u\n",
+        dev->device_type_name, pixfmtstr(fmt.fmt.pix.pixelformat),
+        fmt.fmt.pix.width, fmt.fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_set_format(struct v4l2_device * dev, struct v4l2_format * fmt)
+{
+    int ret;
+
+    ret = ioctl(dev->fd, VIDIOC_S_FMT, fmt);
+    if (ret < 0) {
+        printf("%s: Unable to set format %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return ret;
+    }
+
+    printf("%s: Setting format to: %c%c%c%c %ux%u\n",
+        dev->device_type_name, pixfmtstr(fmt->fmt.pix.pixelformat),
+        fmt->fmt.pix.width, fmt->fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_apply_format(struct v4l2_device * dev, unsigned int pixelformat,
+    unsigned int width, unsigned int height)
+{
+    struct v4l2_format fmt;
+    unsigned int sizeimage = max(get_frame_size(pixelformat, width, height), dev->min_sizeimage);
+    int ret = -EINVAL;
+
+    if (dev->is_streaming || !dev->fd) {
+        return ret;
+    }
+
+    if (dev->format_cached && dev->requested_pixelformat == pixelformat &&
+        dev->requested_width == width && dev->requested_height == height &&
+        dev->requested_sizeimage == sizeimage
+    ) {
+        dev->format_skipped++;
+        return 0;
+    }
+    dev->format_cached = false;
+    dev->interval_cached = false;
+
+    CLEAR(fmt);
+    fmt.type                = dev->buffer_type;
+    fmt.fmt.pix.width       = width;
+    fmt.fmt.pix.height      = height;
+    fmt.fmt.pix.sizeimage   = sizeimage;
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+
+    ret = v4l2_set_format(dev, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* S_FMT may adjust the request, keep what the driver accepted */
+    dev->pixelformat  = fmt.fmt.pix.pixelformat;
+    dev->width        = fmt.fmt.pix.width;
+    dev->height       = fmt.fmt.pix.height;
+    dev->bytesperline = fmt.fmt.pix.bytesperline;
+    dev->format_applied++;
+
+    ret = v4l2_get_format(dev);
+    if (ret < 0) {
+        return ret;
+    }
+
+    dev->requested_pixelformat = pixelformat;
+    dev->requested_width       = width;
+    dev->requested_height      = height;
+    dev->requested_sizeimage   = sizeimage;
+    dev->format_cached         = true;
+    return 0;
+}
+
+/*
+ * Requests a frame interval in 100 ns units and returns the interval the device
+ * runs at, 0 when it is unknown. Repeating the last request skips the ioctls.
+ */
+static unsigned int v4l2_set_frame_interval(struct v4l2_device * dev, unsigned int interval)
+{
+    struct v4l2_streamparm parm;
+    struct v4l2_fract * timeperframe = &parm.parm.capture.timeperframe;
+
+    if (!dev->fd || !interval) {
+        return 0;
+    }
+
+    if (dev->interval_cached && dev->requested_interval == interval) {
+        return dev->frame_interval;
+    }
+
+    CLEAR(parm);
+    parm.type = dev->buffer_type;
+
+    if (ioctl(dev->fd, VIDIOC_G_PARM, &parm) < 0) {
+        printf("%s: Unable to get frame interval: %s (%d).\n",
+            dev->device_type_name, strerror(errno), errno);
+        return 0;
+    }
+
+    if (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
+        timeperframe->numerator   = interval;
+        timeperframe->denominator = 10000000;
+
+        if (ioctl(dev->fd, VIDIOC_S_PARM, &parm) < 0) {
+            printf("%s: Unable to set frame interval: %s (%d).\n",
+                dev->device_type_name, strerror(errno), errno);
+
+            /* keep reporting the interval the device still runs at */
+            CLEAR(parm);
+            parm.type = dev->buffer_type;
+            if (ioctl(dev->fd, VIDIOC_G_PARM, &parm) < 0) {
+                return 0;
+            }
+        }
+    } else {
+        printf("%s: Frame interval is not adjustable\n", dev->device_type_name);
+    }
+
+    dev->frame_interval = 0;
+    if (timeperframe->denominator) {
+        dev->frame_interval = (unsigned long long) timeperframe->numerator * 10000000 /
+            timeperframe->denominator;
+    }
+    dev->requested_interval = interval;
+    dev->interval_cached    = true;
+
+    printf("%s: Frame interval: requested: %u, device: %u (100 ns units)\n",
+        dev->device_type_name, interval, dev->frame_interval);
+    return dev->frame_interval;
+}
+
+/* Checks that the device accepted exactly the requested format */
+static bool v4l2_format_matches(struct v4l2_device * dev, unsigned int pixelformat,
+    unsigned int width, unsigned int height)
+{
+    return dev->pixelformat == pixelformat && dev->width == width && dev->height == height;
+}
+
+static void v4l2_set_ctrl_value(struct control_mapping_pair ctrl, unsigned int ctrl_v4l2, int v4l2_ctrl_value)
+{
+    struct v4l2_queryctrl queryctrl;
+    struct v4l2_control control;
+    CLEAR(queryctrl);
+
+    queryctrl.id = ctrl_v4l2;
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl) == -1) {
+        if (errno != EINVAL) {
+            printf("%s: %s VIDIOC_QUERYCTRL failed: %s (%d).\n",
+                gadget->uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+
+        } else {
+            printf("%s: %s is not supported: %s (%d).\n",
+                gadget->uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+
+        }
+
+    } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
+        printf("%s: %s is disabled.\n", gadget->uvc_dev.device_type_name, ctrl.v4l2_name);
+
+    } else {
+        CLEAR(control);
+        control.id = ctrl.v4l2;
+        control.value = v4l2_ctrl_value;
+
+        if (ioctl(gadget->v4l2_dev.fd, VIDIOC_S_CTRL, &control) == -1) {
+            printf("%s: %s VIDIOC_S_CTRL failed: %s (%d).\n",
+                gadget->uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+            return;
+        }
+        printf("%s: %s changed value (V4L2: %d, UVC: %d)\n",
+            gadget->uvc_dev.device_type_name, ctrl.v4l2_name, v4l2_ctrl_value, ctrl.value);
+    }
+}
+
+static void v4l2_set_ctrl(struct control_mapping_pair ctrl)
+{
+    int v4l2_ctrl_value = 0;
+    int v4l2_diff = ctrl.v4l2_maximum - ctrl.v4l2_minimum;
+    int ctrl_diff = ctrl.maximum - ctrl.minimum;
+
+    if (ctrl.value < ctrl.minimum) {
+        ctrl.value = ctrl.minimum;
+    }
+
+    if (ctrl.value > ctrl.maximum) {
+        ctrl.value = ctrl.maximum;
+    }
+
+    v4l2_ctrl_value = (ctrl.value - ctrl.minimum) * v4l2_diff / ctrl_diff + ctrl.v4l2_minimum;
+
+    v4l2_set_ctrl_value(ctrl, ctrl.v4l2, v4l2_ctrl_value);
+
+    if (ctrl.v4l2 == V4L2_CID_RED_BALANCE) {
+        v4l2_set_ctrl_value(ctrl, V4L2_CID_BLUE_BALANCE, v4l2_ctrl_value);
+    }
+}
+
+/* A control written by a tee member changes the shared camera, every member reports the new value */
+static void v4l2_tee_set_ctrl(unsigned int i)
+{
+    struct uvc_gadget * member = gadget;
+    struct uvc_gadget * owner = gadget->tee.owner;
+    unsigned int j;
+
+    for (j = 0; j < owner->tee.nmembers; j++) {
+        owner->tee.members[j]->control_mapping[i].value  = member->control_mapping[i].value;
+        owner->tee.members[j]->control_mapping[i].length = member->control_mapping[i].length;
+    }
+
+    gadget = owner;
+    v4l2_set_ctrl(gadget->control_mapping[i]);
+    gadget = member;
+}
+
+static void v4l2_apply_camera_control(struct control_mapping_pair * mapping,
+    struct v4l2_queryctrl queryctrl, struct v4l2_control control)
+{
+    mapping->enabled       = true;
+    mapping->control_type  = queryctrl.type;
+    mapping->v4l2_minimum  = queryctrl.minimum;
+    mapping->v4l2_maximum  = queryctrl.maximum;
+    mapping->minimum        = 0;
+    mapping->maximum       = (0 - queryctrl.minimum) + queryctrl.maximum;
+    mapping->step          = queryctrl.step;
+    mapping->default_value = (0 - queryctrl.minimum) + queryctrl.default_value;
+    mapping->value         = (0 - queryctrl.minimum) + control.value;
+    
+    printf("V4L2: Supported control %s (%s = %s)\n", queryctrl.name,
+        mapping->v4l2_name, mapping->uvc_name);
+
+    printf("V4L2:   V4L2: min: %d, max: %d, step: %d, default: %d, value: %d\n",
+        queryctrl.minimum,
+        queryctrl.maximum,
+        queryctrl.step,
+        queryctrl.default_value,
+        control.value
+    );
+
+    printf("V4L2:   UVC: min: %d, max: %d, step: %d, default: %d, value: %d\n",
+        mapping->minimum,
+        mapping->maximum,
+        queryctrl.step,
+        mapping->default_value,
+        mapping->value
+    );
+}
+
+static void v4l2_get_controls()
+{
+    int i;
+    struct v4l2_queryctrl queryctrl;
+    struct v4l2_control control;
+    unsigned int id;
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    CLEAR(queryctrl);
+
+    queryctrl.id = next_fl;
+    while (0 == ioctl (gadget->v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl)) {
+
+        id = queryctrl.id;
+        queryctrl.id |= next_fl;
+
+        if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
+            continue;
+        }
+
+        for (i = 0; i < control_mapping_size; i++) {
+            if (gadget->control_mapping[i].v4l2 == id) {
+                control.id = queryctrl.id;
+                if (0 == ioctl (gadget->v4l2_dev.fd, VIDIOC_G_CTRL, &control)) {
+                    v4l2_apply_camera_control(&gadget->control_mapping[i], queryctrl, control);
+                }
+            }
+        }
+    }
+}
+
+static void v4l2_close()
+{
+    if (gadget->v4l2_dev.fd) {
+        close(gadget->v4l2_dev.fd);
+        gadget->v4l2_dev.fd = -1;
+    }
+}
+
+static void uvc_close()
+{
+    if (gadget->uvc_dev.fd) {
+        close(gadget->uvc_dev.fd);
+        gadget->uvc_dev.fd = -1;
+    }
+}
+
+static void fb_close()
+{
+    fb_vsync_uninit();
+
+    if (gadget->fb_dev.fd) {
+        close(gadget->fb_dev.fd);
+        gadget->fb_dev.fd = -1;
+    }
+}
+
+// https://stackoverflow.com/a/15683117
+static void v4l2_get_available_formats()
+{
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum frmsize;
+    unsigned int width;
+    unsigned int height;
+    CLEAR(fmtdesc);
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    while (ioctl(gadget->v4l2_dev.fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+        if (fmtdesc.pixelformat == V4L2_PIX_FMT_MJPEG || fmtdesc.pixelformat == V4L2_PIX_FMT_YUYV ||
+            fmtdesc.pixelformat == V4L2_PIX_FMT_NV12 || fmtdesc.pixelformat == V4L2_PIX_FMT_H264
+        ) {
+            frmsize.pixel_format = fmtdesc.pixelformat;
+            frmsize.index = 0;
+            while (ioctl(gadget->v4l2_dev.fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0) {
+                width = 0;
+                height = 0;
+                if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                    width = frmsize.discrete.width;
+                    height = frmsize.discrete.height;
+
+                } else if (frmsize.type == V4L2_FRMSIZE_TYPE_STEPWISE) {
+                    width = frmsize.stepwise.max_width;
+                    height = frmsize.stepwise.max_height;
+
+                }
+
+                if (width && height) {
+                    printf("%s: Getting highest frame size: %c%c%c%c %ux%u\n",
+                        gadget->v4l2_dev.device_type_name, pixfmtstr(fmtdesc.pixelformat), width, height);
+                }
+                frmsize.index++;
+            }
+        }
+        fmtdesc.index++;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * V4L2 mem2mem stage
+ */
+
+static void v4l2_m2m_init_queue(struct v4l2_device * dev, const char * type_name,
+    unsigned int buffer_type, unsigned int memory_type)
+{
+    dev->device_type      = DEVICE_TYPE_M2M;
+    dev->device_type_name = type_name;
+    dev->buffer_type      = buffer_type;
+    dev->memory_type      = memory_type;
+}
+
+static int v4l2_m2m_open(char * devname)
+{
+    struct v4l2_capability cap;
+    unsigned int caps;
+    const char * type_name = "DEVICE_M2M";
+    int fd;
+
+    printf("%s: Opening %s device\n", type_name, devname);
+
+    fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (fd == -1) {
+        printf("%s: Device open failed: %s (%d).\n", type_name, strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
+        printf("%s: VIDIOC_QUERYCAP failed: %s (%d).\n", type_name, strerror(errno), errno);
+        goto err;
+    }
+
+    caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+
+    if (!(caps & V4L2_CAP_VIDEO_M2M)) {
+        printf("%s: %s is no single-planar mem2mem device\n", type_name, devname);
+        goto err;
+    }
+
+    if (!(caps & V4L2_CAP_STREAMING)) {
+        printf("%s: %s does not support streaming i/o\n", type_name, devname);
+        goto err;
+    }
+
+    printf("%s: Device is %s on bus %s\n", type_name, cap.card, cap.bus_info);
+
+    v4l2_m2m_init_queue(&gadget->v4l2_m2m.output, "M2M_OUTPUT", V4L2_BUF_TYPE_VIDEO_OUTPUT, V4L2_MEMORY_DMABUF);
+    v4l2_m2m_init_queue(&gadget->v4l2_m2m.capture, "M2M_CAPTURE", V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_MEMORY_MMAP);
+    gadget->v4l2_m2m.output.fd  = fd;
+    gadget->v4l2_m2m.capture.fd = fd;
+    return 1;
+
+err:
+    close(fd);
+    return -EINVAL;
+}
+
+static void v4l2_m2m_close()
+{
+    if (gadget->v4l2_m2m.output.fd > 0) {
+        close(gadget->v4l2_m2m.output.fd);
+    }
+    gadget->v4l2_m2m.output.fd  = -1;
+    gadget->v4l2_m2m.capture.fd = -1;
+}
+
+/*
+ * Sets the mem2mem CAPTURE queue to the committed format and looks for a raw
+ * format accepted by both the capture device and the mem2mem OUTPUT queue.
+ * CAPTURE is set first, stateful encoders derive the OUTPUT formats from it.
+ */
+static int v4l2_m2m_negotiate(unsigned int pixelformat, unsigned int width, unsigned int height)
+{
+    struct v4l2_fmtdesc fmtdesc;
+
+    gadget->v4l2_m2m.enabled = false;
+
+    if (!gadget->settings.m2m_devname || gadget->v4l2_m2m.capture.fd <= 0) {
+        return -ENODEV;
+    }
+
+    if (v4l2_apply_format(&gadget->v4l2_m2m.capture, pixelformat, width, height) < 0 ||
+        !v4l2_format_matches(&gadget->v4l2_m2m.capture, pixelformat, width, height)
+    ) {
+        printf("M2M: Device cannot produce %c%c%c%c %ux%u\n", pixfmtstr(pixelformat), width, height);
+        return -EINVAL;
+    }
+
+    CLEAR(fmtdesc);
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+    while (ioctl(gadget->v4l2_m2m.output.fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+        fmtdesc.index++;
+
+        if (v4l2_apply_format(&gadget->v4l2_dev, fmtdesc.pixelformat, width, height) < 0 ||
+            !v4l2_format_matches(&gadget->v4l2_dev, fmtdesc.pixelformat, width, height)
+        ) {
+            continue;
+        }
+
+        if (v4l2_apply_format(&gadget->v4l2_m2m.output, fmtdesc.pixelformat, width, height) < 0 ||
+            !v4l2_format_matches(&gadget->v4l2_m2m.output, fmtdesc.pixelformat, width, height)
+        ) {
+            continue;
+        }
+
+        gadget->v4l2_m2m.enabled = true;
+        printf("M2M: Converting %c%c%c%c to %c%c%c%c %ux%u\n",
+            pixfmtstr(fmtdesc.pixelformat), pixfmtstr(pixelformat), width, height);
+        return 0;
+    }
+
+    printf("M2M: No capture format can be converted to %c%c%c%c %ux%u\n",
+        pixfmtstr(pixelformat), width, height);
+    return -EINVAL;
+}
+
+/*
+ * Allocates mem2mem buffers. OUTPUT buffers import the capture buffers as
+ * DMABUF (user pointers as fallback), CAPTURE buffers are mapped, exported
+ * for the UVC device and queued.
+ */
+static int v4l2_m2m_start()
+{
+    struct v4l2_device * output = &gadget->v4l2_m2m.output;
+    struct v4l2_device * capture = &gadget->v4l2_m2m.capture;
+
+    output->memory_type = (gadget->v4l2_dev.dmabuf_exported) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_USERPTR;
+
+    if (v4l2_reqbufs(output, gadget->v4l2_dev.nbufs) < 0) {
+        if (output->memory_type == V4L2_MEMORY_USERPTR) {
+            return -EINVAL;
+        }
+
+        printf("%s: Falling back to user pointer i/o\n", output->device_type_name);
+        output->memory_type = V4L2_MEMORY_USERPTR;
+
+        if (v4l2_reqbufs(output, gadget->v4l2_dev.nbufs) < 0) {
+            return -EINVAL;
+        }
+    }
+
+    /* capture buffer N is queued as OUTPUT buffer N */
+    if (output->nbufs < gadget->v4l2_dev.nbufs) {
+        printf("%s: %u buffers for %u capture buffers\n",
+            output->device_type_name, output->nbufs, gadget->v4l2_dev.nbufs);
+        return -EINVAL;
+    }
+
+    if (v4l2_reqbufs(capture, gadget->uvc_dev.nbufs) < 0) {
+        return -EINVAL;
+    }
+
+    v4l2_dmabuf_export(capture);
+
+    if (v4l2_qbuf_mmap(capture) < 0) {
+        return -EINVAL;
+    }
+
+    if (v4l2_video_stream_control(output, STREAM_ON) < 0 ||
+        v4l2_video_stream_control(capture, STREAM_ON) < 0
+    ) {
+        return -EINVAL;
+    }
+
+    if (capture->pixelformat == V4L2_PIX_FMT_H264) {
+        v4l2_request_keyframe(capture);
+    }
+    return 0;
+}
+
+static void v4l2_m2m_stop()
+{
+    v4l2_video_stream_control(&gadget->v4l2_m2m.output, STREAM_OFF);
+    v4l2_video_stream_control(&gadget->v4l2_m2m.capture, STREAM_OFF);
+
+    v4l2_uninit_buffers(&gadget->v4l2_m2m.capture);
+    v4l2_reqbufs(&gadget->v4l2_m2m.capture, 0);
+    v4l2_reqbufs(&gadget->v4l2_m2m.output, 0);
+}
+
+/* Moves a captured frame to the mem2mem OUTPUT queue */
+static void v4l2_m2m_capture_process()
+{
+    struct v4l2_buffer vbuf;
+    struct v4l2_buffer obuf;
+
+    CLEAR(vbuf);
+    vbuf.type   = gadget->v4l2_dev.buffer_type;
+    vbuf.memory = gadget->v4l2_dev.memory_type;
+
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_DQBUF, &vbuf) < 0) {
+        printf("%s: Unable to dequeue buffer: %s (%d).\n",
+            gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    gadget->v4l2_dev.dqbuf_count++;
+    v4l2_dqbuf_latest(&vbuf);
+
+    if (!v4l2_pacing_frames(1)) {
+        v4l2_video_requeue(vbuf.index);
+        return;
+    }
+
+    CLEAR(obuf);
+    obuf.type      = gadget->v4l2_m2m.output.buffer_type;
+    obuf.memory    = gadget->v4l2_m2m.output.memory_type;
+    obuf.index     = vbuf.index;
+    obuf.bytesused = vbuf.bytesused;
+    obuf.length    = gadget->v4l2_dev.mem[vbuf.index].length;
+
+    if (obuf.memory == V4L2_MEMORY_DMABUF) {
+        obuf.m.fd = gadget->v4l2_dev.mem[vbuf.index].dmabuf_fd;
+    } else {
+        obuf.m.userptr = (unsigned long) gadget->v4l2_dev.mem[vbuf.index].start;
+    }
+
+    if (ioctl(gadget->v4l2_m2m.output.fd, VIDIOC_QBUF, &obuf) < 0) {
+        printf("%s: Unable to queue buffer: %s (%d).\n",
+            gadget->v4l2_m2m.output.device_type_name, strerror(errno), errno);
+
+        /* give the frame back to the capture device */
+        if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QBUF, &vbuf) == 0) {
+            gadget->v4l2_dev.qbuf_count++;
+        }
+        return;
+    }
+
+    gadget->v4l2_m2m.output.qbuf_count++;
+}
+
+/* Gives a mem2mem CAPTURE buffer back once the UVC device is done with it */
+static void v4l2_m2m_release(unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    CLEAR(buf);
+    buf.type   = gadget->v4l2_m2m.capture.buffer_type;
+    buf.memory = gadget->v4l2_m2m.capture.memory_type;
+    buf.index  = index;
+
+    if (ioctl(gadget->v4l2_m2m.capture.fd, VIDIOC_QBUF, &buf) < 0) {
+        printf("%s: Unable to queue buffer: %s (%d).\n",
+            gadget->v4l2_m2m.capture.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    gadget->v4l2_m2m.capture.qbuf_count++;
+}
+
+/*
+ * Returns consumed OUTPUT buffers to the capture device and queues finished
+ * CAPTURE buffers to the UVC device.
+ */
+static void v4l2_m2m_video_process()
+{
+    struct v4l2_buffer buf;
+    struct v4l2_buffer ubuf;
+
+    CLEAR(buf);
+    buf.type   = gadget->v4l2_m2m.output.buffer_type;
+    buf.memory = gadget->v4l2_m2m.output.memory_type;
+
+    while (ioctl(gadget->v4l2_m2m.output.fd, VIDIOC_DQBUF, &buf) == 0) {
+        gadget->v4l2_m2m.output.dqbuf_count++;
+
+        /* OUTPUT buffer N carries capture buffer N */
+        v4l2_video_requeue(buf.index);
+
+        CLEAR(buf);
+        buf.type   = gadget->v4l2_m2m.output.buffer_type;
+        buf.memory = gadget->v4l2_m2m.output.memory_type;
+    }
+
+    CLEAR(buf);
+    buf.type   = gadget->v4l2_m2m.capture.buffer_type;
+    buf.memory = gadget->v4l2_m2m.capture.memory_type;
+
+    while (ioctl(gadget->v4l2_m2m.capture.fd, VIDIOC_DQBUF, &buf) == 0) {
+        gadget->v4l2_m2m.capture.dqbuf_count++;
+
+        CLEAR(ubuf);
+        ubuf.type      = gadget->uvc_dev.buffer_type;
+        ubuf.memory    = gadget->uvc_dev.memory_type;
+        ubuf.index     = buf.index;
+        ubuf.bytesused = buf.bytesused;
+        ubuf.length    = gadget->v4l2_m2m.capture.mem[buf.index].length;
+
+        if (gadget->uvc_dev.memory_type == V4L2_MEMORY_DMABUF) {
+            ubuf.m.fd = gadget->v4l2_m2m.capture.mem[buf.index].dmabuf_fd;
+        } else {
+            ubuf.m.userptr = (unsigned long) gadget->v4l2_m2m.capture.mem[buf.index].start;
+        }
+
+        if (ioctl(gadget->uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
+            if (errno == ENODEV) {
+                gadget->uvc_shutdown_requested = true;
+                printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n");
+            }
+
+            /* the frame is lost, let the mem2mem device fill the buffer again */
+            v4l2_m2m_release(buf.index);
+            return;
+        }
+
+        gadget->uvc_dev.qbuf_count++;
+
+        if (!gadget->uvc_dev.is_streaming) {
+            uvc_video_stream(STREAM_ON);
+            gadget->settings.blink_on_startup = 0;
+            streaming_status_value(gadget->uvc_dev.is_streaming);
+        }
+
+        CLEAR(buf);
+        buf.type   = gadget->v4l2_m2m.capture.buffer_type;
+        buf.memory = gadget->v4l2_m2m.capture.memory_type;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * RGB to YUYV conversion kernels
+ */
+
+static void rgb2yuyv_line16_c(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int yuyv;
+    unsigned char r1;
+    unsigned char b1;
+    unsigned char g1;
+    unsigned char r2;
+    unsigned char b2;
+    unsigned char g2;
+
+    while (width >= 2) {
+        b1 = (src[0] & 0x1f) << 3;
+        g1 = (((src[1] & 0x7) << 3) | (src[0] & 0xE0) >> 5) << 2;
+        r1 = (src[1] & 0xF8);
+        b2 = (src[2] & 0x1f) << 3;
+        g2 = (((src[3] & 0x7) << 3) | (src[2] & 0xE0) >> 5) << 2;
+        r2 = (src[3] & 0xF8);
+        yuyv = rgb2yuyv_pair(r1, g1, b1, r2, g2, b2);
+        memcpy(dst, &yuyv, 4);
+        src += 4;
+        dst += 4;
+        width -= 2;
+    }
+}
+
+static void rgb2yuyv_line_rgba_c(uint8_t * dst, const uint8_t * src, unsigned int width,
+    unsigned int bytes_per_pixel, bool bgr)
+{
+    unsigned int red_shift = (bgr) ? 16 : 0;
+    unsigned int blue_shift = (bgr) ? 0 : 16;
+    unsigned int rgba1 = 0;
+    unsigned int rgba2 = 0;
+    unsigned int rgba1_last = 0;
+    unsigned int rgba2_last = 0;
+    unsigned int yuyv;
+    unsigned int yuyv_last = rgb2yuyv_pair(0, 0, 0, 0, 0, 0);
+    unsigned char r1;
+    unsigned char b1;
+    unsigned char g1;
+    unsigned char r2;
+    unsigned char b2;
+    unsigned char g2;
+
+    while (width >= 2) {
+        memcpy(&rgba1, src, bytes_per_pixel);
+        memcpy(&rgba2, src + bytes_per_pixel, bytes_per_pixel);
+        if (rgba1 == rgba1_last && rgba2 == rgba2_last) {
+            memcpy(dst, &yuyv_last, 4);
+        } else {
+            r1 = (rgba1 >> red_shift) & 0xFF;
+            g1 = (rgba1 >> 8) & 0xFF;
+            b1 = (rgba1 >> blue_shift) & 0xFF;
+            r2 = (rgba2 >> red_shift) & 0xFF;
+            g2 = (rgba2 >> 8) & 0xFF;
+            b2 = (rgba2 >> blue_shift) & 0xFF;
+            yuyv = rgb2yuyv_pair(r1, g1, b1, r2, g2, b2);
+            rgba1_last = rgba1;
+            rgba2_last = rgba2;
+            yuyv_last = yuyv;
+            memcpy(dst, &yuyv, 4);
+        }
+        src += bytes_per_pixel * 2;
+        dst += 4;
+        width -= 2;
+    }
+}
+
+static void rgb2yuyv_line24_c(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    rgb2yuyv_line_rgba_c(dst, src, width, 3, false);
+}
+
+static void rgb2yuyv_line32_c(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    rgb2yuyv_line_rgba_c(dst, src, width, 4, false);
+}
+
+static void rgb2yuyv_line24_bgr_c(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    rgb2yuyv_line_rgba_c(dst, src, width, 3, true);
+}
+
+static void rgb2yuyv_line32_bgr_c(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    rgb2yuyv_line_rgba_c(dst, src, width, 4, true);
+}
+
+static const struct rgb2yuyv_kernels rgb2yuyv_kernels_c = {
+    .name       = "scalar",
+    .line16     = rgb2yuyv_line16_c,
+    .line24     = rgb2yuyv_line24_c,
+    .line32     = rgb2yuyv_line32_c,
+    .line24_bgr = rgb2yuyv_line24_bgr_c,
+    .line32_bgr = rgb2yuyv_line32_bgr_c,
+};
+
+#ifdef RGB2YUYV_X86
+/*
+ * SSE2 / AVX2 kernels
+ *
+ * Channels are expanded to 16-bit lanes in pixel order. Every 32-bit lane
+ * then holds one pixel pair, so Y of both pixels and the shared V and U
+ * samples can be computed and packed without crossing 32-bit lanes.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i yuyv_pack_sse2(__m128i r, __m128i g, __m128i b)
+{
+    const __m128i lo16 = _mm_set1_epi32(0x0000ffff);
+    const __m128i lo8  = _mm_set1_epi32(0x000000ff);
+    const __m128i c128 = _mm_set1_epi16(128);
+    __m128i y;
+    __m128i r12;
+    __m128i g12;
+    __m128i b12;
+    __m128i v;
+    __m128i u;
+
+    y = _mm_add_epi16(_mm_add_epi16(_mm_srli_epi16(r, 2), _mm_srli_epi16(g, 1)),
+        _mm_add_epi16(_mm_srli_epi16(b, 3), _mm_set1_epi16(16)));
+
+    r12 = _mm_srli_epi32(_mm_add_epi32(_mm_and_si128(r, lo16), _mm_srli_epi32(r, 16)), 1);
+    g12 = _mm_srli_epi32(_mm_add_epi32(_mm_and_si128(g, lo16), _mm_srli_epi32(g, 16)), 1);
+    b12 = _mm_srli_epi32(_mm_add_epi32(_mm_and_si128(b, lo16), _mm_srli_epi32(b, 16)), 1);
+
+    v = _mm_sub_epi16(_mm_mullo_epi16(r12, _mm_set1_epi16(112)),
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(g12, _mm_set1_epi16(94)),
+        _mm_mullo_epi16(b12, _mm_set1_epi16(18))), c128));
+    v = _mm_and_si128(_mm_add_epi16(_mm_srai_epi16(v, 8), c128), lo8);
+
+    u = _mm_sub_epi16(_mm_mullo_epi16(b12, _mm_set1_epi16(112)),
+        _mm_add_epi16(_mm_mullo_epi16(r12, _mm_set1_epi16(38)),
+        _mm_mullo_epi16(g12, _mm_set1_epi16(74))));
+    u = _mm_and_si128(_mm_add_epi16(_mm_srai_epi16(u, 8), c128), lo8);
+
+    return _mm_or_si128(y, _mm_slli_epi32(_mm_or_si128(u, _mm_slli_epi32(v, 16)), 8));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i yuyv_from_xrgb_sse2(__m128i p0, __m128i p1, bool bgr)
+{
+    const __m128i lo8 = _mm_set1_epi32(0x000000ff);
+    __m128i r = _mm_packs_epi32(_mm_and_si128(p0, lo8), _mm_and_si128(p1, lo8));
+    __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), lo8),
+        _mm_and_si128(_mm_srli_epi32(p1, 8), lo8));
+    __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), lo8),
+        _mm_and_si128(_mm_srli_epi32(p1, 16), lo8));
+
+    return (bgr) ? yuyv_pack_sse2(b, g, r) : yuyv_pack_sse2(r, g, b);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i xrgb_from_rgb24_sse2(const uint8_t * src)
+{
+    __m128i p = _mm_loadu_si128((const __m128i *) src);
+
+    return _mm_unpacklo_epi64(
+        _mm_unpacklo_epi32(p, _mm_srli_si128(p, 3)),
+        _mm_unpacklo_epi32(_mm_srli_si128(p, 6), _mm_srli_si128(p, 9)));
+}
+
+__attribute__((target("sse2")))
+static void rgb2yuyv_line16_sse2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    __m128i p;
+    __m128i r;
+    __m128i g;
+    __m128i b;
+
+    for (; x + 8 <= width; x += 8) {
+        p = _mm_loadu_si128((const __m128i *) (src + x * 2));
+        b = _mm_slli_epi16(_mm_and_si128(p, _mm_set1_epi16(0x001f)), 3);
+        g = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16(0x003f)), 2);
+        r = _mm_and_si128(_mm_srli_epi16(p, 8), _mm_set1_epi16(0x00f8));
+        _mm_storeu_si128((__m128i *) (dst + x * 2), yuyv_pack_sse2(r, g, b));
+    }
+    rgb2yuyv_line16_c(dst + x * 2, src + x * 2, width - x);
+}
+
+__attribute__((target("sse2")))
+static void rgb2yuyv_line24_sse2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    /* 16 byte loads read 4 bytes past the 8 pixels, keep them inside the line */
+    for (; x + 10 <= width; x += 8) {
+        _mm_storeu_si128((__m128i *) (dst + x * 2), yuyv_from_xrgb_sse2(
+            xrgb_from_rgb24_sse2(src + x * 3), xrgb_from_rgb24_sse2(src + x * 3 + 12), false));
+    }
+    rgb2yuyv_line24_c(dst + x * 2, src + x * 3, width - x);
+}
+
+__attribute__((target("sse2")))
+static void rgb2yuyv_line32_sse2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        _mm_storeu_si128((__m128i *) (dst + x * 2), yuyv_from_xrgb_sse2(
+            _mm_loadu_si128((const __m128i *) (src + x * 4)),
+            _mm_loadu_si128((const __m128i *) (src + x * 4 + 16)), false));
+    }
+    rgb2yuyv_line32_c(dst + x * 2, src + x * 4, width - x);
+}
+
+__attribute__((target("sse2")))
+static void rgb2yuyv_line24_bgr_sse2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 10 <= width; x += 8) {
+        _mm_storeu_si128((__m128i *) (dst + x * 2), yuyv_from_xrgb_sse2(
+            xrgb_from_rgb24_sse2(src + x * 3), xrgb_from_rgb24_sse2(src + x * 3 + 12), true));
+    }
+    rgb2yuyv_line24_bgr_c(dst + x * 2, src + x * 3, width - x);
+}
+
+__attribute__((target("sse2")))
+static void rgb2yuyv_line32_bgr_sse2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        _mm_storeu_si128((__m128i *) (dst + x * 2), yuyv_from_xrgb_sse2(
+            _mm_loadu_si128((const __m128i *) (src + x * 4)),
+            _mm_loadu_si128((const __m128i *) (src + x * 4 + 16)), true));
+    }
+    rgb2yuyv_line32_bgr_c(dst + x * 2, src + x * 4, width - x);
+}
+
+static const struct rgb2yuyv_kernels rgb2yuyv_kernels_sse2 = {
+    .name       = "sse2",
+    .line16     = rgb2yuyv_line16_sse2,
+    .line24     = rgb2yuyv_line24_sse2,
+    .line32     = rgb2yuyv_line32_sse2,
+    .line24_bgr = rgb2yuyv_line24_bgr_sse2,
+    .line32_bgr = rgb2yuyv_line32_bgr_sse2,
+};
+
+__attribute__((target("avx2")))
+static inline __m256i yuyv_pack_avx2(__m256i r, __m256i g, __m256i b)
+{
+    const __m256i lo16 = _mm256_set1_epi32(0x0000ffff);
+    const __m256i lo8  = _mm256_set1_epi32(0x000000ff);
+    const __m256i c128 = _mm256_set1_epi16(128);
+    __m256i y;
+    __m256i r12;
+    __m256i g12;
+    __m256i b12;
+    __m256i v;
+    __m256i u;
+
+    y = _mm256_add_epi16(_mm256_add_epi16(_mm256_srli_epi16(r, 2), _mm256_srli_epi16(g, 1)),
+        _mm256_add_epi16(_mm256_srli_epi16(b, 3), _mm256_set1_epi16(16)));
+
+    r12 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(r, lo16), _mm256_srli_epi32(r, 16)), 1);
+    g12 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(g, lo16), _mm256_srli_epi32(g, 16)), 1);
+    b12 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(b, lo16), _mm256_srli_epi32(b, 16)), 1);
+
+    v = _mm256_sub_epi16(_mm256_mullo_epi16(r12, _mm256_set1_epi16(112)),
+        _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(g12, _mm256_set1_epi16(94)),
+        _mm256_mullo_epi16(b12, _mm256_set1_epi16(18))), c128));
+    v = _mm256_and_si256(_mm256_add_epi16(_mm256_srai_epi16(v, 8), c128), lo8);
+
+    u = _mm256_sub_epi16(_mm256_mullo_epi16(b12, _mm256_set1_epi16(112)),
+        _mm256_add_epi16(_mm256_mullo_epi16(r12, _mm256_set1_epi16(38)),
+        _mm256_mullo_epi16(g12, _mm256_set1_epi16(74))));
+    u = _mm256_and_si256(_mm256_add_epi16(_mm256_srai_epi16(u, 8), c128), lo8);
+
+    return _mm256_or_si256(y, _mm256_slli_epi32(_mm256_or_si256(u, _mm256_slli_epi32(v, 16)), 8));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i yuyv_from_xrgb_avx2(__m256i p0, __m256i p1, bool bgr)
+{
+    const __m256i lo8 = _mm256_set1_epi32(0x000000ff);
+    __m256i r = _mm256_packs_epi32(_mm256_and_si256(p0, lo8), _mm256_and_si256(p1, lo8));
+    __m256i g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), lo8),
+        _mm256_and_si256(_mm256_srli_epi32(p1, 8), lo8));
+    __m256i b = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), lo8),
+        _mm256_and_si256(_mm256_srli_epi32(p1, 16), lo8));
+
+    /* packs works per 128-bit lane, restore pixel order of the pairs */
+    return _mm256_permute4x64_epi64((bgr) ? yuyv_pack_avx2(b, g, r) : yuyv_pack_avx2(r, g, b), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xrgb_from_rgb24_avx2(const uint8_t * src)
+{
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i expand = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i p = _mm256_loadu_si256((const __m256i *) src);
+
+    return _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(p, spread), expand);
+}
+
+__attribute__((target("avx2")))
+static void rgb2yuyv_line16_avx2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    __m256i p;
+    __m256i r;
+    __m256i g;
+    __m256i b;
+
+    for (; x + 16 <= width; x += 16) {
+        p = _mm256_loadu_si256((const __m256i *) (src + x * 2));
+        b = _mm256_slli_epi16(_mm256_and_si256(p, _mm256_set1_epi16(0x001f)), 3);
+        g = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(p, 5), _mm256_set1_epi16(0x003f)), 2);
+        r = _mm256_and_si256(_mm256_srli_epi16(p, 8), _mm256_set1_epi16(0x00f8));
+        _mm256_storeu_si256((__m256i *) (dst + x * 2), yuyv_pack_avx2(r, g, b));
+    }
+    rgb2yuyv_line16_sse2(dst + x * 2, src + x * 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb2yuyv_line24_avx2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    /* 32 byte loads read 8 bytes past the 8 pixels, keep them inside the line */
+    for (; x + 19 <= width; x += 16) {
+        _mm256_storeu_si256((__m256i *) (dst + x * 2), yuyv_from_xrgb_avx2(
+            xrgb_from_rgb24_avx2(src + x * 3), xrgb_from_rgb24_avx2(src + x * 3 + 24), false));
+    }
+    rgb2yuyv_line24_sse2(dst + x * 2, src + x * 3, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb2yuyv_line32_avx2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        _mm256_storeu_si256((__m256i *) (dst + x * 2), yuyv_from_xrgb_avx2(
+            _mm256_loadu_si256((const __m256i *) (src + x * 4)),
+            _mm256_loadu_si256((const __m256i *) (src + x * 4 + 32)), false));
+    }
+    rgb2yuyv_line32_sse2(dst + x * 2, src + x * 4, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb2yuyv_line24_bgr_avx2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 19 <= width; x += 16) {
+        _mm256_storeu_si256((__m256i *) (dst + x * 2), yuyv_from_xrgb_avx2(
+            xrgb_from_rgb24_avx2(src + x * 3), xrgb_from_rgb24_avx2(src + x * 3 + 24), true));
+    }
+    rgb2yuyv_line24_bgr_sse2(dst + x * 2, src + x * 3, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rgb2yuyv_line32_bgr_avx2(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        _mm256_storeu_si256((__m256i *) (dst + x * 2), yuyv_from_xrgb_avx2(
+            _mm256_loadu_si256((const __m256i *) (src + x * 4)),
+            _mm256_loadu_si256((const __m256i *) (src + x * 4 + 32)), true));
+    }
+    rgb2yuyv_line32_bgr_sse2(dst + x * 2, src + x * 4, width - x);
+}
+
+static const struct rgb2yuyv_kernels rgb2yuyv_kernels_avx2 = {
+    .name       = "avx2",
+    .line16     = rgb2yuyv_line16_avx2,
+    .line24     = rgb2yuyv_line24_avx2,
+    .line32     = rgb2yuyv_line32_avx2,
+    .line24_bgr = rgb2yuyv_line24_bgr_avx2,
+    .line32_bgr = rgb2yuyv_line32_bgr_avx2,
+};
+#endif /* RGB2YUYV_X86 */
+
+#ifdef RGB2YUYV_NEON
+/*
+ * NEON kernels
+ *
+ * Sixteen pixels are deinterleaved per iteration, even and odd pixels are
+ * split with vuzp and the result is interleaved back with vst4.
+ */
+
+static inline uint8x8_t yuyv_luma_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+    return vadd_u8(vadd_u8(vshr_n_u8(r, 2), vshr_n_u8(g, 1)),
+        vadd_u8(vshr_n_u8(b, 3), vdup_n_u8(16)));
+}
+
+static inline void yuyv_store_neon(uint8_t * dst, uint8x16_t r, uint8x16_t g, uint8x16_t b)
+{
+    uint8x8x2_t rr = vuzp_u8(vget_low_u8(r), vget_high_u8(r));
+    uint8x8x2_t gg = vuzp_u8(vget_low_u8(g), vget_high_u8(g));
+    uint8x8x2_t bb = vuzp_u8(vget_low_u8(b), vget_high_u8(b));
+    int16x8_t r12 = vreinterpretq_s16_u16(vmovl_u8(vhadd_u8(rr.val[0], rr.val[1])));
+    int16x8_t g12 = vreinterpretq_s16_u16(vmovl_u8(vhadd_u8(gg.val[0], gg.val[1])));
+    int16x8_t b12 = vreinterpretq_s16_u16(vmovl_u8(vhadd_u8(bb.val[0], bb.val[1])));
+    int16x8_t v;
+    int16x8_t u;
+    uint8x8x4_t out;
+
+    v = vmulq_n_s16(r12, 112);
+    v = vmlsq_n_s16(v, g12, 94);
+    v = vmlsq_n_s16(v, b12, 18);
+    v = vaddq_s16(vshrq_n_s16(vsubq_s16(v, vdupq_n_s16(128)), 8), vdupq_n_s16(128));
+
+    u = vmulq_n_s16(b12, 112);
+    u = vmlsq_n_s16(u, r12, 38);
+    u = vmlsq_n_s16(u, g12, 74);
+    u = vaddq_s16(vshrq_n_s16(u, 8), vdupq_n_s16(128));
+
+    out.val[0] = yuyv_luma_neon(rr.val[0], gg.val[0], bb.val[0]);
+    out.val[1] = vmovn_u16(vreinterpretq_u16_s16(u));
+    out.val[2] = yuyv_luma_neon(rr.val[1], gg.val[1], bb.val[1]);
+    out.val[3] = vmovn_u16(vreinterpretq_u16_s16(v));
+
+    vst4_u8(dst, out);
+}
+
+static void rgb2yuyv_line16_neon(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    uint8x16x2_t p;
+    uint8x16_t r;
+    uint8x16_t g;
+    uint8x16_t b;
+
+    for (; x + 16 <= width; x += 16) {
+        p = vld2q_u8(src + x * 2);
+        b = vshlq_n_u8(p.val[0], 3);
+        g = vorrq_u8(vshlq_n_u8(p.val[1], 5), vshlq_n_u8(vshrq_n_u8(p.val[0], 5), 2));
+        r = vandq_u8(p.val[1], vdupq_n_u8(0xf8));
+        yuyv_store_neon(dst + x * 2, r, g, b);
+    }
+    rgb2yuyv_line16_c(dst + x * 2, src + x * 2, width - x);
+}
+
+static void rgb2yuyv_line24_neon(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    uint8x16x3_t p;
+
+    for (; x + 16 <= width; x += 16) {
+        p = vld3q_u8(src + x * 3);
+        yuyv_store_neon(dst + x * 2, p.val[0], p.val[1], p.val[2]);
+    }
+    rgb2yuyv_line24_c(dst + x * 2, src + x * 3, width - x);
+}
+
+static void rgb2yuyv_line32_neon(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    uint8x16x4_t p;
+
+    for (; x + 16 <= width; x += 16) {
+        p = vld4q_u8(src + x * 4);
+        yuyv_store_neon(dst + x * 2, p.val[0], p.val[1], p.val[2]);
+    }
+    rgb2yuyv_line32_c(dst + x * 2, src + x * 4, width - x);
+}
+
+static void rgb2yuyv_line24_bgr_neon(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    uint8x16x3_t p;
+
+    for (; x + 16 <= width; x += 16) {
+        p = vld3q_u8(src + x * 3);
+        yuyv_store_neon(dst + x * 2, p.val[2], p.val[1], p.val[0]);
+    }
+    rgb2yuyv_line24_bgr_c(dst + x * 2, src + x * 3, width - x);
+}
+
+static void rgb2yuyv_line32_bgr_neon(uint8_t * dst, const uint8_t * src, unsigned int width)
+{
+    unsigned int x = 0;
+    uint8x16x4_t p;
+
+    for (; x + 16 <= width; x += 16) {
+        p = vld4q_u8(src + x * 4);
+        yuyv_store_neon(dst + x * 2, p.val[2], p.val[1], p.val[0]);
+    }
+    rgb2yuyv_line32_bgr_c(dst + x * 2, src + x * 4, width - x);
+}
+
+static const struct rgb2yuyv_kernels rgb2yuyv_kernels_neon = {
+    .name       = "neon",
+    .line16     = rgb2yuyv_line16_neon,
+    .line24     = rgb2yuyv_line24_neon,
+    .line32     = rgb2yuyv_line32_neon,
+    .line24_bgr = rgb2yuyv_line24_bgr_neon,
+    .line32_bgr = rgb2yuyv_line32_bgr_neon,
+};
+#endif /* RGB2YUYV_NEON */
+
+static struct rgb2yuyv_kernels rgb2yuyv;
+
+static const struct rgb2yuyv_kernels * rgb2yuyv_detect_kernels()
+{
+#ifdef RGB2YUYV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &rgb2yuyv_kernels_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return &rgb2yuyv_kernels_sse2;
+    }
+#endif
+
+#ifdef RGB2YUYV_NEON
+#ifdef __arm__
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        return &rgb2yuyv_kernels_neon;
+    }
+#else
+    return &rgb2yuyv_kernels_neon;
+#endif
+#endif
+
+    return &rgb2yuyv_kernels_c;
+}
+
+/*
+ * Startup safety net only, a kernel that differs falls back to scalar. The
+ * kernels are tested against the scalar reference by tests/convert-test.c
+ * (make check).
+ */
+static bool rgb2yuyv_verify_kernel(rgb2yuyv_line_fn kernel, rgb2yuyv_line_fn reference,
+    unsigned int bytes_per_pixel)
+{
+    /* odd width exercises the scalar tails of the vectorized kernels */
+    const unsigned int width = 1021;
+    uint8_t * src = malloc(width * bytes_per_pixel);
+    uint8_t * expected = malloc(width * 2);
+    uint8_t * result = malloc(width * 2);
+    unsigned int seed = 0x12345678;
+    unsigned int i;
+    bool ret = false;
+
+    if (src && expected && result) {
+        for (i = 0; i < width * bytes_per_pixel; i++) {
+            seed = seed * 1103515245 + 12345;
+            src[i] = seed >> 16;
+        }
+        /* keep some equal pixel pairs for the cached path of the scalar kernels */
+        memset(src + 64 * bytes_per_pixel, 0xff, 32 * bytes_per_pixel);
+
+        memset(expected, 0, width * 2);
+        memset(result, 0, width * 2);
+        reference(expected, src, width);
+        kernel(result, src, width);
+        ret = !memcmp(expected, result, width * 2);
+    }
+
+    free(src);
+    free(expected);
+    free(result);
+    return ret;
+}
+
+static void rgb2yuyv_init()
+{
+    const struct rgb2yuyv_kernels * detected = rgb2yuyv_detect_kernels();
+
+    rgb2yuyv = *detected;
+
+    if (detected == &rgb2yuyv_kernels_c) {
+        printf("CONVERT: Using %s RGB to YUYV kernels\n", rgb2yuyv.name);
+        return;
+    }
+
+    if (!rgb2yuyv_verify_kernel(rgb2yuyv.line16, rgb2yuyv_kernels_c.line16, 2)) {
+        printf("CONVERT: %s 16 bpp kernel differs from scalar reference, disabled\n", rgb2yuyv.name);
+        rgb2yuyv.line16 = rgb2yuyv_kernels_c.line16;
+    }
+
+    if (!rgb2yuyv_verify_kernel(rgb2yuyv.line24, rgb2yuyv_kernels_c.line24, 3)) {
+        printf("CONVERT: %s 24 bpp kernel differs from scalar reference, disabled\n", rgb2yuyv.name);
+        rgb2yuyv.line24 = rgb2yuyv_kernels_c.line24;
+    }
+
+    if (!rgb2yuyv_verify_kernel(rgb2yuyv.line32, rgb2yuyv_kernels_c.line32, 4)) {
+        printf("CONVERT: %s 32 bpp kernel differs from scalar reference, disabled\n", rgb2yuyv.name);
+        rgb2yuyv.line32 = rgb2yuyv_kernels_c.line32;
+    }
+
+    if (!rgb2yuyv_verify_kernel(rgb2yuyv.line24_bgr, rgb2yuyv_kernels_c.line24_bgr, 3)) {
+        printf("CONVERT: %s 24 bpp BGR kernel differs from scalar reference, disabled\n", rgb2yuyv.name);
+        rgb2yuyv.line24_bgr = rgb2yuyv_kernels_c.line24_bgr;
+    }
+
+    if (!rgb2yuyv_verify_kernel(rgb2yuyv.line32_bgr, rgb2yuyv_kernels_c.line32_bgr, 4)) {
+        printf("CONVERT: %s 32 bpp BGR kernel differs from scalar reference, disabled\n", rgb2yuyv.name);
+        rgb2yuyv.line32_bgr = rgb2yuyv_kernels_c.line32_bgr;
+    }
+
+    printf("CONVERT: Using %s RGB to YUYV kernels\n", rgb2yuyv.name);
+}
+
+/* 'bgr' selects 32 bpp pixels with blue in the lowest byte (DRM XRGB8888) */
+static rgb2yuyv_line_fn rgb2yuyv_line_kernel(unsigned int bpp, bool bgr)
+{
+    if (bgr) {
+        switch (bpp) {
+        case 24:
+            return rgb2yuyv.line24_bgr;
+
+        case 32:
+            return rgb2yuyv.line32_bgr;
+        }
+        return NULL;
+    }
+
+    switch (bpp) {
+    case 16:
+        return rgb2yuyv.line16;
+
+    case 24:
+        return rgb2yuyv.line24;
+
+    case 32:
+        return rgb2yuyv.line32;
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer conversion worker pool
+ */
+
+/* CPUs taken by pinned pools, the pools of several gadgets don't share CPUs */
+static unsigned int fb_pool_pinned_cpus;
+
+static unsigned int fb_pool_stripe_line(unsigned int stripe, unsigned int nstripes,
+    unsigned int lines)
+{
+    if (stripe >= nstripes) {
+        return lines;
+    }
+    return (lines * stripe / nstripes) & ~(gadget->fb_pool.line_align - 1);
+}
+
+static void fb_pool_pin_thread(pthread_t thread, unsigned int cpu)
+{
+    cpu_set_t cpuset;
+    int ret;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+
+    ret = pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+    if (ret) {
+        printf("FB: Unable to pin thread to CPU %u: %s (%d).\n", cpu, strerror(ret), ret);
+    }
+}
+
+static void * fb_pool_worker(void * arg)
+{
+    struct fb_worker * worker = arg;
+    unsigned int generation = 0;
+
+    gadget = worker->gadget;
+
+    pthread_mutex_lock(&gadget->fb_pool.lock);
+    while (true) {
+        while (!gadget->fb_pool.shutdown && gadget->fb_pool.generation == generation) {
+            pthread_cond_wait(&gadget->fb_pool.start, &gadget->fb_pool.lock);
+        }
+
+        if (gadget->fb_pool.shutdown) {
+            break;
+        }
+
+        generation = gadget->fb_pool.generation;
+        pthread_mutex_unlock(&gadget->fb_pool.lock);
+
+        gadget->fb_pool.job(gadget->fb_pool.job_data, worker->first_line, worker->last_line);
+
+        pthread_mutex_lock(&gadget->fb_pool.lock);
+        if (--gadget->fb_pool.pending == 0) {
+            pthread_cond_signal(&gadget->fb_pool.done);
+        }
+    }
+    pthread_mutex_unlock(&gadget->fb_pool.lock);
+
+    return NULL;
+}
+
+static int fb_pool_start(unsigned int nthreads, bool pin_threads)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int first_cpu = fb_pool_pinned_cpus;
+    unsigned int needed;
+    unsigned int i;
+    int ret;
+
+    gadget->fb_pool.nworkers = 0;
+    gadget->fb_pool.generation = 0;
+    gadget->fb_pool.pending = 0;
+    gadget->fb_pool.shutdown = false;
+
+    /*
+     * The calling thread converts the last stripe. It runs the loop of every
+     * gadget, only the first pinned pool pins it.
+     */
+    needed = (first_cpu) ? nthreads - 1 : nthreads;
+    if (pin_threads && first_cpu + needed > (unsigned long) max(cpus, 1)) {
+        printf("FB: %u CPUs left for %u pinned threads, threads not pinned\n",
+            (unsigned int) max(cpus - first_cpu, 0), needed);
+        pin_threads = false;
+    }
+
+    if (pin_threads) {
+        fb_pool_pinned_cpus += needed;
+        if (!first_cpu) {
+            fb_pool_pin_thread(pthread_self(), nthreads - 1);
+        }
+    }
+
+    if (nthreads < 2) {
+        return 0;
+    }
+
+    pthread_mutex_init(&gadget->fb_pool.lock, NULL);
+    pthread_cond_init(&gadget->fb_pool.start, NULL);
+    pthread_cond_init(&gadget->fb_pool.done, NULL);
+
+    for (i = 0; i < nthreads - 1; i++) {
+        gadget->fb_pool.workers[i].index = i;
+        gadget->fb_pool.workers[i].gadget = gadget;
+
+        ret = pthread_create(&gadget->fb_pool.workers[i].thread, NULL, fb_pool_worker, &gadget->fb_pool.workers[i]);
+        if (ret) {
+            printf("FB: Unable to start worker %u: %s (%d).\n", i, strerror(ret), ret);
+            break;
+        }
+
+        if (pin_threads) {
+            fb_pool_pin_thread(gadget->fb_pool.workers[i].thread, first_cpu + i);
+        }
+        gadget->fb_pool.nworkers++;
+    }
+
+    printf("FB: Converting frames in %u stripes\n", gadget->fb_pool.nworkers + 1);
+    return 0;
+}
+
+static void fb_pool_stop()
+{
+    unsigned int i;
+
+    if (!gadget->fb_pool.nworkers) {
+        return;
+    }
+
+    pthread_mutex_lock(&gadget->fb_pool.lock);
+    gadget->fb_pool.shutdown = true;
+    pthread_cond_broadcast(&gadget->fb_pool.start);
+    pthread_mutex_unlock(&gadget->fb_pool.lock);
+
+    for (i = 0; i < gadget->fb_pool.nworkers; i++) {
+        pthread_join(gadget->fb_pool.workers[i].thread, NULL);
+    }
+    gadget->fb_pool.nworkers = 0;
+
+    pthread_cond_destroy(&gadget->fb_pool.done);
+    pthread_cond_destroy(&gadget->fb_pool.start);
+    pthread_mutex_destroy(&gadget->fb_pool.lock);
+}
+
+/*
+ * Splits 'lines' into horizontal stripes and runs 'job' on all of them.
+ * Stripe boundaries are multiples of 'line_align' (power of two).
+ * Returns after every stripe has been processed.
+ */
+static void fb_pool_run(fb_stripe_fn job, void * data, unsigned int lines,
+    unsigned int line_align)
+{
+    unsigned int nstripes = gadget->fb_pool.nworkers + 1;
+    unsigned int i;
+
+    if (!gadget->fb_pool.nworkers) {
+        gadget->fb_pool.next_slot = 0;
+        job(data, 0, lines);
+        return;
+    }
+
+    pthread_mutex_lock(&gadget->fb_pool.lock);
+    gadget->fb_pool.line_align = line_align;
+    for (i = 0; i < gadget->fb_pool.nworkers; i++) {
+        gadget->fb_pool.workers[i].first_line = fb_pool_stripe_line(i, nstripes, lines);
+        gadget->fb_pool.workers[i].last_line  = fb_pool_stripe_line(i + 1, nstripes, lines);
+    }
+    gadget->fb_pool.job       = job;
+    gadget->fb_pool.job_data  = data;
+    gadget->fb_pool.next_slot = 0;
+    gadget->fb_pool.pending   = gadget->fb_pool.nworkers;
+    gadget->fb_pool.generation++;
+    pthread_cond_broadcast(&gadget->fb_pool.start);
+    pthread_mutex_unlock(&gadget->fb_pool.lock);
+
+    job(data, fb_pool_stripe_line(gadget->fb_pool.nworkers, nstripes, lines), lines);
+
+    pthread_mutex_lock(&gadget->fb_pool.lock);
+    while (gadget->fb_pool.pending) {
+        pthread_cond_wait(&gadget->fb_pool.done, &gadget->fb_pool.lock);
+    }
+    pthread_mutex_unlock(&gadget->fb_pool.lock);
+}
+
+/*
+ * Returns a scratch buffer index (below fb_pool.nworkers + 1) unique to the
+ * calling stripe of the running job. Call it at most once per stripe.
+ */
+static unsigned int fb_pool_slot()
+{
+    return __atomic_fetch_add(&gadget->fb_pool.next_slot, 1, __ATOMIC_RELAXED);
+}
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer staging
+ *
+ * Framebuffer mappings are often uncached or write-combined, so the many
+ * small reads of the conversion kernels stall. With staging, a chunk of lines
+ * is first copied to a cacheable buffer with one large memcpy and converted
+ * from there. Stripes run concurrently, so the copy of one stripe overlaps
+ * with the conversion of another.
+ */
+
+static void fb_stage_uninit()
+{
+    unsigned int i;
+
+    for (i = 0; i < gadget->fb_stage.slots; i++) {
+        free(gadget->fb_stage.buffers[i]);
+    }
+    CLEAR(gadget->fb_stage);
+}
+
+static int fb_stage_init()
+{
+    unsigned int i;
+
+    CLEAR(gadget->fb_stage);
+
+    gadget->fb_stage.lines = max(FB_STAGE_SIZE / gadget->fb_dev.fb_line_length, 1u);
+    gadget->fb_stage.slots = gadget->fb_pool.nworkers + 1;
+
+    for (i = 0; i < gadget->fb_stage.slots; i++) {
+        gadget->fb_stage.buffers[i] = aligned_alloc(64,
+            (gadget->fb_stage.lines * gadget->fb_dev.fb_line_length + 63) & ~63u);
+        if (!gadget->fb_stage.buffers[i]) {
+            printf("FB: Out of memory for staging\n");
+            fb_stage_uninit();
+            return -ENOMEM;
+        }
+    }
+
+    gadget->fb_stage.enabled = true;
+
+    printf("FB: Staging %u lines per copy\n", gadget->fb_stage.lines);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer scaler
+ *
+ * Each output line is resampled vertically into a line of 16 bit sums at the
+ * source width, then horizontally into a 24 or 32 bpp line which goes through
+ * the regular RGB to YUYV kernel. Nothing larger than a line is buffered.
+ */
+
+typedef uint8_t fb_u8x8 __attribute__((vector_size(8)));
+typedef uint16_t fb_u16x8 __attribute__((vector_size(16)));
+
+static const char * fb_scale_filter_name(enum fb_scale_filter filter)
+{
+    return (filter == FB_SCALE_BILINEAR) ? "bilinear" : "box";
+}
+
+/* Source position of the centre of output pixel 'pos', in 1/256 of a pixel */
+static unsigned int fb_scale_position(unsigned int pos, unsigned int src_size, unsigned int dst_size)
+{
+    int64_t position = (int64_t) (2 * pos + 1) * src_size * 256 / (2 * dst_size) - 128;
+
+    if (position < 0) {
+        return 0;
+    }
+    return min(position, (int64_t) (src_size - 1) * 256);
+}
+
+/*
+ * Returns framebuffer line 'line' with fb_scaler.channels bytes per pixel,
+ * RGB565 lines are unpacked to 'unpacked' first.
+ */
+static const uint8_t * fb_scale_source_line(const uint8_t * src, unsigned int line,
+    uint8_t * unpacked)
+{
+    const uint8_t * pixels = src + line * gadget->fb_dev.fb_line_length;
+    uint16_t rgb;
+    unsigned int x;
+
+    if (gadget->fb_dev.fb_bpp != 16) {
+        return pixels;
+    }
+
+    for (x = 0; x < gadget->fb_dev.fb_width; x++) {
+        rgb = pixels[x * 2] | (pixels[x * 2 + 1] << 8);
+        unpacked[x * 3]     = (rgb >> 8) & 0xf8;
+        unpacked[x * 3 + 1] = (rgb >> 3) & 0xfc;
+        unpacked[x * 3 + 2] = (rgb << 3) & 0xf8;
+    }
+    return unpacked;
+}
+
+static void fb_scale_rows_copy(uint16_t * rows, const uint8_t * src, unsigned int size)
+{
+    fb_u8x8 pixels;
+    fb_u16x8 sum;
+    unsigned int i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&pixels, src + i, sizeof(pixels));
+        sum = __builtin_convertvector(pixels, fb_u16x8);
+        memcpy(rows + i, &sum, sizeof(sum));
+    }
+    for (; i < size; i++) {
+        rows[i] = src[i];
+    }
+}
+
+static void fb_scale_rows_add(uint16_t * rows, const uint8_t * src, unsigned int size)
+{
+    fb_u8x8 pixels;
+    fb_u16x8 sum;
+    unsigned int i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&pixels, src + i, sizeof(pixels));
+        memcpy(&sum, rows + i, sizeof(sum));
+        sum += __builtin_convertvector(pixels, fb_u16x8);
+        memcpy(rows + i, &sum, sizeof(sum));
+    }
+    for (; i < size; i++) {
+        rows[i] += src[i];
+    }
+}
+
+static void fb_scale_rows_blend(uint16_t * rows, const uint8_t * src0, const uint8_t * src1,
+    unsigned int weight, unsigned int size)
+{
+    uint16_t weight0 = 256 - weight;
+    uint16_t weight1 = weight;
+    fb_u8x8 pixels0;
+    fb_u8x8 pixels1;
+    fb_u16x8 sum;
+    unsigned int i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&pixels0, src0 + i, sizeof(pixels0));
+        memcpy(&pixels1, src1 + i, sizeof(pixels1));
+        sum = __builtin_convertvector(pixels0, fb_u16x8) * weight0 +
+            __builtin_convertvector(pixels1, fb_u16x8) * weight1;
+        memcpy(rows + i, &sum, sizeof(sum));
+    }
+    for (; i < size; i++) {
+        rows[i] = src0[i] * weight0 + src1[i] * weight1;
+    }
+}
+
+static void fb_scale_line_box(uint8_t * line, const uint16_t * rows, unsigned int nrows)
+{
+    unsigned int channels = gadget->fb_scaler.channels;
+    uint32_t row_factor = (65536 + nrows / 2) / nrows;
+    uint32_t sum[4];
+    unsigned int x;
+    unsigned int col;
+    unsigned int c;
+
+    for (x = 0; x < gadget->fb_scaler.width; x++) {
+        sum[0] = sum[1] = sum[2] = sum[3] = 0;
+        for (col = gadget->fb_scaler.x_first[x]; col < gadget->fb_scaler.x_last[x]; col++) {
+            for (c = 0; c < channels; c++) {
+                sum[c] += rows[col * channels + c];
+            }
+        }
+        for (c = 0; c < channels; c++) {
+            line[x * channels + c] = ((uint64_t) sum[c] * gadget->fb_scaler.x_factor[x] * row_factor +
+                (1ull << 31)) >> 32;
+        }
+    }
+}
+
+static void fb_scale_line_bilinear(uint8_t * line, const uint16_t * rows)
+{
+    unsigned int channels = gadget->fb_scaler.channels;
+    const uint16_t * left;
+    const uint16_t * right;
+    uint32_t weight;
+    unsigned int x;
+    unsigned int c;
+
+    for (x = 0; x < gadget->fb_scaler.width; x++) {
+        left   = rows + gadget->fb_scaler.x_first[x] * channels;
+        right  = rows + gadget->fb_scaler.x_last[x] * channels;
+        weight = gadget->fb_scaler.x_factor[x];
+        for (c = 0; c < channels; c++) {
+            line[x * channels + c] = (left[c] * (256 - weight) + right[c] * weight + 32768) >> 16;
+        }
+    }
+}
+
+/*
+ * Resamples framebuffer 'src' to output lines first_line..last_line and
+ * converts them to YUYV in 'dst'.
+ */
+static void fb_scale_lines(uint8_t * dst, const uint8_t * src, unsigned int first_line,
+    unsigned int last_line)
+{
+    unsigned int slot = fb_pool_slot();
+    unsigned int row_size = gadget->fb_dev.fb_width * gadget->fb_scaler.channels;
+    uint8_t * unpacked = gadget->fb_scaler.unpacked[slot];
+    uint16_t * rows = gadget->fb_scaler.rows[slot];
+    uint8_t * line = gadget->fb_scaler.line[slot];
+    unsigned int line_size = gadget->fb_scaler.width * 2;
+    unsigned int position;
+    unsigned int first;
+    unsigned int last;
+    unsigned int row;
+    unsigned int y;
+
+    for (y = first_line; y < last_line; y++) {
+        if (gadget->fb_scaler.filter == FB_SCALE_BOX) {
+            first = y * gadget->fb_dev.fb_height / gadget->fb_scaler.height;
+            last  = max((y + 1) * gadget->fb_dev.fb_height / gadget->fb_scaler.height, first + 1);
+
+            fb_scale_rows_copy(rows, fb_scale_source_line(src, first, unpacked), row_size);
+            for (row = first + 1; row < last; row++) {
+                fb_scale_rows_add(rows, fb_scale_source_line(src, row, unpacked), row_size);
+            }
+            fb_scale_line_box(line, rows, last - first);
+
+        } else {
+            position = fb_scale_position(y, gadget->fb_dev.fb_height, gadget->fb_scaler.height);
+            first    = position >> 8;
+            last     = min(first + 1, gadget->fb_dev.fb_height - 1);
+
+            fb_scale_rows_blend(rows,
+                fb_scale_source_line(src, first, unpacked),
+                fb_scale_source_line(src, last, unpacked + row_size),
+                position & 0xff, row_size);
+            fb_scale_line_bilinear(line, rows);
+        }
+
+        gadget->fb_scaler.convert(dst + y * line_size, line, gadget->fb_scaler.width);
+    }
+}
+
+static void fb_scaler_uninit()
+{
+    unsigned int i;
+
+    for (i = 0; i < gadget->fb_scaler.slots; i++) {
+        free(gadget->fb_scaler.unpacked[i]);
+        free(gadget->fb_scaler.rows[i]);
+        free(gadget->fb_scaler.line[i]);
+    }
+    free(gadget->fb_scaler.x_first);
+    free(gadget->fb_scaler.x_last);
+    free(gadget->fb_scaler.x_factor);
+    CLEAR(gadget->fb_scaler);
+}
+
+/*
+ * Enables scaling when the committed frame size differs from the framebuffer
+ * size. Every stripe of the worker pool gets its own scratch lines.
+ */
+static int fb_scaler_init(unsigned int width, unsigned int height)
+{
+    unsigned int channels = (gadget->fb_dev.fb_bpp == 32) ? 4 : 3;
+    unsigned int row_size = gadget->fb_dev.fb_width * channels;
+    unsigned int position;
+    unsigned int x;
+    unsigned int i;
+
+    CLEAR(gadget->fb_scaler);
+
+    if (!width || !height || (width == gadget->fb_dev.fb_width && height == gadget->fb_dev.fb_height)) {
+        return 0;
+    }
+
+    if (!rgb2yuyv_line_kernel(gadget->fb_dev.fb_bpp, gadget->fb_dev.fb_bgr)) {
+        printf("FB: Scaling of %u bpp framebuffer not supported\n", gadget->fb_dev.fb_bpp);
+        return -EINVAL;
+    }
+
+    /* box sums of up to 257 lines fit to 16 bits */
+    if (gadget->settings.fb_scale_filter == FB_SCALE_BOX && gadget->fb_dev.fb_height / height > 256) {
+        printf("FB: Scale factor %u:%u too large\n", gadget->fb_dev.fb_height, height);
+        return -EINVAL;
+    }
+
+    gadget->fb_scaler.filter   = gadget->settings.fb_scale_filter;
+    gadget->fb_scaler.width    = width;
+    gadget->fb_scaler.height   = height;
+    gadget->fb_scaler.channels = channels;
+    gadget->fb_scaler.convert  = rgb2yuyv_line_kernel(channels * 8, gadget->fb_dev.fb_bgr);
+    gadget->fb_scaler.x_first  = calloc(width, sizeof(* gadget->fb_scaler.x_first));
+    gadget->fb_scaler.x_last   = calloc(width, sizeof(* gadget->fb_scaler.x_last));
+    gadget->fb_scaler.x_factor = calloc(width, sizeof(* gadget->fb_scaler.x_factor));
+
+    if (!gadget->fb_scaler.x_first || !gadget->fb_scaler.x_last || !gadget->fb_scaler.x_factor) {
+        goto err;
+    }
+
+    gadget->fb_scaler.slots = gadget->fb_pool.nworkers + 1;
+    for (i = 0; i < gadget->fb_scaler.slots; i++) {
+        gadget->fb_scaler.unpacked[i] = malloc(row_size * 2);
+        gadget->fb_scaler.rows[i]     = malloc(row_size * sizeof(uint16_t));
+        gadget->fb_scaler.line[i]     = calloc(width + 16, channels);
+        if (!gadget->fb_scaler.unpacked[i] || !gadget->fb_scaler.rows[i] || !gadget->fb_scaler.line[i]) {
+            goto err;
+        }
+    }
+
+    for (x = 0; x < width; x++) {
+        if (gadget->fb_scaler.filter == FB_SCALE_BOX) {
+            gadget->fb_scaler.x_first[x]  = x * gadget->fb_dev.fb_width / width;
+            gadget->fb_scaler.x_last[x]   = max((x + 1) * gadget->fb_dev.fb_width / width, gadget->fb_scaler.x_first[x] + 1);
+            gadget->fb_scaler.x_factor[x] = (65536 + (gadget->fb_scaler.x_last[x] - gadget->fb_scaler.x_first[x]) / 2) /
+                (gadget->fb_scaler.x_last[x] - gadget->fb_scaler.x_first[x]);
+        } else {
+            position = fb_scale_position(x, gadget->fb_dev.fb_width, width);
+            gadget->fb_scaler.x_first[x]  = position >> 8;
+            gadget->fb_scaler.x_last[x]   = min(gadget->fb_scaler.x_first[x] + 1, gadget->fb_dev.fb_width - 1);
+            gadget->fb_scaler.x_factor[x] = position & 0xff;
+        }
+    }
+
+    gadget->fb_scaler.enabled = true;
+
+    printf("FB: Scaling %ux%u to %ux%u with %s filter\n", gadget->fb_dev.fb_width, gadget->fb_dev.fb_height,
+        width, height, fb_scale_filter_name(gadget->fb_scaler.filter));
+    return 0;
+
+err:
+    printf("FB: Out of memory for scaling\n");
+    fb_scaler_uninit();
+    return -ENOMEM;
+}
+
+/* ---------------------------------------------------------------------------
+ * YUYV to NV12 conversion
+ */
+
+typedef uint8_t fb_u8x16 __attribute__((vector_size(16)));
+
+/* Rounded up average of two byte vectors, without widening */
+static inline fb_u8x16 nv12_average(fb_u8x16 a, fb_u8x16 b)
+{
+    return (a | b) - ((a ^ b) >> 1);
+}
+
+/*
+ * Splits a YUYV line pair into two Y lines and one UV line. 'yuyv1' may be
+ * equal to 'yuyv0' for the last line of an odd height frame, 'y1' is NULL then.
+ */
+static void yuyv2nv12_line_pair(uint8_t * y0, uint8_t * y1, uint8_t * uv,
+    const uint8_t * yuyv0, const uint8_t * yuyv1, unsigned int width)
+{
+    const fb_u8x16 even = { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30 };
+    const fb_u8x16 odd  = { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31 };
+    fb_u8x16 a0;
+    fb_u8x16 b0;
+    fb_u8x16 a1;
+    fb_u8x16 b1;
+    fb_u8x16 out;
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        memcpy(&a0, yuyv0 + x * 2, 16);
+        memcpy(&b0, yuyv0 + x * 2 + 16, 16);
+        memcpy(&a1, yuyv1 + x * 2, 16);
+        memcpy(&b1, yuyv1 + x * 2 + 16, 16);
+
+        out = __builtin_shuffle(a0, b0, even);
+        memcpy(y0 + x, &out, 16);
+        if (y1) {
+            out = __builtin_shuffle(a1, b1, even);
+            memcpy(y1 + x, &out, 16);
+        }
+        out = nv12_average(__builtin_shuffle(a0, b0, odd), __builtin_shuffle(a1, b1, odd));
+        memcpy(uv + x, &out, 16);
+    }
+
+    for (; x < width; x++) {
+        y0[x] = yuyv0[x * 2];
+        if (y1) {
+            y1[x] = yuyv1[x * 2];
+        }
+        uv[x] = (yuyv0[x * 2 + 1] + yuyv1[x * 2 + 1] + 1) >> 1;
+    }
+}
+
+/* Converts lines first_line..last_line (first_line even) of a YUYV frame to NV12 */
+static void yuyv2nv12_lines(uint8_t * dst, const uint8_t * yuyv, unsigned int width,
+    unsigned int height, unsigned int first_line, unsigned int last_line)
+{
+    uint8_t * uv_plane = dst + width * height;
+    unsigned int line;
+
+    for (line = first_line; line < last_line; line += 2) {
+        if (line + 1 < height) {
+            yuyv2nv12_line_pair(dst + line * width, dst + (line + 1) * width,
+                uv_plane + line / 2 * width,
+                yuyv + line * width * 2, yuyv + (line + 1) * width * 2, width);
+        } else {
+            yuyv2nv12_line_pair(dst + line * width, NULL, uv_plane + line / 2 * width,
+                yuyv + line * width * 2, yuyv + line * width * 2, width);
+        }
+    }
+}
+
+static void fb_nv12_uninit()
+{
+    free(gadget->fb_nv12.yuyv);
+    CLEAR(gadget->fb_nv12);
+}
+
+static int fb_nv12_init(unsigned int width, unsigned int height)
+{
+    CLEAR(gadget->fb_nv12);
+
+    gadget->fb_nv12.yuyv = malloc(width * height * 2);
+    if (!gadget->fb_nv12.yuyv) {
+        printf("FB: Out of memory for NV12 conversion\n");
+        return -ENOMEM;
+    }
+
+    gadget->fb_nv12.width   = width;
+    gadget->fb_nv12.height  = height;
+    gadget->fb_nv12.enabled = true;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * MJPEG encoder
+ */
+
+static uint16_t jpeg_dc_y_codes[12];
+static uint8_t jpeg_dc_y_sizes[12];
+static uint16_t jpeg_dc_c_codes[12];
+static uint8_t jpeg_dc_c_sizes[12];
+static uint16_t jpeg_ac_y_codes[256];
+static uint8_t jpeg_ac_y_sizes[256];
+static uint16_t jpeg_ac_c_codes[256];
+static uint8_t jpeg_ac_c_sizes[256];
+
+/* limited range YUYV to level shifted full range JPEG samples */
+static float jpeg_luma_level[256];
+static float jpeg_chroma_level[256];
+
+static void jpeg_build_huffman(const uint8_t * bits, const uint8_t * vals,
+    uint16_t * codes, uint8_t * sizes)
+{
+    unsigned int code = 0;
+    unsigned int k = 0;
+    unsigned int length;
+    unsigned int i;
+
+    for (length = 1; length <= 16; length++) {
+        for (i = 0; i < bits[length - 1]; i++) {
+            codes[vals[k]] = code++;
+            sizes[vals[k]] = length;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+static void jpeg_init_tables()
+{
+    static bool initialized = false;
+    float level;
+    int i;
+
+    if (initialized) {
+        return;
+    }
+
+    jpeg_build_huffman(jpeg_dc_y_bits, jpeg_dc_vals, jpeg_dc_y_codes, jpeg_dc_y_sizes);
+    jpeg_build_huffman(jpeg_dc_c_bits, jpeg_dc_vals, jpeg_dc_c_codes, jpeg_dc_c_sizes);
+    jpeg_build_huffman(jpeg_ac_y_bits, jpeg_ac_y_vals, jpeg_ac_y_codes, jpeg_ac_y_sizes);
+    jpeg_build_huffman(jpeg_ac_c_bits, jpeg_ac_c_vals, jpeg_ac_c_codes, jpeg_ac_c_sizes);
+
+    for (i = 0; i < 256; i++) {
+        level = (i - 16) * 255.0f / 219.0f;
+        jpeg_luma_level[i] = clamp(level, 0.0f, 255.0f) - 128.0f;
+
+        level = (i - 128) * 255.0f / 224.0f;
+        jpeg_chroma_level[i] = clamp(level, -128.0f, 127.0f);
+    }
+
+    initialized = true;
+}
+
+static void jpeg_put_byte(struct jpeg_bit_writer * bits, uint8_t value)
+{
+    if (bits->size >= bits->capacity) {
+        bits->overflow = true;
+        return;
+    }
+    bits->buf[bits->size++] = value;
+}
+
+static inline void jpeg_put_bits(struct jpeg_bit_writer * bits, unsigned int code, unsigned int size)
+{
+    uint8_t value;
+
+    bits->acc = (bits->acc << size) | (code & ((1 << size) - 1));
+    bits->count += size;
+
+    while (bits->count >= 8) {
+        bits->count -= 8;
+        value = bits->acc >> bits->count;
+        jpeg_put_byte(bits, value);
+        if (value == 0xff) {
+            jpeg_put_byte(bits, 0x00);
+        }
+    }
+}
+
+static void jpeg_flush_bits(struct jpeg_bit_writer * bits)
+{
+    /* pad the last byte with 1-bits */
+    if (bits->count) {
+        jpeg_put_bits(bits, 0x7f, 8 - bits->count);
+    }
+    bits->acc = 0;
+}
+
+static void jpeg_fdct_1d(float * d, unsigned int stride)
+{
+    float tmp0 = d[0 * stride] + d[7 * stride];
+    float tmp7 = d[0 * stride] - d[7 * stride];
+    float tmp1 = d[1 * stride] + d[6 * stride];
+    float tmp6 = d[1 * stride] - d[6 * stride];
+    float tmp2 = d[2 * stride] + d[5 * stride];
+    float tmp5 = d[2 * stride] - d[5 * stride];
+    float tmp3 = d[3 * stride] + d[4 * stride];
+    float tmp4 = d[3 * stride] - d[4 * stride];
+    float tmp10;
+    float tmp11;
+    float tmp12;
+    float tmp13;
+    float z1;
+    float z2;
+    float z3;
+    float z4;
+    float z5;
+    float z11;
+    float z13;
+
+    /* even part */
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp1 + tmp2;
+    tmp12 = tmp1 - tmp2;
+
+    d[0 * stride] = tmp10 + tmp11;
+    d[4 * stride] = tmp10 - tmp11;
+
+    z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2 * stride] = tmp13 + z1;
+    d[6 * stride] = tmp13 - z1;
+
+    /* odd part */
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+
+    z5 = (tmp10 - tmp12) * 0.382683433f;
+    z2 = tmp10 * 0.541196100f + z5;
+    z4 = tmp12 * 1.306562965f + z5;
+    z3 = tmp11 * 0.707106781f;
+
+    z11 = tmp7 + z3;
+    z13 = tmp7 - z3;
+
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[1 * stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+}
+
+static inline unsigned int jpeg_bit_length(int value)
+{
+    unsigned int length = 0;
+
+    if (value < 0) {
+        value = -value;
+    }
+
+    while (value) {
+        length++;
+        value >>= 1;
+    }
+    return length;
+}
+
+static void jpeg_encode_block(struct jpeg_bit_writer * bits, float * block, const float * fdtbl,
+    int * dc_prev, const uint16_t * dc_codes, const uint8_t * dc_sizes,
+    const uint16_t * ac_codes, const uint8_t * ac_sizes)
+{
+    int coef[64];
+    unsigned int size;
+    unsigned int run;
+    float value;
+    int diff;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        jpeg_fdct_1d(block + i * 8, 1);
+    }
+    for (i = 0; i < 8; i++) {
+        jpeg_fdct_1d(block + i, 8);
+    }
+
+    for (i = 0; i < 64; i++) {
+        value = block[i] * fdtbl[i];
+        coef[jpeg_zigzag[i]] = (int) (value < 0 ? value - 0.5f : value + 0.5f);
+    }
+
+    diff = coef[0] - *dc_prev;
+    *dc_prev = coef[0];
+
+    size = jpeg_bit_length(diff);
+    jpeg_put_bits(bits, dc_codes[size], dc_sizes[size]);
+    if (size) {
+        jpeg_put_bits(bits, diff < 0 ? diff - 1 : diff, size);
+    }
+
+    run = 0;
+    for (i = 1; i < 64; i++) {
+        if (!coef[i]) {
+            run++;
+            continue;
+        }
+
+        while (run > 15) {
+            jpeg_put_bits(bits, ac_codes[0xf0], ac_sizes[0xf0]);
+            run -= 16;
+        }
+
+        size = jpeg_bit_length(coef[i]);
+        jpeg_put_bits(bits, ac_codes[(run << 4) | size], ac_sizes[(run << 4) | size]);
+        jpeg_put_bits(bits, coef[i] < 0 ? coef[i] - 1 : coef[i], size);
+        run = 0;
+    }
+
+    if (run) {
+        jpeg_put_bits(bits, ac_codes[0x00], ac_sizes[0x00]);
+    }
+}
+
+static void jpeg_encode_mcu_row(struct jpeg_encoder * enc, const uint8_t * yuyv, unsigned int mcu_row)
+{
+    struct jpeg_bit_writer bits;
+    const uint8_t * lines[JPEG_MCU_HEIGHT];
+    float block_y0[64];
+    float block_y1[64];
+    float block_cb[64];
+    float block_cr[64];
+    int dc_y = 0;
+    int dc_cb = 0;
+    int dc_cr = 0;
+    unsigned int line;
+    unsigned int mcu;
+    unsigned int x;
+    unsigned int y;
+    unsigned int pair;
+    unsigned int last_pair = (enc->width - 1) / 2;
+
+    CLEAR(bits);
+    bits.buf      = enc->rows + mcu_row * enc->row_capacity;
+    bits.capacity = enc->row_capacity;
+
+    for (y = 0; y < JPEG_MCU_HEIGHT; y++) {
+        line = min(mcu_row * JPEG_MCU_HEIGHT + y, enc->height - 1);
+        lines[y] = yuyv + line * enc->width * 2;
+    }
+
+    for (mcu = 0; mcu < enc->mcus_x; mcu++) {
+        for (y = 0; y < JPEG_MCU_HEIGHT; y++) {
+            for (x = 0; x < 8; x++) {
+                /* one YUYV pair holds two luma samples and one sample of each chroma */
+                pair = min(mcu * 8 + x, last_pair);
+                block_cb[y * 8 + x] = jpeg_chroma_level[lines[y][pair * 4 + 1]];
+                block_cr[y * 8 + x] = jpeg_chroma_level[lines[y][pair * 4 + 3]];
+
+                pair = min(mcu * 8 + x / 2, last_pair);
+                block_y0[y * 8 + x] = jpeg_luma_level[lines[y][pair * 4 + (x & 1) * 2]];
+
+                pair = min(mcu * 8 + 4 + x / 2, last_pair);
+                block_y1[y * 8 + x] = jpeg_luma_level[lines[y][pair * 4 + (x & 1) * 2]];
+            }
+        }
+
+        jpeg_encode_block(&bits, block_y0, enc->fdtbl_y, &dc_y,
+            jpeg_dc_y_codes, jpeg_dc_y_sizes, jpeg_ac_y_codes, jpeg_ac_y_sizes);
+        jpeg_encode_block(&bits, block_y1, enc->fdtbl_y, &dc_y,
+            jpeg_dc_y_codes, jpeg_dc_y_sizes, jpeg_ac_y_codes, jpeg_ac_y_sizes);
+        jpeg_encode_block(&bits, block_cb, enc->fdtbl_c, &dc_cb,
+            jpeg_dc_c_codes, jpeg_dc_c_sizes, jpeg_ac_c_codes, jpeg_ac_c_sizes);
+        jpeg_encode_block(&bits, block_cr, enc->fdtbl_c, &dc_cr,
+            jpeg_dc_c_codes, jpeg_dc_c_sizes, jpeg_ac_c_codes, jpeg_ac_c_sizes);
+    }
+
+    jpeg_flush_bits(&bits);
+
+    /* every MCU row is one restart interval */
+    if (mcu_row + 1 < enc->mcus_y) {
+        jpeg_put_byte(&bits, 0xff);
+        jpeg_put_byte(&bits, 0xd0 + (mcu_row & 7));
+    }
+
+    enc->row_size[mcu_row] = bits.size;
+    enc->row_overflow[mcu_row] = bits.overflow;
+}
+
+/*
+ * Encodes the MCU rows covering lines [first_line, last_line) of the packed
+ * YUYV frame 'yuyv'. 'first_line' has to be a multiple of JPEG_MCU_HEIGHT.
+ */
+static void jpeg_encode_lines(struct jpeg_encoder * enc, const uint8_t * yuyv,
+    unsigned int first_line, unsigned int last_line)
+{
+    unsigned int mcu_row;
+    unsigned int last_row = (last_line + JPEG_MCU_HEIGHT - 1) / JPEG_MCU_HEIGHT;
+
+    for (mcu_row = first_line / JPEG_MCU_HEIGHT; mcu_row < last_row; mcu_row++) {
+        jpeg_encode_mcu_row(enc, yuyv, mcu_row);
+    }
+}
+
+static void jpeg_put_marker(struct jpeg_encoder * enc, uint8_t marker, unsigned int length)
+{
+    enc->header[enc->header_size++] = 0xff;
+    enc->header[enc->header_size++] = marker;
+    enc->header[enc->header_size++] = length >> 8;
+    enc->header[enc->header_size++] = length & 0xff;
+}
+
+static void jpeg_put_header_bytes(struct jpeg_encoder * enc, const uint8_t * data, unsigned int length)
+{
+    memcpy(enc->header + enc->header_size, data, length);
+    enc->header_size += length;
+}
+
+static void jpeg_put_huffman_table(struct jpeg_encoder * enc, uint8_t table_class,
+    const uint8_t * bits, const uint8_t * vals)
+{
+    unsigned int count = 0;
+    unsigned int i;
+
+    for (i = 0; i < 16; i++) {
+        count += bits[i];
+    }
+
+    enc->header[enc->header_size++] = table_class;
+    jpeg_put_header_bytes(enc, bits, 16);
+    jpeg_put_header_bytes(enc, vals, count);
+}
+
+static void jpeg_build_header(struct jpeg_encoder * enc, const uint8_t * quant_y, const uint8_t * quant_c)
+{
+    static const uint8_t jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    unsigned int i;
+
+    enc->header_size = 0;
+    enc->header[enc->header_size++] = 0xff;
+    enc->header[enc->header_size++] = 0xd8;
+
+    jpeg_put_marker(enc, 0xe0, 2 + sizeof(jfif));
+    jpeg_put_header_bytes(enc, jfif, sizeof(jfif));
+
+    jpeg_put_marker(enc, 0xdb, 2 + 2 * 65);
+    enc->header[enc->header_size++] = 0;
+    for (i = 0; i < 64; i++) {
+        enc->header[enc->header_size + jpeg_zigzag[i]] = quant_y[i];
+    }
+    enc->header_size += 64;
+    enc->header[enc->header_size++] = 1;
+    for (i = 0; i < 64; i++) {
+        enc->header[enc->header_size + jpeg_zigzag[i]] = quant_c[i];
+    }
+    enc->header_size += 64;
+
+    /* baseline, 8 bit, Y sampled 2x1, Cb and Cr 1x1 */
+    jpeg_put_marker(enc, 0xc0, 17);
+    enc->header[enc->header_size++] = 8;
+    enc->header[enc->header_size++] = enc->height >> 8;
+    enc->header[enc->header_size++] = enc->height & 0xff;
+    enc->header[enc->header_size++] = enc->width >> 8;
+    enc->header[enc->header_size++] = enc->width & 0xff;
+    enc->header[enc->header_size++] = 3;
+    jpeg_put_header_bytes(enc, (const uint8_t []) { 1, 0x21, 0, 2, 0x11, 1, 3, 0x11, 1 }, 9);
+
+    jpeg_put_marker(enc, 0xc4, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    jpeg_put_huffman_table(enc, 0x00, jpeg_dc_y_bits, jpeg_dc_vals);
+    jpeg_put_huffman_table(enc, 0x10, jpeg_ac_y_bits, jpeg_ac_y_vals);
+    jpeg_put_huffman_table(enc, 0x01, jpeg_dc_c_bits, jpeg_dc_vals);
+    jpeg_put_huffman_table(enc, 0x11, jpeg_ac_c_bits, jpeg_ac_c_vals);
+
+    jpeg_put_marker(enc, 0xdd, 4);
+    enc->header[enc->header_size++] = enc->mcus_x >> 8;
+    enc->header[enc->header_size++] = enc->mcus_x & 0xff;
+
+    jpeg_put_marker(enc, 0xda, 12);
+    enc->header[enc->header_size++] = 3;
+    jpeg_put_header_bytes(enc, (const uint8_t []) { 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 }, 9);
+}
+
+static void jpeg_scale_quant(uint8_t * quant, const uint8_t * base, unsigned int quality)
+{
+    unsigned int scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    unsigned int i;
+
+    for (i = 0; i < 64; i++) {
+        quant[i] = clamp((base[i] * scale + 50) / 100, 1u, 255u);
+    }
+}
+
+static int jpeg_encoder_init(struct jpeg_encoder * enc, unsigned int width, unsigned int height,
+    unsigned int quality)
+{
+    static const float aan_scale[8] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+        1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+    };
+    uint8_t quant_y[64];
+    uint8_t quant_c[64];
+    unsigned int row;
+    unsigned int col;
+
+    jpeg_init_tables();
+
+    enc->width   = width;
+    enc->height  = height;
+    enc->quality = clamp(quality, 1u, 100u);
+    enc->mcus_x  = (width + JPEG_MCU_WIDTH - 1) / JPEG_MCU_WIDTH;
+    enc->mcus_y  = (height + JPEG_MCU_HEIGHT - 1) / JPEG_MCU_HEIGHT;
+
+    jpeg_scale_quant(quant_y, jpeg_std_quant_y, enc->quality);
+    jpeg_scale_quant(quant_c, jpeg_std_quant_c, enc->quality);
+
+    for (row = 0; row < 8; row++) {
+        for (col = 0; col < 8; col++) {
+            enc->fdtbl_y[row * 8 + col] = 1.0f /
+                (quant_y[row * 8 + col] * aan_scale[row] * aan_scale[col] * 8.0f);
+            enc->fdtbl_c[row * 8 + col] = 1.0f /
+                (quant_c[row * 8 + col] * aan_scale[row] * aan_scale[col] * 8.0f);
+        }
+    }
+
+    jpeg_build_header(enc, quant_y, quant_c);
+
+    /* twice the raw size of an MCU row leaves room for noisy content at high quality */
+    enc->row_capacity = enc->mcus_x * JPEG_MCU_WIDTH * JPEG_MCU_HEIGHT * 2 * 2 + 16;
+    enc->rows         = malloc(enc->mcus_y * enc->row_capacity);
+    enc->row_size     = calloc(enc->mcus_y, sizeof(* enc->row_size));
+    enc->row_overflow = calloc(enc->mcus_y, sizeof(* enc->row_overflow));
+    enc->yuyv         = malloc(width * height * 2);
+
+    if (!enc->rows || !enc->row_size || !enc->row_overflow || !enc->yuyv) {
+        printf("JPEG: Out of memory\n");
+        free(enc->rows);
+        free(enc->row_size);
+        free(enc->row_overflow);
+        free(enc->yuyv);
+        CLEAR(* enc);
+        return -ENOMEM;
+    }
+
+    enc->enabled = true;
+    printf("JPEG: Encoder %ux%u, quality %u, %u restart intervals\n",
+        enc->width, enc->height, enc->quality, enc->mcus_y);
+    return 0;
+}
+
+static void jpeg_encoder_uninit(struct jpeg_encoder * enc)
+{
+    if (!enc->enabled) {
+        return;
+    }
+
+    free(enc->rows);
+    free(enc->row_size);
+    free(enc->row_overflow);
+    free(enc->yuyv);
+    CLEAR(* enc);
+}
+
+/*
+ * Assembles header, encoded MCU rows and EOI into 'dst'.
+ * Returns the size of the JPEG image or 0 when it doesn't fit.
+ */
+static unsigned int jpeg_encoder_finish(struct jpeg_encoder * enc, uint8_t * dst, unsigned int capacity)
+{
+    unsigned int size = enc->header_size;
+    unsigned int row;
+
+    for (row = 0; row < enc->mcus_y; row++) {
+        if (enc->row_overflow[row]) {
+            return 0;
+        }
+        size += enc->row_size[row];
+    }
+
+    if (size + 2 > capacity) {
+        return 0;
+    }
+
+    memcpy(dst, enc->header, enc->header_size);
+    size = enc->header_size;
+
+    for (row = 0; row < enc->mcus_y; row++) {
+        memcpy(dst + size, enc->rows + row * enc->row_capacity, enc->row_size[row]);
+        size += enc->row_size[row];
+    }
+
+    dst[size++] = 0xff;
+    dst[size++] = 0xd9;
+    return size;
+}
+
+/* ---------------------------------------------------------------------------
+ * V4L2 format conversion
+ */
+
+/* Capture formats the conversion stage can read, in order of preference */
+static const unsigned int v4l2_convert_formats[] = {
+    V4L2_PIX_FMT_YUYV,
+    V4L2_PIX_FMT_UYVY,
+    V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_YUV420,
+    V4L2_PIX_FMT_XBGR32,
+    V4L2_PIX_FMT_ABGR32,
+    V4L2_PIX_FMT_BGR32,
+    V4L2_PIX_FMT_RGBX32,
+    V4L2_PIX_FMT_RGBA32,
+    V4L2_PIX_FMT_BGR24,
+    V4L2_PIX_FMT_RGB24,
+    V4L2_PIX_FMT_RGB565,
+};
+
+static const fb_u8x16 yuv_interleave_low  = { 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 };
+static const fb_u8x16 yuv_interleave_high = { 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31 };
+
+/* Interleaves a luma line with an interleaved chroma line (UVUV...) to YUYV */
+static void yuv_interleave_line(uint8_t * dst, const uint8_t * y, const uint8_t * uv, unsigned int width)
+{
+    fb_u8x16 luma;
+    fb_u8x16 chroma;
+    fb_u8x16 out;
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        memcpy(&luma, y + x, 16);
+        memcpy(&chroma, uv + x, 16);
+
+        out = __builtin_shuffle(luma, chroma, yuv_interleave_low);
+        memcpy(dst + x * 2, &out, 16);
+        out = __builtin_shuffle(luma, chroma, yuv_interleave_high);
+        memcpy(dst + x * 2 + 16, &out, 16);
+    }
+
+    for (; x + 2 <= width; x += 2) {
+        dst[x * 2]     = y[x];
+        dst[x * 2 + 1] = uv[x];
+        dst[x * 2 + 2] = y[x + 1];
+        dst[x * 2 + 3] = uv[x + 1];
+    }
+}
+
+static void v4l2_convert_line_yuyv(uint8_t * dst, const uint8_t * src, unsigned int line)
+{
+    memcpy(dst, src + line * gadget->v4l2_convert.stride, gadget->v4l2_convert.width * 2);
+}
+
+static void v4l2_convert_line_uyvy(uint8_t * dst, const uint8_t * src, unsigned int line)
+{
+    const fb_u8x16 swap = { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 };
+    const uint8_t * uyvy = src + line * gadget->v4l2_convert.stride;
+    unsigned int bytes = gadget->v4l2_convert.width * 2;
+    unsigned int x = 0;
+    fb_u8x16 pixels;
+
+    for (; x + 16 <= bytes; x += 16) {
+        memcpy(&pixels, uyvy + x, 16);
+        pixels = __builtin_shuffle(pixels, swap);
+        memcpy(dst + x, &pixels, 16);
+    }
+
+    for (; x + 2 <= bytes; x += 2) {
+        dst[x]     = uyvy[x + 1];
+        dst[x + 1] = uyvy[x];
+    }
+}
+
+static void v4l2_convert_line_nv12(uint8_t * dst, const uint8_t * src, unsigned int line)
+{
+    unsigned int stride = gadget->v4l2_convert.stride;
+
+    yuv_interleave_line(dst, src + line * stride,
+        src + stride * gadget->v4l2_convert.height + line / 2 * stride, gadget->v4l2_convert.width);
+}
+
+static void v4l2_convert_line_yuv420(uint8_t * dst, const uint8_t * src, unsigned int line)
+{
+    unsigned int stride = gadget->v4l2_convert.stride;
+    unsigned int width = gadget->v4l2_convert.width;
+    const uint8_t * y = src + line * stride;
+    const uint8_t * u = src + stride * gadget->v4l2_convert.height + line / 2 * (stride / 2);
+    const uint8_t * v = u + (stride / 2) * (gadget->v4l2_convert.height / 2);
+    fb_u8x16 luma;
+    fb_u8x16 cb = { 0 };
+    fb_u8x16 cr = { 0 };
+    fb_u8x16 chroma;
+    fb_u8x16 out;
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        memcpy(&luma, y + x, 16);
+        memcpy(&cb, u + x / 2, 8);
+        memcpy(&cr, v + x / 2, 8);
+        chroma = __builtin_shuffle(cb, cr, yuv_interleave_low);
+
+        out = __builtin_shuffle(luma, chroma, yuv_interleave_low);
+        memcpy(dst + x * 2, &out, 16);
+        out = __builtin_shuffle(luma, chroma, yuv_interleave_high);
+        memcpy(dst + x * 2 + 16, &out, 16);
+    }
+
+    for (; x + 2 <= width; x += 2) {
+        dst[x * 2]     = y[x];
+        dst[x * 2 + 1] = u[x / 2];
+        dst[x * 2 + 2] = y[x + 1];
+        dst[x * 2 + 3] = v[x / 2];
+    }
+}
+
+static void v4l2_convert_line_rgb(uint8_t * dst, const uint8_t * src, unsigned int line)
+{
+    gadget->v4l2_convert.rgb(dst, src + line * gadget->v4l2_convert.stride, gadget->v4l2_convert.width);
+}
+
+/* Returns the line kernel converting 'format' to YUYV, NULL if not supported */
+static v4l2_convert_line_fn v4l2_convert_line_kernel(unsigned int format, rgb2yuyv_line_fn * rgb)
+{
+    *rgb = NULL;
+
+    switch (format) {
+    case V4L2_PIX_FMT_YUYV:
+        return v4l2_convert_line_yuyv;
+
+    case V4L2_PIX_FMT_UYVY:
+        return v4l2_convert_line_uyvy;
+
+    case V4L2_PIX_FMT_NV12:
+        return v4l2_convert_line_nv12;
+
+    case V4L2_PIX_FMT_YUV420:
+        return v4l2_convert_line_yuv420;
+
+    /* byte 0 is blue for the 'bgr' kernels, red for the others */
+    case V4L2_PIX_FMT_XBGR32:
+    case V4L2_PIX_FMT_ABGR32:
+    case V4L2_PIX_FMT_BGR32:
+        *rgb = rgb2yuyv_line_kernel(32, true);
+        break;
+
+    case V4L2_PIX_FMT_RGBX32:
+    case V4L2_PIX_FMT_RGBA32:
+        *rgb = rgb2yuyv_line_kernel(32, false);
+        break;
+
+    case V4L2_PIX_FMT_BGR24:
+        *rgb = rgb2yuyv_line_kernel(24, true);
+        break;
+
+    case V4L2_PIX_FMT_RGB24:
+        *rgb = rgb2yuyv_line_kernel(24, false);
+        break;
+
+    case V4L2_PIX_FMT_RGB565:
+        *rgb = rgb2yuyv_line_kernel(16, false);
+        break;
+    }
+
+    return (*rgb) ? v4l2_convert_line_rgb : NULL;
+}
+
+static bool v4l2_convert_target(unsigned int format)
+{
+    return format == V4L2_PIX_FMT_YUYV || format == V4L2_PIX_FMT_NV12 || format == V4L2_PIX_FMT_MJPEG;
+}
+
+/*
+ * Sets the capture device to the committed format. If the device cannot
+ * produce it, tries the formats the conversion stage can convert from.
+ */
+static int v4l2_convert_negotiate(unsigned int pixelformat, unsigned int width, unsigned int height)
+{
+    v4l2_convert_line_fn convert;
+    rgb2yuyv_line_fn rgb;
+    unsigned int format;
+    unsigned int i;
+
+    if (gadget->v4l2_dev.is_streaming) {
+        return -EBUSY;
+    }
+
+    gadget->v4l2_convert.enabled = false;
+    gadget->v4l2_m2m.enabled = false;
+
+    if (v4l2_apply_format(&gadget->v4l2_dev, pixelformat, width, height) == 0 &&
+        v4l2_format_matches(&gadget->v4l2_dev, pixelformat, width, height)
+    ) {
+        return 0;
+    }
+
+    /* a mem2mem device is preferred over converting in software */
+    if (v4l2_m2m_negotiate(pixelformat, width, height) == 0) {
+        return 0;
+    }
+
+    if (!v4l2_convert_target(pixelformat)) {
+        printf("CONVERT: No conversion to %c%c%c%c available\n", pixfmtstr(pixelformat));
+        return -EINVAL;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(v4l2_convert_formats); i++) {
+        format = v4l2_convert_formats[i];
+        convert = v4l2_convert_line_kernel(format, &rgb);
+
+        if (format == pixelformat || !convert) {
+            continue;
+        }
+
+        if (v4l2_apply_format(&gadget->v4l2_dev, format, width, height) < 0 ||
+            !v4l2_format_matches(&gadget->v4l2_dev, format, width, height)
+        ) {
+            continue;
+        }
+
+        gadget->v4l2_convert.src_format = format;
+        gadget->v4l2_convert.dst_format = pixelformat;
+        gadget->v4l2_convert.width      = width;
+        gadget->v4l2_convert.height     = height;
+        gadget->v4l2_convert.stride     = gadget->v4l2_dev.bytesperline;
+        gadget->v4l2_convert.convert    = convert;
+        gadget->v4l2_convert.rgb        = rgb;
+        gadget->v4l2_convert.enabled    = true;
+
+        /* packed YUYV is read in place by the NV12 packer and the JPEG encoder */
+        gadget->v4l2_convert.direct = format == V4L2_PIX_FMT_YUYV && gadget->v4l2_convert.stride == width * 2;
+
+        printf("CONVERT: Converting %c%c%c%c to %c%c%c%c %ux%u\n",
+            pixfmtstr(format), pixfmtstr(pixelformat), width, height);
+        return 0;
+    }
+
+    printf("CONVERT: No capture format can be converted to %c%c%c%c %ux%u\n",
+        pixfmtstr(pixelformat), width, height);
+    return -EINVAL;
+}
+
+/*
+ * Negotiates the capture side once per format. The capture device keeps its
+ * format and the conversion or mem2mem setup stays valid across streams, so a
+ * repeated commit of the same format costs no ioctls. Warm standby buffers
+ * only survive that case.
+ */
+static int v4l2_negotiate(unsigned int pixelformat, unsigned int width, unsigned int height)
+{
+    if (gadget->format_state.negotiated &&
+        gadget->format_state.negotiated_pixelformat == pixelformat &&
+        gadget->format_state.negotiated_width == width &&
+        gadget->format_state.negotiated_height == height
+    ) {
+        gadget->format_state.negotiations_skipped++;
+        return 0;
+    }
+
+    v4l2_standby_release();
+
+    gadget->format_state.negotiations++;
+    gadget->format_state.negotiated = v4l2_convert_negotiate(pixelformat, width, height) == 0;
+    if (!gadget->format_state.negotiated) {
+        return -EINVAL;
+    }
+
+    gadget->format_state.negotiated_pixelformat = pixelformat;
+    gadget->format_state.negotiated_width       = width;
+    gadget->format_state.negotiated_height      = height;
+    return 0;
+}
+
+static int v4l2_convert_start()
+{
+    unsigned int i;
+
+    gadget->v4l2_convert.nfree   = min(gadget->uvc_dev.nbufs, V4L2_CONVERT_MAX_BUFFERS);
+    gadget->v4l2_convert.dropped = 0;
+    for (i = 0; i < gadget->v4l2_convert.nfree; i++) {
+        gadget->v4l2_convert.free[i] = i;
+    }
+
+    if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_MJPEG) {
+        return jpeg_encoder_init(&gadget->v4l2_jpeg, gadget->v4l2_convert.width, gadget->v4l2_convert.height,
+            gadget->settings.jpeg_quality);
+    }
+
+    if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_NV12 && !gadget->v4l2_convert.direct) {
+        gadget->v4l2_convert.yuyv = malloc(gadget->v4l2_convert.width * gadget->v4l2_convert.height * 2);
+        if (!gadget->v4l2_convert.yuyv) {
+            printf("CONVERT: Out of memory\n");
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void v4l2_convert_stop()
+{
+    jpeg_encoder_uninit(&gadget->v4l2_jpeg);
+    free(gadget->v4l2_convert.yuyv);
+    gadget->v4l2_convert.yuyv  = NULL;
+    gadget->v4l2_convert.nfree = 0;
+}
+
+static void v4l2_convert_release(unsigned int index)
+{
+    if (gadget->v4l2_convert.nfree < V4L2_CONVERT_MAX_BUFFERS) {
+        gadget->v4l2_convert.free[gadget->v4l2_convert.nfree++] = index;
+    }
+}
+
+struct v4l2_convert_job {
+    uint8_t * dst;
+    const uint8_t * src;
+};
+
+static void v4l2_convert_lines(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct v4l2_convert_job * job = data;
+    unsigned int width = gadget->v4l2_convert.width;
+    const uint8_t * yuyv = job->src;
+    uint8_t * dst = job->dst;
+    unsigned int line;
+
+    if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_MJPEG) {
+        dst = gadget->v4l2_jpeg.yuyv;
+    } else if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_NV12) {
+        dst = gadget->v4l2_convert.yuyv;
+    }
+
+    if (!gadget->v4l2_convert.direct) {
+        for (line = first_line; line < last_line; line++) {
+            gadget->v4l2_convert.convert(dst + line * width * 2, job->src, line);
+        }
+        yuyv = dst;
+    }
+
+    if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_MJPEG) {
+        jpeg_encode_lines(&gadget->v4l2_jpeg, yuyv, first_line, last_line);
+
+    } else if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_NV12) {
+        yuyv2nv12_lines(job->dst, yuyv, width, gadget->v4l2_convert.height, first_line, last_line);
+    }
+}
+
+/* Queues a converted frame to UVC domain, an empty frame goes back to the free list */
+static void v4l2_convert_queue(unsigned int index, unsigned int bytesused)
+{
+    struct v4l2_buffer ubuf;
+
+    if (!bytesused) {
+        gadget->v4l2_convert.dropped++;
+        goto release;
+    }
+
+    CLEAR(ubuf);
+    ubuf.type      = gadget->uvc_dev.buffer_type;
+    ubuf.memory    = gadget->uvc_dev.memory_type;
+    ubuf.index     = index;
+    ubuf.bytesused = bytesused;
+
+    if (gadget->uvc_dev.memory_type == V4L2_MEMORY_USERPTR) {
+        ubuf.m.userptr = (unsigned long) gadget->uvc_dev.mem[index].start;
+        ubuf.length    = gadget->uvc_dev.mem[index].length;
+    }
+
+    if (ioctl(gadget->uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
+        if (errno == ENODEV) {
+            gadget->uvc_shutdown_requested = true;
+            printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n");
+        }
+        goto release;
+    }
+
+    gadget->uvc_dev.qbuf_count++;
+
+    if (!gadget->uvc_dev.is_streaming) {
+        uvc_video_stream(STREAM_ON);
+        gadget->settings.blink_on_startup = 0;
+        streaming_status_value(gadget->uvc_dev.is_streaming);
+    }
+    return;
+
+release:
+    /* the free list belongs to the capture thread when threaded */
+    if (gadget->pipeline.enabled) {
+        pipeline_push(&gadget->pipeline.spent, index, 0);
+    } else {
+        v4l2_convert_release(index);
+    }
+}
+
+/*
+ * Converts a captured frame into a free UVC buffer and gives the capture
+ * buffer back right away. Frames are dropped when no UVC buffer is free.
+ */
+static void v4l2_convert_video_process()
+{
+    struct v4l2_convert_job job;
+    struct v4l2_buffer vbuf;
+    struct timespec start;
+    struct timespec end;
+    bool converted = false;
+    unsigned int indices[V4L2_PACING_MAX_COPIES];
+    unsigned int copies;
+    unsigned int count;
+    unsigned int i;
+    unsigned int index = 0;
+    unsigned int capacity = 0;
+    unsigned int bytesused = 0;
+
+    CLEAR(vbuf);
+    vbuf.type   = gadget->v4l2_dev.buffer_type;
+    vbuf.memory = gadget->v4l2_dev.memory_type;
+
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_DQBUF, &vbuf) < 0) {
+        printf("%s: Unable to dequeue buffer: %s (%d).\n",
+            gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    gadget->v4l2_dev.dqbuf_count++;
+    v4l2_dqbuf_latest(&vbuf);
+    copies = v4l2_pacing_frames(V4L2_PACING_MAX_COPIES);
+
+    if (!copies) {
+        /* dropped by pacing */
+
+    } else if (gadget->v4l2_convert.nfree) {
+        index = gadget->v4l2_convert.free[--gadget->v4l2_convert.nfree];
+
+        job.dst = gadget->uvc_dev.mem[index].start;
+        job.src = gadget->v4l2_dev.mem[vbuf.index].start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (gadget->v4l2_convert.dst_format == V4L2_PIX_FMT_MJPEG) {
+            fb_pool_run(v4l2_convert_lines, &job, gadget->v4l2_convert.height, JPEG_MCU_HEIGHT);
+
+            capacity = min(gadget->uvc_dev.mem[index].length,
+                get_frame_size(V4L2_PIX_FMT_MJPEG, gadget->v4l2_convert.width, gadget->v4l2_convert.height));
+            bytesused = jpeg_encoder_finish(&gadget->v4l2_jpeg, job.dst, capacity);
+        } else {
+            fb_pool_run(v4l2_convert_lines, &job, gadget->v4l2_convert.height, 2);
+            bytesused = get_frame_size(gadget->v4l2_convert.dst_format, gadget->v4l2_convert.width, gadget->v4l2_convert.height);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        __atomic_fetch_add(&gadget->uvc_dev.process_time_ns, elapsed_ns(&start, &end), __ATOMIC_RELAXED);
+        converted = true;
+
+        if (!bytesused) {
+            printf("JPEG: Encoded frame exceeds %u bytes, frame dropped\n", capacity);
+            v4l2_convert_release(index);
+            gadget->v4l2_convert.dropped++;
+            converted = false;
+        }
+
+    } else {
+        gadget->v4l2_convert.dropped++;
+    }
+
+    if (ioctl(gadget->v4l2_dev.fd, VIDIOC_QBUF, &vbuf) < 0) {
+        printf("%s: Unable to queue buffer: %s (%d).\n",
+            gadget->v4l2_dev.device_type_name, strerror(errno), errno);
+    } else {
+        gadget->v4l2_dev.qbuf_count++;
+    }
+
+    if (!converted) {
+        return;
+    }
+
+    /* a capture device slower than the committed interval gets its frames duplicated */
+    indices[0] = index;
+    for (count = 1; count < copies && gadget->v4l2_convert.nfree; count++) {
+        indices[count] = gadget->v4l2_convert.free[--gadget->v4l2_convert.nfree];
+        memcpy(gadget->uvc_dev.mem[indices[count]].start, job.dst, bytesused);
+        gadget->v4l2_pacing.duplicated++;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (gadget->pipeline.enabled) {
+            pipeline_push(&gadget->pipeline.ready, indices[i], bytesused);
+        } else {
+            v4l2_convert_queue(indices[i], bytesused);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * UVC streaming related
+ */
+
+struct fb_convert_job {
+    uint8_t * dst;
+    const uint8_t * src;
+    rgb2yuyv_line_fn convert;
+    struct jpeg_encoder * jpeg;
+    uint8_t * nv12;
+};
+
+static void uvc_fb_convert_lines_staged(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct fb_convert_job * job = data;
+    uint8_t * stage = gadget->fb_stage.buffers[fb_pool_slot()];
+    unsigned int line_size = gadget->fb_dev.fb_width * 2;
+    unsigned int pixels_size = gadget->fb_dev.fb_width * (gadget->fb_dev.fb_bpp / 8);
+    unsigned int chunk;
+    unsigned int lines;
+    unsigned int line;
+
+    for (chunk = first_line; chunk < last_line; chunk += lines) {
+        lines = min(gadget->fb_stage.lines, last_line - chunk);
+
+        memcpy(stage, job->src + chunk * gadget->fb_dev.fb_line_length,
+            (lines - 1) * gadget->fb_dev.fb_line_length + pixels_size);
+
+        for (line = 0; line < lines; line++) {
+            job->convert(job->dst + (chunk + line) * line_size,
+                stage + line * gadget->fb_dev.fb_line_length, gadget->fb_dev.fb_width);
+        }
+    }
+}
+
+static void uvc_fb_convert_lines(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct fb_convert_job * job = data;
+    unsigned int line_size = gadget->fb_dev.fb_width * 2;
+    uint8_t * uvc_pixels = job->dst + first_line * line_size;
+    const uint8_t * fb_pixels = job->src + first_line * gadget->fb_dev.fb_line_length;
+    unsigned int line;
+
+    if (gadget->fb_stage.enabled) {
+        uvc_fb_convert_lines_staged(data, first_line, last_line);
+        return;
+    }
+
+    for (line = first_line; line < last_line; line++) {
+        job->convert(uvc_pixels, fb_pixels, gadget->fb_dev.fb_width);
+        uvc_pixels += line_size;
+        fb_pixels += gadget->fb_dev.fb_line_length;
+    }
+}
+
+/*
+ * Damage tracking variant of uvc_fb_convert_lines(). Tiles whose framebuffer
+ * content equals the shadow copy are taken from the cached YUYV image, only
+ * changed tiles are converted again. Stripes are aligned to FB_TILE_HEIGHT.
+ */
+static void uvc_fb_convert_lines_damage(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct fb_convert_job * job = data;
+    unsigned int bytes_per_pixel = gadget->fb_dev.fb_bpp / 8;
+    unsigned int line_size = gadget->fb_dev.fb_width * 2;
+    unsigned int shadow_line_size = gadget->fb_dev.fb_width * bytes_per_pixel;
+    unsigned long converted = 0;
+    unsigned long processed = 0;
+    unsigned int tile_first;
+    unsigned int tile_last;
+    unsigned int tile_x;
+    unsigned int tile_width;
+    unsigned int tile_bytes;
+    unsigned int line;
+    bool dirty;
+
+    for (tile_first = first_line; tile_first < last_line; tile_first = tile_last) {
+        tile_last = tile_first + FB_TILE_HEIGHT;
+        if (tile_last > last_line) {
+            tile_last = last_line;
+        }
+
+        for (tile_x = 0; tile_x < gadget->fb_dev.fb_width; tile_x += FB_TILE_WIDTH) {
+            tile_width = gadget->fb_dev.fb_width - tile_x;
+            if (tile_width > FB_TILE_WIDTH) {
+                tile_width = FB_TILE_WIDTH;
+            }
+            tile_bytes = tile_width * bytes_per_pixel;
+
+            dirty = !gadget->fb_damage.valid;
+            for (line = tile_first; line < tile_last && !dirty; line++) {
+                dirty = memcmp(job->src + line * gadget->fb_dev.fb_line_length + tile_x * bytes_per_pixel,
+                    gadget->fb_damage.shadow + line * shadow_line_size + tile_x * bytes_per_pixel,
+                    tile_bytes) != 0;
+            }
+            processed++;
+
+            if (!dirty) {
+                continue;
+            }
+
+            for (line = tile_first; line < tile_last; line++) {
+                uint8_t * shadow = gadget->fb_damage.shadow + line * shadow_line_size + tile_x * bytes_per_pixel;
+
+                memcpy(shadow, job->src + line * gadget->fb_dev.fb_line_length + tile_x * bytes_per_pixel,
+                    tile_bytes);
+                job->convert(gadget->fb_damage.yuyv + line * line_size + tile_x * 2, shadow, tile_width);
+            }
+            converted++;
+        }
+
+        memcpy(job->dst + tile_first * line_size, gadget->fb_damage.yuyv + tile_first * line_size,
+            (tile_last - tile_first) * line_size);
+    }
+
+    __atomic_add_fetch(&gadget->fb_damage.tiles_converted, converted, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gadget->fb_damage.tiles_processed, processed, __ATOMIC_RELAXED);
+}
+
+static void uvc_fb_scale_lines(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct fb_convert_job * job = data;
+
+    fb_scale_lines(job->dst, job->src, first_line, last_line);
+}
+
+/* Converts to YUYV with whichever of scaling, damage tracking or plain conversion is active */
+static void uvc_fb_convert_any_lines(void * data, unsigned int first_line, unsigned int last_line)
+{
+    if (gadget->fb_scaler.enabled) {
+        uvc_fb_scale_lines(data, first_line, last_line);
+    } else if (gadget->fb_damage.enabled) {
+        uvc_fb_convert_lines_damage(data, first_line, last_line);
+    } else {
+        uvc_fb_convert_lines(data, first_line, last_line);
+    }
+}
+
+static void uvc_fb_encode_lines(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct fb_convert_job * job = data;
+
+    uvc_fb_convert_any_lines(data, first_line, last_line);
+    jpeg_encode_lines(job->jpeg, job->dst, first_line, last_line);
+}
+
+static void uvc_fb_nv12_lines(void * data, unsigned int first_line, unsigned int last_line)
+{
+    struct fb_convert_job * job = data;
+
+    uvc_fb_convert_any_lines(data, first_line, last_line);
+    yuyv2nv12_lines(job->nv12, job->dst, gadget->fb_nv12.width, gadget->fb_nv12.height, first_line, last_line);
+}
+
+/* Returns -ENOSPC when the encoded frame doesn't fit, buf must not be queued then */
+static int uvc_fb_fill_buffer(struct v4l2_buffer * buf)
+{
+    struct fb_convert_job job;
+    uint8_t * uvc_pixels = (uint8_t *) gadget->uvc_dev.mem[buf->index].start;
+    unsigned int width = (gadget->fb_scaler.enabled) ? gadget->fb_scaler.width : gadget->fb_dev.fb_width;
+    unsigned int height = (gadget->fb_scaler.enabled) ? gadget->fb_scaler.height : gadget->fb_dev.fb_height;
+    bool damage = gadget->fb_damage.enabled && !gadget->fb_scaler.enabled;
+    unsigned int capacity;
+
+    buf->bytesused = height * width * 2;
+
+    job.dst     = uvc_pixels;
+    job.src     = fb_scanout_memory();
+    job.convert = rgb2yuyv_line_kernel(gadget->fb_dev.fb_bpp, gadget->fb_dev.fb_bgr);
+    job.jpeg    = NULL;
+    job.nv12    = NULL;
+
+    if (!job.src || !job.convert) {
+        return 0;
+    }
+
+    if (gadget->fb_jpeg.enabled) {
+        job.dst  = gadget->fb_jpeg.yuyv;
+        job.jpeg = &gadget->fb_jpeg;
+
+        fb_pool_run(uvc_fb_encode_lines, &job, height, (damage) ? FB_TILE_HEIGHT : JPEG_MCU_HEIGHT);
+        gadget->fb_damage.valid = damage;
+
+        capacity = min(gadget->uvc_dev.mem[buf->index].length,
+            get_frame_size(V4L2_PIX_FMT_MJPEG, width, height));
+
+        buf->bytesused = jpeg_encoder_finish(&gadget->fb_jpeg, uvc_pixels, capacity);
+        if (!buf->bytesused) {
+            printf("JPEG: Encoded frame exceeds %u bytes, frame dropped\n", capacity);
+            return -ENOSPC;
+        }
+        return 0;
+    }
+
+    if (gadget->fb_nv12.enabled) {
+        job.dst  = gadget->fb_nv12.yuyv;
+        job.nv12 = uvc_pixels;
+
+        fb_pool_run(uvc_fb_nv12_lines, &job, height, (damage) ? FB_TILE_HEIGHT : 2);
+        gadget->fb_damage.valid = damage;
+
+        buf->bytesused = get_frame_size(V4L2_PIX_FMT_NV12, width, height);
+        return 0;
+    }
+
+    if (gadget->fb_scaler.enabled) {
+        fb_pool_run(uvc_fb_scale_lines, &job, height, 2);
+        return 0;
+    }
+
+    if (gadget->fb_damage.enabled) {
+        fb_pool_run(uvc_fb_convert_lines_damage, &job, gadget->fb_dev.fb_height, FB_TILE_HEIGHT);
+        gadget->fb_damage.valid = true;
+        return 0;
+    }
+
+    fb_pool_run(uvc_fb_convert_lines, &job, gadget->fb_dev.fb_height, 2);
+    return 0;
+}
+
+/* The still image borrows the scaling code, which works on gadget->fb_scaler */
+static void uvc_fb_still_swap_scaler()
+{
+    struct fb_scaler scaler = gadget->fb_scaler;
+
+    gadget->fb_scaler = gadget->uvc_still.scaler;
+    gadget->uvc_still.scaler = scaler;
+}
+
+static void uvc_fb_still_uninit()
+{
+    uvc_fb_still_swap_scaler();
+    fb_scaler_uninit();
+    uvc_fb_still_swap_scaler();
+
+    jpeg_encoder_uninit(&gadget->uvc_still.jpeg);
+    free(gadget->uvc_still.buffer);
+    gadget->uvc_still.buffer = NULL;
+    gadget->uvc_still.capacity = 0;
+}
+
+static int uvc_fb_still_init(unsigned int width, unsigned int height)
+{
+    struct uvc_still * still = &gadget->uvc_still;
+    int ret;
+
+    if (still->jpeg.enabled && still->jpeg.width == width && still->jpeg.height == height) {
+        return 0;
+    }
+    uvc_fb_still_uninit();
+
+    uvc_fb_still_swap_scaler();
+    ret = fb_scaler_init(width, height);
+    uvc_fb_still_swap_scaler();
+    if (ret < 0) {
+        return ret;
+    }
+
+    still->capacity = get_frame_size(V4L2_PIX_FMT_MJPEG, width, height);
+    still->buffer = malloc(still->capacity);
+    if (!still->buffer || jpeg_encoder_init(&still->jpeg, width, height, gadget->settings.jpeg_quality) < 0) {
+        printf("STILL: Out of memory for %ux%u still images\n", width, height);
+        uvc_fb_still_uninit();
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Renders the triggered still image into the still buffer and hands it to the
+ * dequeued UVC buffer instead of a video frame. Returns 0 when buf holds the
+ * still image, the trigger is reset either way.
+ */
+static int uvc_fb_still_fill(struct v4l2_buffer * buf)
+{
+    struct uvc_still * still = &gadget->uvc_still;
+    struct fb_convert_job job;
+    unsigned int length = gadget->uvc_dev.mem[buf->index].length;
+    unsigned int bytesused;
+    bool damage;
+
+    still->trigger = STILL_TRIGGER_NORMAL;
+
+    if (uvc_fb_still_init(still->width, still->height) < 0) {
+        still->dropped++;
+        return -EINVAL;
+    }
+
+    job.dst     = still->jpeg.yuyv;
+    job.src     = fb_scanout_memory();
+    job.convert = rgb2yuyv_line_kernel(gadget->fb_dev.fb_bpp, gadget->fb_dev.fb_bgr);
+    job.jpeg    = &still->jpeg;
+    job.nv12    = NULL;
+
+    if (!job.src || !job.convert) {
+        still->dropped++;
+        return -EINVAL;
+    }
+
+    /* an unscaled still image keeps the damage tracker up to date */
+    damage = gadget->fb_damage.enabled && !still->scaler.enabled;
+
+    uvc_fb_still_swap_scaler();
+    fb_pool_run(uvc_fb_encode_lines, &job, still->height, (damage) ? FB_TILE_HEIGHT : JPEG_MCU_HEIGHT);
+    uvc_fb_still_swap_scaler();
+
+    if (damage) {
+        gadget->fb_damage.valid = true;
+    }
+
+    bytesused = jpeg_encoder_finish(&still->jpeg, still->buffer, still->capacity);
+    if (!bytesused || bytesused > length) {
+        printf("STILL: Still image exceeds the UVC buffer of %u bytes, dropped\n", length);
+        still->dropped++;
+        return -EINVAL;
+    }
+
+    memcpy(gadget->uvc_dev.mem[buf->index].start, still->buffer, bytesused);
+    buf->bytesused = bytesused;
+    still->sent++;
+
+    printf("STILL: Still image %ux%u sent, %u bytes\n", still->width, still->height, bytesused);
+    return 0;
+}
+
+static void uvc_fb_video_process()
+{
+    struct v4l2_buffer ubuf;
+    struct timespec start;
+    struct timespec end;
+    int ret = 0;
+    /*
+     * Return immediately if UVC video output device has not started
+     * streaming yet.
+     */
+    if (!gadget->uvc_dev.is_streaming) {
+        return;
+    }
+
+    if (gadget->uvc_dev.fb_held) {
+        ubuf = gadget->uvc_dev.fb_held_buf;
+        gadget->uvc_dev.fb_held = false;
+
+    } else {
+        /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
+        CLEAR(ubuf);
+        ubuf.type   = gadget->uvc_dev.buffer_type;
+        ubuf.memory = gadget->uvc_dev.memory_type;
+
+        if (ioctl(gadget->uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
+            printf("%s: Unable to dequeue buffer: %s (%d).\n",
+                gadget->uvc_dev.device_type_name, strerror(errno), errno);
+            return;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (gadget->uvc_still.trigger == STILL_TRIGGER_NORMAL || uvc_fb_still_fill(&ubuf) < 0) {
+        ret = uvc_fb_fill_buffer(&ubuf);
+    }
+    fb_scanout_done();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* an empty buffer would reach the host as a frame, keep it for the next frame instead */
+    if (ret < 0) {
+        gadget->uvc_dev.fb_held_buf = ubuf;
+        gadget->uvc_dev.fb_held = true;
+        gadget->uvc_dev.fb_dropped++;
+        return;
+    }
 
-    if (ioctl(v4l2_dev.fd, VIDIOC_DQBUF, &vbuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-            v4l2_dev.device_type_name, strerror(errno), errno);
+    if (ioctl(gadget->uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
+        printf("%s: Unable to queue buffer: %s (%d).\n",
+            gadget->uvc_dev.device_type_name, strerror(errno), errno);
         return;
     }
 
-    v4l2_dev.dqbuf_count++;
+    gadget->uvc_dev.qbuf_count++;
+
+    if (gadget->settings.show_fps) {
+        uvc_count_buffer(elapsed_ns(&start, &end));
+    }
+}
+
+static void uvc_v4l2_video_process()
+{
+    struct v4l2_buffer ubuf;
+    /*
+     * Do not dequeue buffers from UVC side until there are atleast
+     * 2 buffers available at UVC domain.
+     */
+    if (!gadget->uvc_shutdown_requested && ((gadget->uvc_dev.dqbuf_count + 1) >= gadget->uvc_dev.qbuf_count)) {
+        return;
+    }
 
-    /* Queue video buffer to UVC domain. */
+    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
     CLEAR(ubuf);
-    ubuf.type      = uvc_dev.buffer_type;
-    ubuf.memory    = uvc_dev.memory_type;
-    ubuf.m.userptr = (unsigned long) v4l2_dev.mem[vbuf.index].start;
-    ubuf.length    = v4l2_dev.mem[vbuf.index].length;
-    ubuf.index     = vbuf.index;
-    ubuf.bytesused = vbuf.bytesused;
-
-    if (ioctl(uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
-        /* Check for a USB disconnect/shutdown event. */
-        if (errno == ENODEV) {
-            uvc_shutdown_requested = true;
-            printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_QBUF\n");
+    ubuf.type   = gadget->uvc_dev.buffer_type;
+    ubuf.memory = gadget->uvc_dev.memory_type;
+
+    /* Dequeue the spent buffer from UVC domain */
+    if (ioctl(gadget->uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
+        printf("%s: Unable to dequeue buffer: %s (%d).\n",
+            gadget->uvc_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    gadget->uvc_dev.dqbuf_count++;
+    v4l2_adaptive_dequeued();
+
+    /*
+        * If the dequeued buffer was marked with state ERROR by the
+        * underlying UVC driver gadget, do not queue the same to V4l2
+        * and wait for a STREAMOFF event on UVC side corresponding to
+        * set_alt(0). So, now all buffers pending at UVC end will be
+        * dequeued one-by-one and we will enter a state where we once
+        * again wait for a set_alt(1) command from the USB host side.
+        */
+    if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
+        gadget->uvc_shutdown_requested = true;
+        printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_DQBUF\n");
+        return;
+    }
+
+    /* mem2mem CAPTURE buffers go back to the mem2mem device */
+    if (gadget->v4l2_m2m.enabled) {
+        v4l2_m2m_release(ubuf.index);
+
+        if (gadget->settings.show_fps) {
+            uvc_count_buffer(0);
         }
         return;
     }
 
-    uvc_dev.qbuf_count++;
+    /* The capture thread requeues or frees the buffer */
+    if (gadget->pipeline.enabled) {
+        pipeline_push(&gadget->pipeline.spent, ubuf.index, 0);
 
-    if (!uvc_dev.is_streaming) {
-        uvc_video_stream(STREAM_ON);
-        settings.blink_on_startup = 0;
-        streaming_status_value(uvc_dev.is_streaming);
+        if (gadget->settings.show_fps) {
+            uvc_count_buffer(0);
+        }
+        return;
     }
-}
 
-/* ---------------------------------------------------------------------------
- * V4L2 generic stuff
- */
+    /* Converted frames use their own buffers, the capture buffer was already requeued */
+    if (gadget->v4l2_convert.enabled) {
+        v4l2_convert_release(ubuf.index);
 
-static int v4l2_get_format(struct v4l2_device * dev)
-{
-    struct v4l2_format fmt;
-    int ret;
+        if (gadget->settings.show_fps) {
+            uvc_count_buffer(0);
+        }
+        return;
+    }
 
-    CLEAR(fmt);
-    fmt.type = dev->buffer_type;
+    /* A shared capture buffer waits for the other tee members */
+    if (gadget->tee.owner) {
+        v4l2_tee_release(ubuf.index);
 
-    ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
-    if (ret < 0) {
-        return ret;
+        if (gadget->settings.show_fps) {
+            uvc_count_buffer(0);
+        }
+        return;
     }
 
-    printf("%s: Getting current format: %c%c%c%c %ux%u\n",
-        dev->device_type_name, pixfmtstr(fmt.fmt.pix.pixelformat),
-        fmt.fmt.pix.width, fmt.fmt.pix.height);
+    /* Queue the buffer to V4L2 domain */
+    v4l2_video_requeue(ubuf.index);
 
-    return 0;
+    if (gadget->settings.show_fps) {
+        uvc_count_buffer(0);
+    }
 }
 
-static int v4l2_set_format(struct v4l2_device * dev, struct v4l2_format * fmt)
+static const char * pipeline_thread_name(enum pipeline_thread_type type)
+{
+    switch (type) {
+    case PIPELINE_CAPTURE:
+        return "capture";
+
+    case PIPELINE_TRANSMIT:
+        return "transmit";
+
+    default:
+        return "control";
+    }
+}
+
+/* Realtime priority for the video threads, CPU affinity for all of them */
+static void pipeline_thread_setup(enum pipeline_thread_type type)
 {
+    struct sched_param param;
+    cpu_set_t cpuset;
     int ret;
 
-    ret = ioctl(dev->fd, VIDIOC_S_FMT, fmt);
-    if (ret < 0) {
-        printf("%s: Unable to set format %s (%d).\n",
-            dev->device_type_name, strerror(errno), errno);
-        return ret;
+    if (gadget->settings.pipeline_priority > 0 && type != PIPELINE_CONTROL) {
+        CLEAR(param);
+        param.sched_priority = gadget->settings.pipeline_priority;
+
+        ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret) {
+            printf("PIPELINE: Unable to set %s thread priority %d: %s (%d).\n",
+                pipeline_thread_name(type), gadget->settings.pipeline_priority, strerror(ret), ret);
+        }
     }
 
-    printf("%s: Setting format to: %c%c%c%c %ux%u\n",
-        dev->device_type_name, pixfmtstr(fmt->fmt.pix.pixelformat),
-        fmt->fmt.pix.width, fmt->fmt.pix.height);
+    if (gadget->settings.pipeline_cpus[type] >= 0 && gadget->settings.pipeline_cpus[type] < CPU_SETSIZE) {
+        CPU_ZERO(&cpuset);
+        CPU_SET(gadget->settings.pipeline_cpus[type], &cpuset);
 
-    return 0;
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (ret) {
+            printf("PIPELINE: Unable to pin %s thread to CPU %d: %s (%d).\n",
+                pipeline_thread_name(type), gadget->settings.pipeline_cpus[type], strerror(ret), ret);
+        }
+    }
 }
 
-static int v4l2_apply_format(struct v4l2_device * dev, unsigned int pixelformat,
-    unsigned int width, unsigned int height)
+static bool pipeline_stopping(enum pipeline_thread_type type)
 {
-    struct v4l2_format fmt;
-    int ret = -EINVAL;
+    return __atomic_load_n(&gadget->pipeline.threads[type].stop, __ATOMIC_ACQUIRE);
+}
 
-    if (dev->is_streaming || !dev->fd) {
-        return ret;
-    }
+/* Sleeps until the thread is woken or fd is ready, returns the events of fd */
+static short pipeline_wait(enum pipeline_thread_type type, int fd, short events)
+{
+    struct pollfd fds[2];
+    uint64_t count;
 
-    CLEAR(fmt);
-    fmt.type                = dev->buffer_type;
-    fmt.fmt.pix.width       = width;
-    fmt.fmt.pix.height      = height;
-    fmt.fmt.pix.sizeimage   = get_frame_size(pixelformat, width, height);
-    fmt.fmt.pix.pixelformat = pixelformat;
-    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+    fds[0].fd      = gadget->pipeline.threads[type].wakefd;
+    fds[0].events  = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd      = (events) ? fd : -1;
+    fds[1].events  = events;
+    fds[1].revents = 0;
 
-    ret = v4l2_set_format(dev, &fmt);
-    if (ret < 0) {
-        return ret;
+    if (poll(fds, 2, -1) < 0) {
+        return 0;
     }
 
-    return v4l2_get_format(dev);
+    /* only resets the counter, the rings tell what to do */
+    if ((fds[0].revents & POLLIN) && read(fds[0].fd, &count, sizeof count) < 0) {
+        return 0;
+    }
+    return fds[1].revents;
 }
 
-static void v4l2_set_ctrl_value(struct control_mapping_pair ctrl, unsigned int ctrl_v4l2, int v4l2_ctrl_value)
+/* Dequeues captured frames and converts them, requeues what the host is done with */
+static void * pipeline_capture_thread(void * arg)
 {
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control;
-    CLEAR(queryctrl);
+    struct pipeline_item item;
+    short revents;
 
-    queryctrl.id = ctrl_v4l2;
-    if (ioctl(v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl) == -1) {
-        if (errno != EINVAL) {
-            printf("%s: %s VIDIOC_QUERYCTRL failed: %s (%d).\n",
-                uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+    gadget = arg;
+    pipeline_thread_setup(PIPELINE_CAPTURE);
 
-        } else {
-            printf("%s: %s is not supported: %s (%d).\n",
-                uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
+    while (!pipeline_stopping(PIPELINE_CAPTURE)) {
+        while (pipeline_pop(&gadget->pipeline.spent, &item)) {
+            if (gadget->v4l2_convert.enabled) {
+                v4l2_convert_release(item.index);
+            } else {
+                v4l2_video_requeue(item.index);
+            }
+        }
+
+        revents = pipeline_wait(PIPELINE_CAPTURE, gadget->v4l2_dev.fd,
+            (gadget->v4l2_dev.dqbuf_count < gadget->v4l2_dev.qbuf_count) ? POLLIN : 0);
+
+        if (revents & (POLLIN | POLLERR)) {
+            if (gadget->v4l2_convert.enabled) {
+                v4l2_convert_video_process();
+            } else {
+                v4l2_uvc_video_process();
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Queues ready frames to the UVC device and dequeues the ones sent to the host */
+static void * pipeline_transmit_thread(void * arg)
+{
+    struct pipeline_item item;
+    short revents;
+
+    gadget = arg;
+    pipeline_thread_setup(PIPELINE_TRANSMIT);
 
+    while (!pipeline_stopping(PIPELINE_TRANSMIT)) {
+        while (pipeline_pop(&gadget->pipeline.ready, &item)) {
+            if (gadget->v4l2_convert.enabled) {
+                v4l2_convert_queue(item.index, item.value);
+            } else {
+                v4l2_uvc_video_queue(item.index, item.value);
+            }
         }
 
-    } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-        printf("%s: %s is disabled.\n", uvc_dev.device_type_name, ctrl.v4l2_name);
+        revents = pipeline_wait(PIPELINE_TRANSMIT, gadget->uvc_dev.fd,
+            (gadget->uvc_dev.is_streaming &&
+                (gadget->uvc_shutdown_requested || gadget->uvc_dev.dqbuf_count + 1 < gadget->uvc_dev.qbuf_count)) ? POLLOUT : 0);
 
-    } else {
-        CLEAR(control);
-        control.id = ctrl.v4l2;
-        control.value = v4l2_ctrl_value;
+        if (revents & (POLLOUT | POLLERR)) {
+            uvc_v4l2_video_process();
+        }
+    }
+    return NULL;
+}
 
-        if (ioctl(v4l2_dev.fd, VIDIOC_S_CTRL, &control) == -1) {
-            printf("%s: %s VIDIOC_S_CTRL failed: %s (%d).\n",
-                uvc_dev.device_type_name, ctrl.v4l2_name, strerror(errno), errno);
-            return;
+/* Applies V4L2 control writes, a slow VIDIOC_S_CTRL no longer holds up EP0 or video */
+static void * pipeline_control_thread(void * arg)
+{
+    struct control_mapping_pair ctrl;
+    struct pipeline_item item;
+
+    gadget = arg;
+    pipeline_thread_setup(PIPELINE_CONTROL);
+
+    while (!pipeline_stopping(PIPELINE_CONTROL)) {
+        while (pipeline_pop(&gadget->pipeline.controls, &item)) {
+            ctrl = gadget->pipeline.control_mapping[item.index];
+            ctrl.value = item.value;
+            v4l2_set_ctrl(ctrl);
         }
-        printf("%s: %s changed value (V4L2: %d, UVC: %d)\n",
-            uvc_dev.device_type_name, ctrl.v4l2_name, v4l2_ctrl_value, ctrl.value);
+
+        pipeline_wait(PIPELINE_CONTROL, -1, 0);
     }
+    return NULL;
 }
 
-static void v4l2_set_ctrl(struct control_mapping_pair ctrl)
+static int pipeline_thread_start(enum pipeline_thread_type type, void * (* fn)(void *),
+    struct pipeline_ring * ring)
 {
-    int v4l2_ctrl_value = 0;
-    int v4l2_diff = ctrl.v4l2_maximum - ctrl.v4l2_minimum;
-    int ctrl_diff = ctrl.maximum - ctrl.minimum;
+    struct pipeline_thread * thread = &gadget->pipeline.threads[type];
+    int ret;
 
-    if (ctrl.value < ctrl.minimum) {
-        ctrl.value = ctrl.minimum;
+    thread->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thread->wakefd < 0) {
+        printf("PIPELINE: Unable to create eventfd: %s (%d).\n", strerror(errno), errno);
+        return -EINVAL;
     }
 
-    if (ctrl.value > ctrl.maximum) {
-        ctrl.value = ctrl.maximum;
+    ring->head   = 0;
+    ring->tail   = 0;
+    ring->wakefd = thread->wakefd;
+    thread->stop = false;
+
+    ret = pthread_create(&thread->thread, NULL, fn, gadget);
+    if (ret) {
+        printf("PIPELINE: Unable to start %s thread: %s (%d).\n",
+            pipeline_thread_name(type), strerror(ret), ret);
+        close(thread->wakefd);
+        return -EINVAL;
     }
 
-    v4l2_ctrl_value = (ctrl.value - ctrl.minimum) * v4l2_diff / ctrl_diff + ctrl.v4l2_minimum;
+    thread->started = true;
+    return 0;
+}
 
-    v4l2_set_ctrl_value(ctrl, ctrl.v4l2, v4l2_ctrl_value);
+static void pipeline_thread_stop(enum pipeline_thread_type type)
+{
+    struct pipeline_thread * thread = &gadget->pipeline.threads[type];
+    uint64_t wake = 1;
 
-    if (ctrl.v4l2 == V4L2_CID_RED_BALANCE) {
-        v4l2_set_ctrl_value(ctrl, V4L2_CID_BLUE_BALANCE, v4l2_ctrl_value);
+    if (!thread->started) {
+        return;
+    }
+
+    __atomic_store_n(&thread->stop, true, __ATOMIC_RELEASE);
+    if (write(thread->wakefd, &wake, sizeof wake) < 0) {
+        printf("PIPELINE: Unable to wake thread: %s (%d)\n", strerror(errno), errno);
     }
+
+    pthread_join(thread->thread, NULL);
+    close(thread->wakefd);
+    thread->started = false;
 }
 
-static void v4l2_apply_camera_control(struct control_mapping_pair * mapping,
-    struct v4l2_queryctrl queryctrl, struct v4l2_control control)
+static void pipeline_stop()
 {
-    mapping->enabled       = true;
-    mapping->control_type  = queryctrl.type;
-    mapping->v4l2_minimum  = queryctrl.minimum;
-    mapping->v4l2_maximum  = queryctrl.maximum;
-    mapping->minimum        = 0;
-    mapping->maximum       = (0 - queryctrl.minimum) + queryctrl.maximum;
-    mapping->step          = queryctrl.step;
-    mapping->default_value = (0 - queryctrl.minimum) + queryctrl.default_value;
-    mapping->value         = (0 - queryctrl.minimum) + control.value;
-    
-    printf("V4L2: Supported control %s (%s = %s)\n", queryctrl.name,
-        mapping->v4l2_name, mapping->uvc_name);
+    if (!gadget->pipeline.enabled) {
+        return;
+    }
 
-    printf("V4L2:   V4L2: min: %d, max: %d, step: %d, default: %d, value: %d\n",
-        queryctrl.minimum,
-        queryctrl.maximum,
-        queryctrl.step,
-        queryctrl.default_value,
-        control.value
-    );
+    pipeline_thread_stop(PIPELINE_CAPTURE);
+    pipeline_thread_stop(PIPELINE_TRANSMIT);
+    gadget->pipeline.enabled = false;
 
-    printf("V4L2:   UVC: min: %d, max: %d, step: %d, default: %d, value: %d\n",
-        mapping->minimum,
-        mapping->maximum,
-        queryctrl.step,
-        mapping->default_value,
-        mapping->value
-    );
+    printf("PIPELINE: Capture and transmit threads stopped\n");
 }
 
-static void v4l2_get_controls()
+/*
+ * Hands the video of a V4L2 stream to the capture and transmit threads, the
+ * main loop stops watching the capture fd and UVC buffers until stream off.
+ * mem2mem streams stay on the main thread.
+ */
+static void pipeline_start()
+{
+    if (!gadget->settings.pipeline_threads || gadget->v4l2_m2m.enabled) {
+        return;
+    }
+
+    gadget->pipeline.enabled = true;
+
+    if (pipeline_thread_start(PIPELINE_TRANSMIT, pipeline_transmit_thread, &gadget->pipeline.ready) < 0 ||
+        pipeline_thread_start(PIPELINE_CAPTURE, pipeline_capture_thread, &gadget->pipeline.spent) < 0
+    ) {
+        pipeline_stop();
+        return;
+    }
+
+    printf("PIPELINE: Capture and transmit threads started\n");
+}
+
+/* Largest still image of the committed format, a still image has to fit one UVC buffer */
+static unsigned int uvc_still_max_frame_size(unsigned int pixelformat)
 {
+    struct uvc_frame_format * frame_format;
+    unsigned int size = 0;
     int i;
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control;
-    unsigned int id;
-    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-    CLEAR(queryctrl);
 
-    queryctrl.id = next_fl;
-    while (0 == ioctl (v4l2_dev.fd, VIDIOC_QUERYCTRL, &queryctrl)) {
+    if (gadget->settings.source_device == DEVICE_TYPE_V4L2 || pixelformat != V4L2_PIX_FMT_MJPEG) {
+        return 0;
+    }
 
-        id = queryctrl.id;
-        queryctrl.id |= next_fl;
+    for (i = 0; i <= gadget->last_format_index; i++) {
+        frame_format = &gadget->uvc_frame_format[i];
+        if (frame_format->bFormatIndex == gadget->uvc_dev.commit.bFormatIndex &&
+            frame_format->bmCapabilities & UVC_FRAME_CAP_STILL
+        ) {
+            size = max(size, get_frame_size(frame_format->video_format, frame_format->wWidth, frame_format->wHeight));
+        }
+    }
+    return size;
+}
+
+/* Configures the devices for the format the host committed last */
+static void uvc_apply_committed_format()
+{
+    if (!gadget->format_state.committed) {
+        return;
+    }
+
+    if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
+        v4l2_negotiate(gadget->format_state.pixelformat, gadget->format_state.width, gadget->format_state.height);
+        v4l2_pacing_start(v4l2_set_frame_interval(&gadget->v4l2_dev, gadget->format_state.interval), gadget->format_state.interval);
+    }
+    gadget->uvc_dev.min_sizeimage = uvc_still_max_frame_size(gadget->format_state.pixelformat);
+    v4l2_apply_format(&gadget->uvc_dev, gadget->format_state.pixelformat, gadget->format_state.width, gadget->format_state.height);
+
+    printf("UVC: Format commits: %u, capture negotiations: %u (%u skipped), "
+        "S_FMT: V4L2 %u (%u skipped), UVC %u (%u skipped)\n",
+        gadget->format_state.commits, gadget->format_state.negotiations, gadget->format_state.negotiations_skipped,
+        gadget->v4l2_dev.format_applied, gadget->v4l2_dev.format_skipped,
+        gadget->uvc_dev.format_applied, gadget->uvc_dev.format_skipped);
+}
+
+/* Starts the shared camera of the tee owner in the format a member committed */
+static int v4l2_tee_capture_start(struct format_state * format)
+{
+    if (v4l2_negotiate(format->pixelformat, format->width, format->height) < 0) {
+        return -EINVAL;
+    }
+
+    if (gadget->v4l2_convert.enabled) {
+        printf("%sTEE: %s can't capture the committed format, only passthrough formats can be shared\n",
+            gadget->label, gadget->settings.v4l2_devname);
+        return -EINVAL;
+    }
+    v4l2_pacing_start(v4l2_set_frame_interval(&gadget->v4l2_dev, format->interval), format->interval);
+
+    if (v4l2_request_bufs(gadget->v4l2_dev.nbufs) < 0) {
+        return -EINVAL;
+    }
+
+    if (gadget->v4l2_dev.nbufs > V4L2_TEE_MAX_BUFFERS) {
+        printf("%sTEE: %u capture buffers, at most %u can be shared\n",
+            gadget->label, gadget->v4l2_dev.nbufs, V4L2_TEE_MAX_BUFFERS);
+        goto err;
+    }
+
+    v4l2_dmabuf_export(&gadget->v4l2_dev);
+
+    if (v4l2_qbuf_mmap(&gadget->v4l2_dev) < 0) {
+        goto err;
+    }
 
-        if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-            continue;
-        }
+    v4l2_video_stream(STREAM_ON);
 
-        for (i = 0; i < control_mapping_size; i++) {
-            if (control_mapping[i].v4l2 == id) {
-                control.id = queryctrl.id;
-                if (0 == ioctl (v4l2_dev.fd, VIDIOC_G_CTRL, &control)) {
-                    v4l2_apply_camera_control(&control_mapping[i], queryctrl, control);
-                }
-            }
-        }
+    if (gadget->v4l2_dev.pixelformat == V4L2_PIX_FMT_H264) {
+        v4l2_request_keyframe(&gadget->v4l2_dev);
     }
+
+    CLEAR(gadget->tee.refcount);
+    gadget->tee.pixelformat = format->pixelformat;
+    gadget->tee.width       = format->width;
+    gadget->tee.height      = format->height;
+    gadget->tee.frames      = 0;
+    gadget->tee.queued      = 0;
+    return 0;
+
+err:
+    v4l2_uninit_device();
+    v4l2_request_bufs(0);
+    return -EINVAL;
 }
 
-static void v4l2_close()
+/* Stops the shared camera after its last member stopped streaming */
+static void v4l2_tee_capture_stop()
 {
-    if (v4l2_dev.fd) {
-        close(v4l2_dev.fd);
-        v4l2_dev.fd = -1;
-    }
+    v4l2_video_stream(STREAM_OFF);
+    v4l2_uninit_device();
+    v4l2_request_bufs(0);
+    v4l2_pacing_stop();
+
+    printf("%sTEE: Captured frames: %llu, queued to members: %llu\n",
+        gadget->label, gadget->tee.frames, gadget->tee.queued);
 }
 
-static void uvc_close()
+/*
+ * STREAMON of a tee member. The first streaming member starts the camera, the
+ * others join when they committed the same format. The UVC device gets the
+ * capture buffers themselves, as DMABUF when exported.
+ */
+static void uvc_handle_streamon_tee()
 {
-    if (uvc_dev.fd) {
-        close(uvc_dev.fd);
-        uvc_dev.fd = -1;
+    struct uvc_gadget * member = gadget;
+    struct uvc_gadget * owner = gadget->tee.owner;
+    struct format_state * format = &gadget->format_state;
+    int ret = 0;
+
+    if (!format->committed || member->tee.streaming) {
+        return;
     }
-}
 
-static void fb_close()
-{
-    if (fb_dev.fd) {
-        close(fb_dev.fd);
-        fb_dev.fd = -1;
+    if (!owner->tee.streaming_members) {
+        gadget = owner;
+        ret = v4l2_tee_capture_start(format);
+        gadget = member;
+
+    } else if (format->pixelformat != owner->tee.pixelformat ||
+        format->width != owner->tee.width || format->height != owner->tee.height
+    ) {
+        printf("%sTEE: Committed format differs from the shared %c%c%c%c %ux%u stream\n", gadget->label,
+            pixfmtstr(owner->tee.pixelformat), owner->tee.width, owner->tee.height);
+        ret = -EINVAL;
     }
-}
 
-// https://stackoverflow.com/a/15683117
-static void v4l2_get_available_formats()
-{
-    struct v4l2_fmtdesc fmtdesc;
-    struct v4l2_frmsizeenum frmsize;
-    unsigned int width;
-    unsigned int height;
-    CLEAR(fmtdesc);
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ret < 0) {
+        return;
+    }
 
-    while (ioctl(v4l2_dev.fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
-        if (fmtdesc.pixelformat == V4L2_PIX_FMT_MJPEG || fmtdesc.pixelformat == V4L2_PIX_FMT_YUYV) {
-            frmsize.pixel_format = fmtdesc.pixelformat;
-            frmsize.index = 0;
-            while (ioctl(v4l2_dev.fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0) {
-                width = 0;
-                height = 0;
-                if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-                    width = frmsize.discrete.width;
-                    height = frmsize.discrete.height;
+    v4l2_apply_format(&gadget->uvc_dev, format->pixelformat, format->width, format->height);
 
-                } else if (frmsize.type == V4L2_FRMSIZE_TYPE_STEPWISE) {
-                    width = frmsize.stepwise.max_width;
-                    height = frmsize.stepwise.max_height;
+    gadget->v4l2_standby.streamon_time = monotonic_ms();
+    gadget->v4l2_standby.warm_start    = owner->tee.streaming_members > 0;
 
-                }
+    /* the capture buffers stay exported, other members may use them */
+    gadget->uvc_dev.memory_type = (owner->v4l2_dev.dmabuf_exported) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_USERPTR;
 
-                if (width && height) {
-                    printf("%s: Getting highest frame size: %c%c%c%c %ux%u\n",
-                        v4l2_dev.device_type_name, pixfmtstr(fmtdesc.pixelformat), width, height);
-                }
-                frmsize.index++;
-            }
+    if (uvc_request_bufs(owner->v4l2_dev.nbufs) < 0) {
+        if (gadget->uvc_dev.memory_type == V4L2_MEMORY_USERPTR) {
+            goto err;
+        }
+
+        printf("%s: Falling back to user pointer i/o\n", gadget->uvc_dev.device_type_name);
+        gadget->uvc_dev.memory_type = V4L2_MEMORY_USERPTR;
+
+        if (uvc_request_bufs(owner->v4l2_dev.nbufs) < 0) {
+            goto err;
         }
-        fmtdesc.index++;
     }
-}
 
-/* ---------------------------------------------------------------------------
- * UVC streaming related
- */
+    member->tee.streaming = true;
+    member->tee.held = 0;
+    owner->tee.streaming_members++;
+    return;
+
+err:
+    if (!owner->tee.streaming_members) {
+        gadget = owner;
+        v4l2_tee_capture_stop();
+        gadget = member;
+    }
+}
 
-static void uvc_fb_fill_buffer(struct v4l2_buffer * buf)
+/* STREAMOFF of a tee member, the buffers it still held are released */
+static void uvc_handle_streamoff_tee()
 {
-    unsigned int rgba1;
-    unsigned int rgba2;
-    unsigned int rgba1_last;
-    unsigned int rgba2_last;
-    unsigned int yvyu;
-    unsigned int yvyu_last;
-    unsigned char r1;
-    unsigned char b1;
-    unsigned char g1;
-    unsigned char r2;
-    unsigned char b2;
-    unsigned char g2;
-    unsigned int size = fb_dev.fb_height * fb_dev.fb_width;
-    char * uvc_pixels = (char *) uvc_dev.mem[buf->index].start;
-    char * fb_pixels  = (char *) fb_dev.fb_memory;
-
-    buf->bytesused = size * 2;
-
-    switch(fb_dev.fb_bpp) {
-        case 16:
-            while(size) {
-                b1 = (*(fb_pixels) & 0x1f) << 3;
-                g1 = (((*(fb_pixels + 1) & 0x7) << 3) | (*(fb_pixels) & 0xE0) >> 5) << 2;
-                r1 = (*(fb_pixels + 1) & 0xF8);
-                b2 = (*(fb_pixels + 2) & 0x1f) << 3;
-                g2 = (((*(fb_pixels + 3) & 0x7) << 3) | (*(fb_pixels + 2) & 0xE0) >> 5) << 2;
-                r2 = (*(fb_pixels + 3) & 0xF8);
-                yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);
-                memcpy(uvc_pixels, &yvyu, 4);
-                fb_pixels += 4;
-                uvc_pixels += 4;
-                size -= 2;
-            }
-            break;
+    struct uvc_gadget * member = gadget;
+    struct uvc_gadget * owner = gadget->tee.owner;
+    unsigned int i;
 
-        case 24:
-            while(size) {
-                memcpy(&rgba1, fb_pixels, 3);
-                memcpy(&rgba2, fb_pixels + 3, 3);
-                if (rgba1 == rgba1_last && rgba2 == rgba2_last) {
-                    memcpy(uvc_pixels, &yvyu_last, 4);
-                } else {
-                    r1 = rgba1 & 0xFF;
-                    g1 = (rgba1 >> 8) & 0xFF;
-                    b1 = (rgba1 >> 16) & 0xFF;
-                    r2 = rgba2 & 0xFF;
-                    g2 = (rgba2 >> 8) & 0xFF;
-                    b2 = (rgba2 >> 16) & 0xFF;
-                    yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);
-                    rgba1_last = rgba1;
-                    rgba2_last = rgba2;
-                    yvyu_last = yvyu;
-                    memcpy(uvc_pixels, &yvyu, 4);
-                }
-                fb_pixels += 6;
-                uvc_pixels += 4;
-                size -= 2;
-            }
-            break;
+    uvc_video_stream(STREAM_OFF);
+    uvc_request_bufs(0);
 
-        case 32:
-            while(size) {
-                memcpy(&rgba1, fb_pixels, 4);
-                memcpy(&rgba2, fb_pixels + 4, 4);
-                if (rgba1 == rgba1_last && rgba2 == rgba2_last) {
-                    memcpy(uvc_pixels, &yvyu_last, 4);
-                } else {
-                    r1 = rgba1 & 0xFF;
-                    g1 = (rgba1 >> 8) & 0xFF;
-                    b1 = (rgba1 >> 16) & 0xFF;
-                    r2 = rgba2 & 0xFF;
-                    g2 = (rgba2 >> 8) & 0xFF;
-                    b2 = (rgba2 >> 16) & 0xFF;
-                    yvyu = rgb2yvyu(r1, g1, b1, r2, g2, b2);
-                    rgba1_last = rgba1;
-                    rgba2_last = rgba2;
-                    yvyu_last = yvyu;
-                    memcpy(uvc_pixels, &yvyu, 4);
-                }
-                fb_pixels += 8;
-                uvc_pixels += 4;
-                size -= 2;
-            }
-            break;
+    if (member->tee.streaming) {
+        member->tee.streaming = false;
+        owner->tee.streaming_members--;
+
+        for (i = 0; i < V4L2_TEE_MAX_BUFFERS; i++) {
+            v4l2_tee_release(i);
+        }
+
+        if (!owner->tee.streaming_members) {
+            gadget = owner;
+            v4l2_tee_capture_stop();
+            gadget = member;
+        }
     }
- }
 
-static void uvc_fb_video_process()
+    streaming_status_value(gadget->uvc_dev.is_streaming);
+}
+
+static void uvc_handle_streamon_event()
 {
-    struct v4l2_buffer ubuf;
-    /*
-     * Return immediately if UVC video output device has not started
-     * streaming yet.
-     */
-    if (!uvc_dev.is_streaming) {
+    if (gadget->tee.owner) {
+        uvc_handle_streamon_tee();
         return;
     }
-    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
-    CLEAR(ubuf);
-    ubuf.type   = uvc_dev.buffer_type;
-    ubuf.memory = uvc_dev.memory_type;
 
-    if (ioctl(uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
-        return;
-    }
+    uvc_apply_committed_format();
 
-    uvc_fb_fill_buffer(&ubuf);
+    gadget->v4l2_standby.streamon_time = monotonic_ms();
+    gadget->v4l2_standby.warm_start    = gadget->v4l2_standby.warm;
 
-    if (ioctl(uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
-        printf("%s: Unable to queue buffer: %s (%d).\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
-        return;
+    if (gadget->settings.source_device == DEVICE_TYPE_V4L2 && gadget->v4l2_standby.warm) {
+        if (v4l2_standby_resume() < 0) {
+            return;
+        }
+
+    } else if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
+        v4l2_adaptive_start();
+
+        if (v4l2_request_bufs((gadget->v4l2_adaptive.enabled) ? gadget->v4l2_adaptive.count : gadget->v4l2_dev.nbufs) < 0) {
+            return;
+        }
+
+        if (!gadget->v4l2_convert.enabled) {
+            v4l2_dmabuf_export(&gadget->v4l2_dev);
+        }
+
+        if (v4l2_qbuf_mmap(&gadget->v4l2_dev) < 0) {
+            return;
+        }
+
+        /* Start V4L2 capturing now. */
+        v4l2_video_stream(STREAM_ON);
     }
 
-    uvc_dev.qbuf_count++;
+    if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
 
-    if (settings.show_fps) {
-        uvc_dev.buffers_processed++;
+        if (gadget->v4l2_dev.pixelformat == V4L2_PIX_FMT_H264) {
+            v4l2_request_keyframe(&gadget->v4l2_dev);
+        }
+
+        if (gadget->v4l2_m2m.enabled && v4l2_m2m_start() < 0) {
+            return;
+        }
     }
-}
 
-static void uvc_v4l2_video_process()
-{
-    struct v4l2_buffer ubuf;
-    struct v4l2_buffer vbuf;
     /*
-     * Do not dequeue buffers from UVC side until there are atleast
-     * 2 buffers available at UVC domain.
+     * Framebuffer is converted straight into driver owned buffers, capture
+     * or mem2mem buffers are passed as DMABUF when exported. User pointers
+     * are fallback.
      */
-    if (!uvc_shutdown_requested && ((uvc_dev.dqbuf_count + 1) >= uvc_dev.qbuf_count)) {
-        return;
-    }
+    struct v4l2_device * source = (gadget->v4l2_m2m.enabled) ? &gadget->v4l2_m2m.capture : &gadget->v4l2_dev;
 
-    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
-    CLEAR(ubuf);
-    ubuf.type   = uvc_dev.buffer_type;
-    ubuf.memory = uvc_dev.memory_type;
+    if (uvc_owns_buffers()) {
+        gadget->uvc_dev.memory_type = V4L2_MEMORY_MMAP;
+    } else {
+        gadget->uvc_dev.memory_type = (source->dmabuf_exported) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_USERPTR;
+    }
 
-    /* Dequeue the spent buffer from UVC domain */
-    if (ioctl(uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
-        return;
+    /* slots without memory of their own, adaptive mode may add capture buffers */
+    if (gadget->v4l2_adaptive.enabled) {
+        gadget->uvc_dev.nbufs = V4L2_ADAPTIVE_MAX_BUFFERS;
     }
 
-    uvc_dev.dqbuf_count++;
+    if (uvc_request_bufs(gadget->uvc_dev.nbufs) < 0) {
+        if (gadget->uvc_dev.memory_type == V4L2_MEMORY_USERPTR) {
+            return;
+        }
 
-    /*
-        * If the dequeued buffer was marked with state ERROR by the
-        * underlying UVC driver gadget, do not queue the same to V4l2
-        * and wait for a STREAMOFF event on UVC side corresponding to
-        * set_alt(0). So, now all buffers pending at UVC end will be
-        * dequeued one-by-one and we will enter a state where we once
-        * again wait for a set_alt(1) command from the USB host side.
-        */
-    if (ubuf.flags & V4L2_BUF_FLAG_ERROR) {
-        uvc_shutdown_requested = true;
-        printf("UVC: Possible USB shutdown requested from Host, seen during VIDIOC_DQBUF\n");
-        return;
-    }
+        printf("%s: Falling back to user pointer i/o\n", gadget->uvc_dev.device_type_name);
+        v4l2_dmabuf_close(source);
+        gadget->uvc_dev.memory_type = V4L2_MEMORY_USERPTR;
 
-    /* Queue the buffer to V4L2 domain */
-    CLEAR(vbuf);
-    vbuf.type   = v4l2_dev.buffer_type;
-    vbuf.memory = v4l2_dev.memory_type;
-    vbuf.index  = ubuf.index;
+        if (uvc_request_bufs(gadget->uvc_dev.nbufs) < 0) {
+            return;
+        }
+    }
 
-    if (ioctl(v4l2_dev.fd, VIDIOC_QBUF, &vbuf) < 0) {
-        printf("%s: Unable to queue buffer: %s (%d).\n",
-            v4l2_dev.device_type_name, strerror(errno), errno);
+    if (gadget->v4l2_convert.enabled && v4l2_convert_start() < 0) {
         return;
     }
 
-    v4l2_dev.qbuf_count++;
-
-    if (settings.show_fps) {
-        uvc_dev.buffers_processed++;
+    if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
+        pipeline_start();
     }
-}
 
-static void uvc_handle_streamon_event()
-{
-    if (settings.source_device == DEVICE_TYPE_V4L2) {
-        if (v4l2_request_bufs(v4l2_dev.nbufs) < 0) {
+    if (gadget->settings.source_device != DEVICE_TYPE_V4L2) {
+        if (gadget->uvc_dev.pixelformat == V4L2_PIX_FMT_H264) {
+            printf("FB: H264 format is not supported by framebuffer source\n");
             return;
         }
 
-        if (v4l2_qbuf_mmap(&v4l2_dev) < 0) {
+        if (fb_mmap_open() < 0) {
             return;
         }
 
-        /* Start V4L2 capturing now. */
-        v4l2_video_stream(STREAM_ON);
-    }
+        if (fb_scaler_init(gadget->uvc_dev.width, gadget->uvc_dev.height) < 0) {
+            return;
+        }
 
-    if (uvc_request_bufs(uvc_dev.nbufs) < 0) {
-        return;
-    }
+        if (gadget->uvc_dev.pixelformat == V4L2_PIX_FMT_MJPEG &&
+            jpeg_encoder_init(&gadget->fb_jpeg,
+                (gadget->fb_scaler.enabled) ? gadget->fb_scaler.width : gadget->fb_dev.fb_width,
+                (gadget->fb_scaler.enabled) ? gadget->fb_scaler.height : gadget->fb_dev.fb_height,
+                gadget->settings.jpeg_quality) < 0
+        ) {
+            return;
+        }
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        if (fb_mmap_open() < 0) {
+        if (gadget->uvc_dev.pixelformat == V4L2_PIX_FMT_NV12 &&
+            fb_nv12_init(
+                (gadget->fb_scaler.enabled) ? gadget->fb_scaler.width : gadget->fb_dev.fb_width,
+                (gadget->fb_scaler.enabled) ? gadget->fb_scaler.height : gadget->fb_dev.fb_height) < 0
+        ) {
             return;
         }
 
@@ -1259,28 +6147,71 @@ static void uvc_handle_streamon_event()
         }
 
         uvc_video_stream(STREAM_ON);
-        settings.blink_on_startup = 0;
-        streaming_status_value(uvc_dev.is_streaming);
+        gadget->settings.blink_on_startup = 0;
+        streaming_status_value(gadget->uvc_dev.is_streaming);
     }
 }
 
 static void uvc_handle_streamoff_event()
 {
-    if (settings.source_device == DEVICE_TYPE_V4L2) {
-        v4l2_video_stream(STREAM_OFF);
-        v4l2_uninit_device();
-        v4l2_request_bufs(0);
+    bool standby = false;
+
+    if (gadget->tee.owner) {
+        uvc_handle_streamoff_tee();
+        return;
     }
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
+    if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
+        pipeline_stop();
+
+        standby = v4l2_standby_possible();
+        if (!standby) {
+            v4l2_video_stream(STREAM_OFF);
+            v4l2_uninit_device();
+            v4l2_request_bufs(0);
+        }
+        v4l2_convert_stop();
+        uvc_uninit_device();
+
+        if (gadget->v4l2_m2m.enabled) {
+            v4l2_m2m_stop();
+        }
+    }
+
+    if (gadget->settings.source_device != DEVICE_TYPE_V4L2) {
         fb_mmap_close();
+        fb_scaler_uninit();
+        fb_nv12_uninit();
+        jpeg_encoder_uninit(&gadget->fb_jpeg);
+        uvc_fb_still_uninit();
         uvc_uninit_device();
+
+        if (gadget->uvc_dev.fb_dropped) {
+            printf("%sFB: Frames dropped: %llu\n", gadget->label, gadget->uvc_dev.fb_dropped);
+        }
+        gadget->uvc_dev.fb_held    = false;
+        gadget->uvc_dev.fb_dropped = 0;
+    }
+
+    if (gadget->uvc_still.sent || gadget->uvc_still.dropped) {
+        printf("%sSTILL: Still images sent: %llu, dropped: %llu\n", gadget->label,
+            gadget->uvc_still.sent, gadget->uvc_still.dropped);
     }
+    gadget->uvc_still.trigger = STILL_TRIGGER_NORMAL;
+    gadget->uvc_still.sent    = 0;
+    gadget->uvc_still.dropped = 0;
 
     uvc_video_stream(STREAM_OFF);
     uvc_request_bufs(0);
+    v4l2_adaptive_stop();
+    v4l2_pacing_stop();
+
+    /* after the UVC device let go of the buffers */
+    if (standby) {
+        v4l2_standby_park();
+    }
 
-    streaming_status_value(uvc_dev.is_streaming);
+    streaming_status_value(gadget->uvc_dev.is_streaming);
 }
 
 /* ---------------------------------------------------------------------------
@@ -1301,18 +6232,18 @@ static int uvc_get_frame_format_index(int format_index, enum uvc_frame_format_ge
     int value;
     int i;
 
-    for (i = 0; i <= last_format_index; i++) {
-        if (format_index == -1 || format_index == (int) uvc_frame_format[i].bFormatIndex) {
+    for (i = 0; i <= gadget->last_format_index; i++) {
+        if (format_index == -1 || format_index == (int) gadget->uvc_frame_format[i].bFormatIndex) {
 
             switch (getter) {
                 case FORMAT_INDEX_MIN:
                 case FORMAT_INDEX_MAX:
-                    value = uvc_frame_format[i].bFormatIndex;
+                    value = gadget->uvc_frame_format[i].bFormatIndex;
                     break;
 
                 case FRAME_INDEX_MIN:
                 case FRAME_INDEX_MAX:
-                    value = uvc_frame_format[i].bFrameIndex;
+                    value = gadget->uvc_frame_format[i].bFrameIndex;
                     break;
             }
             if (index == -1) {
@@ -1344,11 +6275,11 @@ static int uvc_get_frame_format(struct uvc_frame_format ** frame_format,
     unsigned int iFormat, unsigned int iFrame)
 {
     int i;
-    for (i = 0; i <= last_format_index; i++) {
-        if (uvc_frame_format[i].bFormatIndex == iFormat &&
-            uvc_frame_format[i].bFrameIndex == iFrame
+    for (i = 0; i <= gadget->last_format_index; i++) {
+        if (gadget->uvc_frame_format[i].bFormatIndex == iFormat &&
+            gadget->uvc_frame_format[i].bFrameIndex == iFrame
         ) {
-            *frame_format = &uvc_frame_format[i];
+            *frame_format = &gadget->uvc_frame_format[i];
             return 0;
         }
     }
@@ -1357,20 +6288,64 @@ static int uvc_get_frame_format(struct uvc_frame_format ** frame_format,
 
 static void uvc_dump_frame_format(struct uvc_frame_format * frame_format, const char * title)
 {
-    printf("%s: format: %d, frame: %d, resolution: %dx%d, frame_interval: %d,  bitrate: [%d, %d]\n",
+    printf("%s: format: %d, frame: %d, resolution: %dx%d, frame_interval: %d (%u listed),  bitrate: [%d, %d]\n",
         title,
         frame_format->bFormatIndex,
         frame_format->bFrameIndex,
         frame_format->wWidth,
         frame_format->wHeight,
         frame_format->dwDefaultFrameInterval,
+        frame_format->frame_intervals,
         frame_format->dwMinBitRate,
         frame_format->dwMaxBitRate
     );
 }
 
+/*
+ * Picks the interval of the frame nearest to the requested one, 0 requests the
+ * default interval. Frames without an interval list only offer the default.
+ */
+static unsigned int uvc_frame_interval(struct uvc_frame_format * frame_format, unsigned int interval)
+{
+    unsigned int best;
+    unsigned int i;
+
+    if (frame_format->dwDefaultFrameInterval >= 100000) {
+        best = frame_format->dwDefaultFrameInterval;
+    } else {
+        best = 400000;
+    }
+
+    if (!interval) {
+        interval = best;
+    }
+
+    if (!frame_format->frame_intervals) {
+        return best;
+    }
+
+    best = frame_format->dwFrameInterval[0];
+    for (i = 1; i < frame_format->frame_intervals; i++) {
+        if (abs_diff(frame_format->dwFrameInterval[i], interval) < abs_diff(best, interval)) {
+            best = frame_format->dwFrameInterval[i];
+        }
+    }
+    return best;
+}
+
+/* High bandwidth endpoints lose 128 bytes of every additional transaction */
+static unsigned int uvc_max_payload_transfer_size()
+{
+    unsigned int size = gadget->streaming_maxpacket;
+
+    if (gadget->streaming_maxpacket > 1024 && gadget->streaming_maxpacket % 1024 != 0) {
+        size -= (gadget->streaming_maxpacket / 1024) * 128;
+    }
+    return size;
+}
+
 static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
-    enum stream_control_action action, int iformat, int iframe)
+    enum stream_control_action action, int iformat, int iframe, unsigned int interval)
 {
     int format_first;
     int format_last;
@@ -1379,7 +6354,6 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
     int format_frame_first;
     int format_frame_last;
     unsigned int frame_interval;
-    unsigned int dwMaxPayloadTransferSize;
 
     switch (action) {
     case STREAM_CONTROL_INIT:
@@ -1394,8 +6368,13 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
         printf("UVC: Streaming control: action: GET MAX\n");
         break;
 
+    case STREAM_CONTROL_DEF:
+        printf("UVC: Streaming control: action: GET DEF\n");
+        break;
+
     case STREAM_CONTROL_SET:
-        printf("UVC: Streaming control: action: SET, format: %d, frame: %d\n", iformat, iframe);
+        printf("UVC: Streaming control: action: SET, format: %d, frame: %d, interval: %u\n",
+            iformat, iframe, interval);
         break;
 
     }
@@ -1406,7 +6385,7 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
     frame_first = uvc_get_frame_format_index(-1, FRAME_INDEX_MIN);
     frame_last = uvc_get_frame_format_index(-1, FRAME_INDEX_MAX);
 
-    if (action == STREAM_CONTROL_MIN) {
+    if (action == STREAM_CONTROL_MIN || action == STREAM_CONTROL_DEF) {
         iformat = format_first;
         iframe = frame_first;
 
@@ -1420,44 +6399,129 @@ static void uvc_fill_streaming_control(struct uvc_streaming_control * ctrl,
         format_frame_first = uvc_get_frame_format_index(iformat, FRAME_INDEX_MIN);
         format_frame_last = uvc_get_frame_format_index(iformat, FRAME_INDEX_MAX);
 
-        iframe = clamp(iframe, format_frame_first, format_frame_last);
+        iframe = clamp(iframe, format_frame_first, format_frame_last);
+    }
+
+    struct uvc_frame_format * frame_format = &gadget->uvc_frame_format[0];
+    uvc_get_frame_format(&frame_format, iformat, iframe);
+
+    uvc_dump_frame_format(frame_format, "FRAME");
+
+    /* the shortest interval is the minimum, the longest the maximum */
+    if (action == STREAM_CONTROL_MIN) {
+        interval = 1;
+    } else if (action == STREAM_CONTROL_MAX) {
+        interval = UINT_MAX;
+    } else if (action != STREAM_CONTROL_SET) {
+        interval = 0;
+    }
+    frame_interval = uvc_frame_interval(frame_format, interval);
+
+    memset(ctrl, 0, sizeof * ctrl);
+    ctrl->bmHint                   = 1;
+    ctrl->bFormatIndex             = iformat;
+    ctrl->bFrameIndex              = iframe;
+    ctrl->dwMaxVideoFrameSize      = get_frame_size(frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+    ctrl->dwMaxPayloadTransferSize = uvc_max_payload_transfer_size();
+    ctrl->dwFrameInterval          = frame_interval;
+    ctrl->bmFramingInfo            = 3;
+    ctrl->bMinVersion              = format_first;
+    ctrl->bMaxVersion              = format_last;
+    ctrl->bPreferedVersion         = format_last;
+
+    dump_uvc_streaming_control(ctrl);
+
+    /* applied at STREAMON, see uvc_apply_committed_format() */
+    if (gadget->uvc_dev.control == UVC_VS_COMMIT_CONTROL && action == STREAM_CONTROL_SET) {
+        gadget->format_state.committed   = true;
+        gadget->format_state.pixelformat = frame_format->video_format;
+        gadget->format_state.width       = frame_format->wWidth;
+        gadget->format_state.height      = frame_format->wHeight;
+        gadget->format_state.interval    = frame_interval;
+        gadget->format_state.commits++;
+    }
+}
+
+/* Framebuffer MJPEG streams render still images of any still capable frame size */
+static bool uvc_still_rendered()
+{
+    return gadget->settings.source_device != DEVICE_TYPE_V4L2 && gadget->uvc_dev.pixelformat == V4L2_PIX_FMT_MJPEG;
+}
+
+/*
+ * Still frames are the frames of the committed video format with the still
+ * image bit, the largest one is the default. Streams whose still image is the
+ * next video frame only offer the committed video frame.
+ */
+static void uvc_fill_still_control(struct uvc_still_control * ctrl,
+    enum stream_control_action action, unsigned int iframe)
+{
+    struct uvc_frame_format * video = NULL;
+    struct uvc_frame_format * frame_format = NULL;
+    struct uvc_frame_format * candidate;
+    unsigned int iformat = gadget->uvc_dev.commit.bFormatIndex;
+    bool rendered;
+    int i;
+
+    uvc_get_frame_format(&video, iformat, gadget->uvc_dev.commit.bFrameIndex);
+    if (!video) {
+        memset(ctrl, 0, sizeof * ctrl);
+        return;
     }
+    rendered = gadget->settings.source_device != DEVICE_TYPE_V4L2 && video->video_format == V4L2_PIX_FMT_MJPEG;
 
-    struct uvc_frame_format * frame_format;
-    uvc_get_frame_format(&frame_format, iformat, iframe);
+    for (i = 0; i <= gadget->last_format_index && rendered; i++) {
+        candidate = &gadget->uvc_frame_format[i];
+        if (candidate->bFormatIndex != iformat || !(candidate->bmCapabilities & UVC_FRAME_CAP_STILL)) {
+            continue;
+        }
 
-    uvc_dump_frame_format(frame_format, "FRAME");
+        switch (action) {
+        case STREAM_CONTROL_MIN:
+            if (!frame_format || candidate->bFrameIndex < frame_format->bFrameIndex) {
+                frame_format = candidate;
+            }
+            break;
 
-    if (frame_format->dwDefaultFrameInterval >= 100000) {
-        frame_interval = frame_format->dwDefaultFrameInterval;
-    } else {
-        frame_interval = 400000;
+        case STREAM_CONTROL_MAX:
+            if (!frame_format || candidate->bFrameIndex > frame_format->bFrameIndex) {
+                frame_format = candidate;
+            }
+            break;
+
+        case STREAM_CONTROL_SET:
+            if (candidate->bFrameIndex == iframe) {
+                frame_format = candidate;
+            }
+            break;
+
+        default:
+            if (!frame_format ||
+                candidate->wWidth * candidate->wHeight > frame_format->wWidth * frame_format->wHeight
+            ) {
+                frame_format = candidate;
+            }
+            break;
+        }
     }
 
-    dwMaxPayloadTransferSize = streaming_maxpacket;
-    if (streaming_maxpacket > 1024 && streaming_maxpacket % 1024 != 0) {
-        dwMaxPayloadTransferSize -= (streaming_maxpacket / 1024) * 128;
+    if (!frame_format) {
+        frame_format = video;
     }
 
     memset(ctrl, 0, sizeof * ctrl);
-    ctrl->bmHint                   = 1;
     ctrl->bFormatIndex             = iformat;
-    ctrl->bFrameIndex              = iframe;
+    ctrl->bFrameIndex              = frame_format->bFrameIndex;
+    ctrl->bCompressionIndex        = 1;
     ctrl->dwMaxVideoFrameSize      = get_frame_size(frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
-    ctrl->dwMaxPayloadTransferSize = dwMaxPayloadTransferSize;
-    ctrl->dwFrameInterval          = frame_interval;
-    ctrl->bmFramingInfo            = 3;
-    ctrl->bMinVersion              = format_first;
-    ctrl->bMaxVersion              = format_last;
-    ctrl->bPreferedVersion         = format_last;
+    ctrl->dwMaxPayloadTransferSize = uvc_max_payload_transfer_size();
 
-    dump_uvc_streaming_control(ctrl);
+    printf("UVC: Still control: format: %u, frame: %u, resolution: %ux%u\n",
+        ctrl->bFormatIndex, ctrl->bFrameIndex, frame_format->wWidth, frame_format->wHeight);
 
-    if (uvc_dev.control == UVC_VS_COMMIT_CONTROL && action == STREAM_CONTROL_SET) {
-        if (settings.source_device == DEVICE_TYPE_V4L2) {
-            v4l2_apply_format(&v4l2_dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
-        }
-        v4l2_apply_format(&uvc_dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+    if (gadget->uvc_dev.control == UVC_VS_STILL_COMMIT_CONTROL && action == STREAM_CONTROL_SET) {
+        gadget->uvc_still.width  = frame_format->wWidth;
+        gadget->uvc_still.height = frame_format->wHeight;
     }
 }
 
@@ -1470,7 +6534,7 @@ static void uvc_interface_control(unsigned int interface,
     const char * interface_name = (interface == UVC_VC_INPUT_TERMINAL) ? "INPUT_TERMINAL" : "PROCESSING_UNIT";
 
     for (i = 0; i < control_mapping_size; i++) {
-        if (control_mapping[i].type == interface && control_mapping[i].uvc == cs) {
+        if (gadget->control_mapping[i].type == interface && gadget->control_mapping[i].uvc == cs) {
             found = true;
             break;
         }
@@ -1479,97 +6543,180 @@ static void uvc_interface_control(unsigned int interface,
     if (!found) {
         printf("UVC: %s - %s - %02x - UNSUPPORTED\n", interface_name, request_code_name, cs);
         resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+        gadget->uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
         return;
     }
 
-    if (!control_mapping[i].enabled) {
+    if (!gadget->control_mapping[i].enabled) {
         printf("UVC: %s - %s - %s - DISABLED\n", interface_name, request_code_name,
-            control_mapping[i].uvc_name);
+            gadget->control_mapping[i].uvc_name);
         resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+        gadget->uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
         return;
     }
 
-    printf("UVC: %s - %s - %s\n", interface_name, request_code_name, control_mapping[i].uvc_name);
+    printf("UVC: %s - %s - %s\n", interface_name, request_code_name, gadget->control_mapping[i].uvc_name);
 
     switch (req) {
     case UVC_SET_CUR:
         resp->data[0] = 0x0;
         resp->length = len;
-        uvc_dev.control_interface = interface;
-        uvc_dev.control_type = cs;
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        gadget->uvc_dev.control_interface = interface;
+        gadget->uvc_dev.control_type = cs;
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_MIN:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].minimum, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &gadget->control_mapping[i].minimum, resp->length);
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_MAX:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].maximum, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &gadget->control_mapping[i].maximum, resp->length);
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_CUR:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].value, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &gadget->control_mapping[i].value, resp->length);
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_INFO:
         resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
         resp->length = 1;
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_DEF:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].default_value, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &gadget->control_mapping[i].default_value, resp->length);
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     case UVC_GET_RES:
         resp->length = 4;
-        memcpy(&resp->data[0], &control_mapping[i].step, resp->length);
-        uvc_dev.request_error_code = REQEC_NO_ERROR;
+        memcpy(&resp->data[0], &gadget->control_mapping[i].step, resp->length);
+        gadget->uvc_dev.request_error_code = REQEC_NO_ERROR;
         break;
 
     default:
         resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
+        gadget->uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
         break;
 
     }
     return;
 }
 
+static void uvc_events_process_still(uint8_t req, uint8_t cs, struct uvc_request_data * resp)
+{
+    struct uvc_still_control * ctrl = (struct uvc_still_control *) &resp->data;
+    struct uvc_still_control * target = (cs == UVC_VS_STILL_PROBE_CONTROL) ?
+        &(gadget->uvc_still.probe) : &(gadget->uvc_still.commit);
+
+    int ctrl_length = sizeof * ctrl;
+    resp->length = ctrl_length;
+
+    switch (req) {
+    case UVC_SET_CUR:
+        gadget->uvc_dev.control = cs;
+        break;
+
+    case UVC_GET_MAX:
+        uvc_fill_still_control(ctrl, STREAM_CONTROL_MAX, 0);
+        break;
+
+    case UVC_GET_CUR:
+        memcpy(ctrl, target, ctrl_length);
+        break;
+
+    case UVC_GET_MIN:
+        uvc_fill_still_control(ctrl, STREAM_CONTROL_MIN, 0);
+        break;
+
+    case UVC_GET_DEF:
+        uvc_fill_still_control(ctrl, STREAM_CONTROL_DEF, 0);
+        break;
+
+    case UVC_GET_LEN:
+        resp->data[0] = 0x00;
+        resp->data[1] = ctrl_length;
+        resp->length = 2;
+        break;
+
+    case UVC_GET_INFO:
+        resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
+        resp->length = 1;
+        break;
+
+    default:
+        resp->length = -EL2HLT;
+        gadget->uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
+        break;
+    }
+}
+
+static void uvc_events_process_still_trigger(uint8_t req, uint8_t cs, struct uvc_request_data * resp)
+{
+    switch (req) {
+    case UVC_SET_CUR:
+        gadget->uvc_dev.control = cs;
+        resp->length = 1;
+        break;
+
+    case UVC_GET_CUR:
+        resp->data[0] = gadget->uvc_still.trigger;
+        resp->length = 1;
+        break;
+
+    case UVC_GET_INFO:
+        resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
+        resp->length = 1;
+        break;
+
+    default:
+        resp->length = -EL2HLT;
+        gadget->uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
+        break;
+    }
+}
+
 static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_request_data * resp)
 {
     printf("UVC: Streaming request CS: %s, REQ: %s\n", uvc_vs_interface_control_name(cs),
         uvc_request_code_name(req));
 
+    if (cs == UVC_VS_STILL_PROBE_CONTROL || cs == UVC_VS_STILL_COMMIT_CONTROL) {
+        uvc_events_process_still(req, cs, resp);
+        return;
+    }
+
+    if (cs == UVC_VS_STILL_IMAGE_TRIGGER_CONTROL) {
+        uvc_events_process_still_trigger(req, cs, resp);
+        return;
+    }
+
     if (cs != UVC_VS_PROBE_CONTROL && cs != UVC_VS_COMMIT_CONTROL) {
         return;
     }
 
     struct uvc_streaming_control * ctrl = (struct uvc_streaming_control *) &resp->data;
-    struct uvc_streaming_control * target = (cs == UVC_VS_PROBE_CONTROL) ? &(uvc_dev.probe) : &(uvc_dev.commit);
+    struct uvc_streaming_control * target = (cs == UVC_VS_PROBE_CONTROL) ? &(gadget->uvc_dev.probe) : &(gadget->uvc_dev.commit);
 
     int ctrl_length = sizeof * ctrl;
     resp->length = ctrl_length;
 
     switch (req) {
     case UVC_SET_CUR:
-        uvc_dev.control = cs;
+        gadget->uvc_dev.control = cs;
         resp->length = ctrl_length;
         break;
 
     case UVC_GET_MAX:
-        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MAX, 0, 0);
+        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MAX, 0, 0, 0);
         break;
 
     case UVC_GET_CUR:
@@ -1577,8 +6724,11 @@ static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_req
         break;
 
     case UVC_GET_MIN:
+        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MIN, 0, 0, 0);
+        break;
+
     case UVC_GET_DEF:
-        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MIN, 0, 0);
+        uvc_fill_streaming_control(ctrl, STREAM_CONTROL_DEF, 0, 0, 0);
         break;
 
     case UVC_GET_RES:
@@ -1614,7 +6764,7 @@ static void uvc_events_process_class(struct usb_ctrlrequest * ctrl, struct uvc_r
         switch (interface) {
             case 0:
                 if (control == UVC_VC_REQUEST_ERROR_CODE_CONTROL) {
-                    resp->data[0] = uvc_dev.request_error_code;
+                    resp->data[0] = gadget->uvc_dev.request_error_code;
                     resp->length = 1;
                 }
                 break;
@@ -1643,12 +6793,12 @@ static void uvc_events_process_class(struct usb_ctrlrequest * ctrl, struct uvc_r
 
 static void uvc_events_process_setup(struct usb_ctrlrequest * ctrl, struct uvc_request_data * resp)
 {
-    uvc_dev.control = 0;
+    gadget->uvc_dev.control = 0;
     if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
         uvc_events_process_class(ctrl, resp);
     }
 
-    if (ioctl(uvc_dev.fd, UVCIOC_SEND_RESPONSE, resp) < 0) {
+    if (ioctl(gadget->uvc_dev.fd, UVCIOC_SEND_RESPONSE, resp) < 0) {
         printf("UVCIOC_SEND_RESPONSE failed: %s (%d)\n", strerror(errno), errno);
     }
 }
@@ -1658,35 +6808,82 @@ static void uvc_events_process_data_control(struct uvc_request_data * data, stru
     struct uvc_streaming_control * ctrl = (struct uvc_streaming_control *) &data->data;
     unsigned int iformat = (unsigned int) ctrl->bFormatIndex;
     unsigned int iframe = (unsigned int) ctrl->bFrameIndex;
+    unsigned int interval = ctrl->dwFrameInterval;
+
+    uvc_fill_streaming_control(target, STREAM_CONTROL_SET, iformat, iframe, interval);
+}
+
+/* Streams that can't render a still image of their own send the next video frame */
+static void uvc_still_trigger(uint8_t trigger)
+{
+    switch (trigger) {
+    case STILL_TRIGGER_TRANSMIT:
+    case STILL_TRIGGER_TRANSMIT_BULK:
+        if (!uvc_still_rendered() || !gadget->uvc_dev.is_streaming || !gadget->uvc_still.width ||
+            gadget->uvc_still.commit.bFormatIndex != gadget->uvc_dev.commit.bFormatIndex
+        ) {
+            printf("STILL: The next video frame is the still image\n");
+            gadget->uvc_still.trigger = STILL_TRIGGER_NORMAL;
+            break;
+        }
+
+        printf("STILL: Still image %ux%u triggered\n", gadget->uvc_still.width, gadget->uvc_still.height);
+        gadget->uvc_still.trigger = STILL_TRIGGER_TRANSMIT;
+        break;
 
-    uvc_fill_streaming_control(target, STREAM_CONTROL_SET, iformat, iframe);
+    default:
+        gadget->uvc_still.trigger = STILL_TRIGGER_NORMAL;
+        break;
+    }
 }
 
 static void uvc_events_process_data(struct uvc_request_data * data)
 {
     int i;
-    printf("UVC: Control %s, length: %d\n", uvc_vs_interface_control_name(uvc_dev.control), data->length);
+    printf("UVC: Control %s, length: %d\n", uvc_vs_interface_control_name(gadget->uvc_dev.control), data->length);
 
-    switch (uvc_dev.control) {
+    switch (gadget->uvc_dev.control) {
     case UVC_VS_PROBE_CONTROL:
-        uvc_events_process_data_control(data, &(uvc_dev.probe));
+        uvc_events_process_data_control(data, &(gadget->uvc_dev.probe));
         break;
 
     case UVC_VS_COMMIT_CONTROL:
-        uvc_events_process_data_control(data, &(uvc_dev.commit));
+        uvc_events_process_data_control(data, &(gadget->uvc_dev.commit));
+        break;
+
+    case UVC_VS_STILL_PROBE_CONTROL:
+        uvc_fill_still_control(&(gadget->uvc_still.probe), STREAM_CONTROL_SET,
+            ((struct uvc_still_control *) &data->data)->bFrameIndex);
+        break;
+
+    case UVC_VS_STILL_COMMIT_CONTROL:
+        uvc_fill_still_control(&(gadget->uvc_still.commit), STREAM_CONTROL_SET,
+            ((struct uvc_still_control *) &data->data)->bFrameIndex);
+        break;
+
+    case UVC_VS_STILL_IMAGE_TRIGGER_CONTROL:
+        if (data->length > 0) {
+            uvc_still_trigger(data->data[0]);
+        }
         break;
 
     case UVC_VS_CONTROL_UNDEFINED:
         if (data->length > 0 && data->length <= 4) {
             for (i = 0; i < control_mapping_size; i++) {
-                if (control_mapping[i].type == uvc_dev.control_interface &&
-                    control_mapping[i].uvc == uvc_dev.control_type &&
-                    control_mapping[i].enabled
+                if (gadget->control_mapping[i].type == gadget->uvc_dev.control_interface &&
+                    gadget->control_mapping[i].uvc == gadget->uvc_dev.control_type &&
+                    gadget->control_mapping[i].enabled
                 ) {
-                    control_mapping[i].value = 0x00000000;
-                    control_mapping[i].length = data->length;
-                    memcpy(&control_mapping[i].value, data->data, data->length);
-                    v4l2_set_ctrl(control_mapping[i]);
+                    gadget->control_mapping[i].value = 0x00000000;
+                    gadget->control_mapping[i].length = data->length;
+                    memcpy(&gadget->control_mapping[i].value, data->data, data->length);
+                    if (gadget->tee.owner) {
+                        v4l2_tee_set_ctrl(i);
+                    } else if (!gadget->pipeline.threads[PIPELINE_CONTROL].started ||
+                        !pipeline_push(&gadget->pipeline.controls, i, gadget->control_mapping[i].value)
+                    ) {
+                        v4l2_set_ctrl(gadget->control_mapping[i]);
+                    }
                 }
             }
         }
@@ -1704,9 +6901,9 @@ static void uvc_events_process()
     struct uvc_event * uvc_event = (void *) &v4l2_event.u.data;
     struct uvc_request_data resp;
 
-    if (ioctl(uvc_dev.fd, VIDIOC_DQEVENT, &v4l2_event) < 0) {
+    if (ioctl(gadget->uvc_dev.fd, VIDIOC_DQEVENT, &v4l2_event) < 0) {
         printf("%s: VIDIOC_DQEVENT failed: %s (%d)\n",
-            uvc_dev.device_type_name, strerror(errno), errno);
+            gadget->uvc_dev.device_type_name, strerror(errno), errno);
         return;
     }
 
@@ -1715,12 +6912,12 @@ static void uvc_events_process()
 
     switch (v4l2_event.type) {
     case UVC_EVENT_CONNECT:
-        printf("%s: UVC_EVENT_CONNECT\n", uvc_dev.device_type_name);
+        printf("%s: UVC_EVENT_CONNECT\n", gadget->uvc_dev.device_type_name);
         break;
 
     case UVC_EVENT_DISCONNECT:
-        printf("%s: UVC_EVENT_DISCONNECT\n", uvc_dev.device_type_name);
-        uvc_shutdown_requested = true;
+        printf("%s: UVC_EVENT_DISCONNECT\n", gadget->uvc_dev.device_type_name);
+        gadget->uvc_shutdown_requested = true;
         break;
 
     case UVC_EVENT_SETUP:
@@ -1750,17 +6947,17 @@ static void uvc_events(int action)
     CLEAR(sub);
 
     sub.type = UVC_EVENT_CONNECT;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(gadget->uvc_dev.fd, action, &sub);
     sub.type = UVC_EVENT_DISCONNECT;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(gadget->uvc_dev.fd, action, &sub);
     sub.type = UVC_EVENT_SETUP;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(gadget->uvc_dev.fd, action, &sub);
     sub.type = UVC_EVENT_DATA;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(gadget->uvc_dev.fd, action, &sub);
     sub.type = UVC_EVENT_STREAMON;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(gadget->uvc_dev.fd, action, &sub);
     sub.type = UVC_EVENT_STREAMOFF;
-    ioctl(uvc_dev.fd, action, &sub);
+    ioctl(gadget->uvc_dev.fd, action, &sub);
 }
 
 static void uvc_events_subscribe()
@@ -1778,230 +6975,684 @@ static void uvc_events_unsubscribe()
  * main
  */
 
-static void processing_loop_v4l2_uvc()
+/* Adds fd of a gadget (or the shared signal and timer fds) to the epoll set */
+static int processing_loop_add(struct processing_loop_fds * loop, unsigned int id,
+    enum processing_loop_source source, uint32_t events)
 {
-    struct timeval tv;
-    struct timeval video_tv;
-    double last_time_blink = 0;
-    bool blink_state = false;
-    int activity;
-    fd_set fdsv, fdsu;
-    int nfds;
+    struct epoll_event event;
 
-    printf("PROCESSING LOOP: V4L2 -> UVC\n");
+    if (loop->fds[source] < 0) {
+        return 0;
+    }
 
-    while (!terminate) {
-        FD_ZERO(&fdsv);
-        FD_ZERO(&fdsu);
+    CLEAR(event);
+    event.events = events;
+    event.data.u32 = id * LOOP_SOURCES + source;
+
+    if (epoll_ctl(processing_loop.epfd, EPOLL_CTL_ADD, loop->fds[source], &event) < 0) {
+        printf("PROCESSING: epoll_ctl failed: %s (%d)\n", strerror(errno), errno);
+        return -EINVAL;
+    }
+    loop->events[source] = events;
+    return 0;
+}
+
+/*
+ * SIGINT and SIGTERM are blocked in main() before any thread starts and read
+ * from a signalfd here, the timerfd wakes the loop for frame pacing and led
+ * blinking. All gadgets share the epoll set, the epoll data of a fd encodes
+ * the gadget and the source.
+ */
+static int processing_loop_init()
+{
+    struct processing_loop_fds * shared = &processing_loop.shared;
+    struct uvc_gadget * instance;
+    sigset_t mask;
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < LOOP_SOURCES; ++i) {
+        shared->fds[i] = -1;
+        shared->events[i] = 0;
+        shared->ready[i] = 0;
+    }
+    processing_loop.deadline = 0;
 
-        /* We want both setup and data events on UVC interface.. */
-        FD_SET(uvc_dev.fd, &fdsu);
+    processing_loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (processing_loop.epfd < 0) {
+        printf("PROCESSING: epoll_create1 failed: %s (%d)\n", strerror(errno), errno);
+        return -EINVAL;
+    }
 
-        fd_set efds = fdsu;
-        fd_set dfds = fdsu;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
 
-        /* yield CPU to other processes and avoid spinlock when camera is not being used
-         * fix from - https://github.com/kinweilee/v4l2-mmal-uvc/blob/master/v4l2-mmal-uvc.c
-         * rcarmo - https://github.com/peterbay/uvc-gadget/pull/6
-         */
-        nanosleep ((const struct timespec[]) { {0, 1000000L} }, NULL);
+    shared->fds[LOOP_SIGNAL] = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    shared->fds[LOOP_TIMER] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (shared->fds[LOOP_SIGNAL] < 0 || shared->fds[LOOP_TIMER] < 0) {
+        printf("PROCESSING: Unable to create signalfd or timerfd: %s (%d)\n", strerror(errno), errno);
+        return -EINVAL;
+    }
 
-        /* Timeout. */
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+    if (processing_loop_add(shared, 0, LOOP_SIGNAL, EPOLLIN) < 0 ||
+        processing_loop_add(shared, 0, LOOP_TIMER, EPOLLIN) < 0
+    ) {
+        return -EINVAL;
+    }
 
-        /* don't block vdev device if streaming is off */
-        if (v4l2_dev.is_streaming) {
-            /* ..but only data events on V4L2 interface */
-            FD_SET(v4l2_dev.fd, &fdsv);
+    for (i = 0; i < gadgets_count; ++i) {
+        instance = &gadgets[i];
 
-            nfds = max(v4l2_dev.fd, uvc_dev.fd);
-            activity = select(nfds + 1, &fdsv, &dfds, &efds, &tv);
+        for (j = 0; j < LOOP_SOURCES; ++j) {
+            instance->loop.fds[j] = -1;
+            instance->loop.events[j] = 0;
+            instance->loop.ready[j] = 0;
+        }
 
-            if (activity == 0) {
-                printf("PROCESSING: Select timeout\n");
-                break;
+        instance->loop.fds[LOOP_UVC] = instance->uvc_dev.fd;
+        if (instance->settings.source_device == DEVICE_TYPE_V4L2 &&
+            (!instance->tee.owner || instance->tee.owner == instance)
+        ) {
+            instance->loop.fds[LOOP_V4L2] = instance->v4l2_dev.fd;
+            instance->loop.fds[LOOP_M2M] = (instance->settings.m2m_devname) ? instance->v4l2_m2m.output.fd : -1;
+        }
+
+        if (instance->settings.source_device != DEVICE_TYPE_V4L2 && instance->fb_dev.fb_vsync) {
+            instance->loop.fds[LOOP_VSYNC] = instance->fb_vsync.fd;
+        }
+
+        for (j = LOOP_UVC; j < LOOP_SOURCES; ++j) {
+            if (processing_loop_add(&instance->loop, i, j, 0) < 0) {
+                return -EINVAL;
             }
+        }
+    }
+    return 0;
+}
 
-        } else {
-            activity = select(uvc_dev.fd + 1, NULL, &dfds, &efds, NULL);
+static void processing_loop_close()
+{
+    if (processing_loop.shared.fds[LOOP_SIGNAL] >= 0) {
+        close(processing_loop.shared.fds[LOOP_SIGNAL]);
+    }
+
+    if (processing_loop.shared.fds[LOOP_TIMER] >= 0) {
+        close(processing_loop.shared.fds[LOOP_TIMER]);
+    }
+
+    if (processing_loop.epfd >= 0) {
+        close(processing_loop.epfd);
+    }
+}
+
+/*
+ * videobuf2 reports an error for a queue that is not streaming and a buffer
+ * the loop does not want yet stays ready, so the data events are only asked
+ * for while there is something to dequeue.
+ */
+static void processing_loop_watch(enum processing_loop_source source, uint32_t events)
+{
+    struct epoll_event event;
+
+    if (gadget->loop.fds[source] < 0 || gadget->loop.events[source] == events) {
+        return;
+    }
+
+    CLEAR(event);
+    event.events = events;
+    event.data.u32 = gadget->id * LOOP_SOURCES + source;
+
+    if (epoll_ctl(processing_loop.epfd, EPOLL_CTL_MOD, gadget->loop.fds[source], &event) < 0) {
+        printf("PROCESSING: epoll_ctl failed: %s (%d)\n", strerror(errno), errno);
+        return;
+    }
+    gadget->loop.events[source] = events;
+}
+
+/* Arms the timer for an absolute CLOCK_MONOTONIC time in ms, 0 disarms it */
+static void processing_loop_arm(double deadline)
+{
+    struct itimerspec timer;
+
+    if (processing_loop.deadline == deadline) {
+        return;
+    }
+
+    CLEAR(timer);
+    timer.it_value.tv_sec = deadline / 1000;
+    timer.it_value.tv_nsec = (deadline - timer.it_value.tv_sec * 1000.0) * 1e6;
+
+    timerfd_settime(processing_loop.shared.fds[LOOP_TIMER], TFD_TIMER_ABSTIME, &timer, NULL);
+    processing_loop.deadline = deadline;
+}
+
+/* Earliest of the deadlines, 0 for none */
+static double processing_loop_earliest(double a, double b)
+{
+    if (!a || !b) {
+        return (a) ? a : b;
+    }
+    return min(a, b);
+}
+
+static int processing_loop_wait()
+{
+    struct processing_loop_fds * shared = &processing_loop.shared;
+    struct epoll_event events[LOOP_SOURCES * UVC_GADGETS_MAX];
+    struct signalfd_siginfo siginfo;
+    enum processing_loop_source source;
+    uint64_t expirations;
+    unsigned int i;
+    unsigned int j;
+    int count;
 
+    count = epoll_wait(processing_loop.epfd, events, LOOP_SOURCES * UVC_GADGETS_MAX, -1);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return 0;
         }
+        printf("PROCESSING: epoll_wait error %d, %s\n", errno, strerror(errno));
+        return count;
+    }
 
-        if (activity == -1) {
-            printf("PROCESSING: Select error %d, %s\n", errno, strerror(errno));
-            if (EINTR == errno) {
-                continue;
+    for (i = 0; i < LOOP_SOURCES; ++i) {
+        shared->ready[i] = 0;
+        for (j = 0; j < gadgets_count; ++j) {
+            gadgets[j].loop.ready[i] = 0;
+        }
+    }
+
+    for (i = 0; i < (unsigned int) count; ++i) {
+        source = events[i].data.u32 % LOOP_SOURCES;
+        if (source == LOOP_SIGNAL || source == LOOP_TIMER) {
+            shared->ready[source] = events[i].events;
+        } else {
+            gadgets[events[i].data.u32 / LOOP_SOURCES].loop.ready[source] = events[i].events;
+        }
+    }
+
+    if (shared->ready[LOOP_SIGNAL] &&
+        read(shared->fds[LOOP_SIGNAL], &siginfo, sizeof siginfo) == sizeof siginfo
+    ) {
+        printf("PROCESSING: Signal %u received\n", siginfo.ssi_signo);
+        terminate = 1;
+    }
+
+    if (shared->ready[LOOP_TIMER] &&
+        read(shared->fds[LOOP_TIMER], &expirations, sizeof expirations) == sizeof expirations
+    ) {
+        processing_loop.deadline = 0;
+    }
+    return count;
+}
+
+/* The streaming status led belongs to the first gadget */
+static void processing_loop_blink(double now)
+{
+    if (gadget->settings.blink_on_startup > 0) {
+        if (now - processing_loop.last_time_blink >= 100) {
+            processing_loop.blink_state = !processing_loop.blink_state;
+            streaming_status_value(processing_loop.blink_state);
+            processing_loop.last_time_blink = now;
+            if (!processing_loop.blink_state) {
+                gadget->settings.blink_on_startup -= 1;
             }
-            break;
         }
+    }
+}
 
-        gettimeofday(&video_tv, 0);
-        double now = (video_tv.tv_sec + (video_tv.tv_usec * 1e-6)) * 1000;
+static void processing_loop_v4l2_uvc_watch()
+{
+    /* tee members follow the camera of the owner */
+    struct uvc_gadget * source = (gadget->tee.owner) ? gadget->tee.owner : gadget;
+
+    /* a sensor parked in warm standby streams without a host */
+    bool video = source->v4l2_dev.is_streaming && !source->v4l2_standby.parked;
+
+    /* UVC buffers are only dequeued while at least 2 are left at UVC domain */
+    processing_loop_watch(LOOP_UVC, EPOLLPRI |
+        ((video && gadget->uvc_dev.is_streaming && !gadget->pipeline.enabled &&
+            (gadget->uvc_shutdown_requested || gadget->uvc_dev.dqbuf_count + 1 < gadget->uvc_dev.qbuf_count)) ? EPOLLOUT : 0));
+
+    processing_loop_watch(LOOP_V4L2,
+        (video && !gadget->pipeline.enabled && gadget->v4l2_dev.dqbuf_count < gadget->v4l2_dev.qbuf_count) ? EPOLLIN : 0);
+
+    /* mem2mem device signals finished CAPTURE (read) and OUTPUT (write) buffers */
+    processing_loop_watch(LOOP_M2M,
+        (video && gadget->v4l2_m2m.capture.is_streaming) ? EPOLLIN | EPOLLOUT : 0);
+}
+
+static void processing_loop_v4l2_uvc(double now)
+{
+    struct uvc_gadget * source = (gadget->tee.owner) ? gadget->tee.owner : gadget;
+    unsigned long long process_time_ns;
+    unsigned int buffers;
 
-        if (FD_ISSET(uvc_dev.fd, &efds)) {
-            uvc_events_process();
+    if (gadget->loop.ready[LOOP_UVC] & EPOLLPRI) {
+        uvc_events_process();
+    }
+
+    if (!source->v4l2_dev.is_streaming || source->v4l2_standby.parked) {
+        return;
+    }
+
+    if (gadget->loop.ready[LOOP_UVC] & (EPOLLOUT | EPOLLERR)) {
+        uvc_v4l2_video_process();
+    }
+
+    if (gadget->loop.ready[LOOP_V4L2] & (EPOLLIN | EPOLLERR)) {
+        if (gadget->v4l2_m2m.enabled) {
+            v4l2_m2m_capture_process();
+        } else if (gadget->v4l2_convert.enabled) {
+            v4l2_convert_video_process();
+        } else {
+            v4l2_uvc_video_process();
         }
+    }
+
+    if (gadget->v4l2_m2m.enabled && gadget->loop.ready[LOOP_M2M]) {
+        v4l2_m2m_video_process();
+    }
+
+    if (gadget->settings.show_fps) {
+        if (now - gadget->uvc_dev.last_time_video_process >= 1000) {
+            buffers = __atomic_exchange_n(&gadget->uvc_dev.buffers_processed, 0, __ATOMIC_RELAXED);
+            process_time_ns = __atomic_exchange_n(&gadget->uvc_dev.process_time_ns, 0, __ATOMIC_RELAXED);
 
-        if (v4l2_dev.is_streaming) {
-            if (FD_ISSET(uvc_dev.fd, &dfds)) {
-                uvc_v4l2_video_process();
+            printf("%sFPS: %u\n", gadget->label, buffers);
+            if (gadget->v4l2_convert.enabled && buffers) {
+                printf("%sCONVERT: Frame conversion time: %.2f ms, dropped frames: %llu\n", gadget->label,
+                    process_time_ns * 1e-6 / buffers, gadget->v4l2_convert.dropped);
             }
+            if (gadget->settings.latest_frame) {
+                printf("%sV4L2: Stale frames dropped: %llu\n", gadget->label, gadget->v4l2_dev.frames_dropped);
+            }
+            if (gadget->v4l2_pacing.enabled) {
+                printf("%sPACING: Frames dropped: %llu, duplicated: %llu\n", gadget->label,
+                    gadget->v4l2_pacing.dropped, gadget->v4l2_pacing.duplicated);
+            }
+            if (gadget->v4l2_adaptive.enabled) {
+                printf("%sADAPTIVE: Buffers: %u, underruns: %llu, dequeue jitter: %.2f ms\n", gadget->label,
+                    gadget->v4l2_dev.nbufs, gadget->v4l2_adaptive.underruns, gadget->v4l2_adaptive.jitter);
+            }
+            gadget->uvc_dev.last_time_video_process = now;
+        }
+    }
+}
 
-            if (FD_ISSET(v4l2_dev.fd, &fdsv)) {
-                v4l2_uvc_video_process();
+/* Returns when the next frame of a framebuffer sourced gadget is due, 0 when none is waited for */
+static double processing_loop_fb_uvc_watch(double now)
+{
+    bool held = gadget->uvc_dev.fb_held;
+    bool vsync = gadget->fb_vsync.pending;
+
+    /*
+     * A spent buffer is only taken once the next frame is due, the timer wakes
+     * the loop then. A held buffer doesn't wait for the UVC device at all, a
+     * frame waiting for vsync only for LOOP_VSYNC.
+     */
+    processing_loop_watch(LOOP_UVC, EPOLLPRI |
+        ((gadget->uvc_dev.is_streaming && now >= gadget->next_frame_time && !held && !vsync) ? EPOLLOUT : 0));
+    processing_loop_watch(LOOP_VSYNC, (vsync) ? EPOLLIN : 0);
+
+    if (vsync) {
+        return 0;
+    }
+
+    if (gadget->uvc_dev.is_streaming && held) {
+        return max(gadget->next_frame_time, now);
+    }
+    return (gadget->uvc_dev.is_streaming && now < gadget->next_frame_time) ? gadget->next_frame_time : 0;
+}
+
+static void processing_loop_fb_uvc()
+{
+    int frame_interval = (1000 / gadget->settings.fb_framerate);
+    unsigned long long process_time_ns;
+    unsigned int buffers;
+    bool vsync = false;
+    double now;
+
+    if (gadget->loop.ready[LOOP_UVC] & EPOLLPRI) {
+        uvc_events_process();
+    }
+
+    /* a failed wait switches to the timer, the waiting frame is taken anyway */
+    if (gadget->loop.ready[LOOP_VSYNC] & (EPOLLIN | EPOLLERR)) {
+        vsync = fb_vsync_complete() != 0;
+    }
+
+    now = monotonic_ms();
+
+    if ((gadget->loop.ready[LOOP_UVC] & (EPOLLOUT | EPOLLERR)) || gadget->uvc_dev.fb_held || vsync) {
+        if (now >= gadget->next_frame_time) {
+            /* the frame is taken when the requested vsync is reported */
+            if (gadget->fb_dev.fb_vsync && !vsync && fb_vsync_request() == 0) {
+                return;
+            }
+            uvc_fb_video_process();
+
+            /*
+             * Keep an absolute schedule when aligned to vsync, the wait
+             * rounds every frame up to the next refresh.
+             */
+            if (gadget->fb_dev.fb_vsync && gadget->next_frame_time + frame_interval > now) {
+                gadget->next_frame_time += frame_interval;
+            } else {
+                gadget->next_frame_time = now + frame_interval;
             }
+        }
+    }
 
-            if (settings.show_fps) {
-                if (now - uvc_dev.last_time_video_process >= 1000) {
-                    printf("FPS: %d\n", uvc_dev.buffers_processed);
-                    uvc_dev.buffers_processed = 0;
-                    uvc_dev.last_time_video_process = now;
-                }
+    if (gadget->settings.show_fps) {
+        if (now - gadget->uvc_dev.last_time_video_process >= 1000) {
+            buffers = __atomic_exchange_n(&gadget->uvc_dev.buffers_processed, 0, __ATOMIC_RELAXED);
+            process_time_ns = __atomic_exchange_n(&gadget->uvc_dev.process_time_ns, 0, __ATOMIC_RELAXED);
+
+            printf("%sFPS: %u\n", gadget->label, buffers);
+            if (buffers) {
+                printf("%sFB: Frame conversion time: %.2f ms%s, dropped frames: %llu\n", gadget->label,
+                    process_time_ns * 1e-6 / buffers,
+                    (gadget->fb_stage.enabled) ? " (staged)" : "", gadget->uvc_dev.fb_dropped);
             }
-        }
-        
-        if (settings.blink_on_startup > 0) {
-            if (now - last_time_blink >= 100) {
-                blink_state = !(blink_state);
-                streaming_status_value(blink_state);
-                last_time_blink = now;
-                if (!blink_state) {
-                    settings.blink_on_startup -= 1;
-                }
+            if (gadget->fb_damage.enabled && gadget->fb_damage.tiles_processed) {
+                printf("%sFB: Converted tiles: %lu of %lu (%lu%%)\n", gadget->label,
+                    gadget->fb_damage.tiles_converted, gadget->fb_damage.tiles_processed,
+                    gadget->fb_damage.tiles_converted * 100 / gadget->fb_damage.tiles_processed);
+                gadget->fb_damage.tiles_converted = 0;
+                gadget->fb_damage.tiles_processed = 0;
             }
+            gadget->uvc_dev.last_time_video_process = now;
         }
     }
 }
 
-static void processing_loop_fb_uvc() 
+/* One loop serves every gadget, events of a gadget are handled with 'gadget' pointing to it */
+static void processing_loop_run()
 {
-    struct timeval video_tv;
-    int activity;
-    double next_frame_time = 0;
-    double last_time_blink = 0;
-    bool blink_state = false;
+    double deadline;
     double now;
-    fd_set fdsu;
+    unsigned int i;
 
-    int frame_interval = (1000 / settings.fb_framerate);
+    for (i = 0; i < gadgets_count; ++i) {
+        gadget = &gadgets[i];
+        printf("PROCESSING LOOP: %s%s -> UVC\n", gadget->label,
+            (gadget->settings.source_device == DEVICE_TYPE_V4L2) ? "V4L2" : "FB");
+    }
 
-    printf("PROCESSING LOOP: FB -> UVC\n");
+    if (processing_loop_init() < 0) {
+        processing_loop_close();
+        return;
+    }
 
     while (!terminate) {
-        FD_ZERO(&fdsu);
-        FD_SET(uvc_dev.fd, &fdsu);
-
-        fd_set efds = fdsu;
-        fd_set dfds = fdsu;
-
-        nanosleep ((const struct timespec[]) { {0, 1000000L} }, NULL);
+        now = monotonic_ms();
 
-        activity = select(uvc_dev.fd + 1, NULL, &dfds, &efds, NULL);
+        gadget = &gadgets[0];
+        deadline = (gadget->settings.blink_on_startup > 0) ? processing_loop.last_time_blink + 100 : 0;
 
-        if (activity == -1) {
-            printf("PROCESSING: Select error %d, %s\n", errno, strerror(errno));
-            if (EINTR == errno) {
-                continue;
+        for (i = 0; i < gadgets_count; ++i) {
+            gadget = &gadgets[i];
+            if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
+                processing_loop_v4l2_uvc_watch();
+            } else {
+                deadline = processing_loop_earliest(deadline, processing_loop_fb_uvc_watch(now));
             }
-            break;
         }
 
-        if (activity == 0) {
-            printf("PROCESSING: Select timeout\n");
-            break;
-        }
+        processing_loop_arm(deadline);
 
-        if (FD_ISSET(uvc_dev.fd, &efds)) {
-            uvc_events_process();
+        if (processing_loop_wait() < 0) {
+            break;
         }
 
-        gettimeofday(&video_tv, 0);
-        now = (video_tv.tv_sec + (video_tv.tv_usec * 1e-6)) * 1000;
-
-        if (FD_ISSET(uvc_dev.fd, &dfds)) {
-            if (now >= next_frame_time) {
-                uvc_fb_video_process();
-                next_frame_time = now + frame_interval;
-            }
-        }
+        now = monotonic_ms();
 
-        if (settings.show_fps) {
-            if (now - uvc_dev.last_time_video_process >= 1000) {
-                printf("FPS: %d\n", uvc_dev.buffers_processed);
-                uvc_dev.buffers_processed = 0;
-                uvc_dev.last_time_video_process = now;
+        for (i = 0; i < gadgets_count; ++i) {
+            gadget = &gadgets[i];
+            if (gadget->settings.source_device == DEVICE_TYPE_V4L2) {
+                processing_loop_v4l2_uvc(now);
+            } else {
+                processing_loop_fb_uvc();
             }
         }
 
-        if (settings.blink_on_startup > 0) {
-            if (now - last_time_blink >= 100) {
-                blink_state = !(blink_state);
-                streaming_status_value(blink_state);
-                last_time_blink = now;
-                if (!blink_state) {
-                    settings.blink_on_startup -= 1;
-                }
-            }
-        }
+        gadget = &gadgets[0];
+        processing_loop_blink(monotonic_ms());
     }
+
+    processing_loop_close();
 }
 
-static int init()
+/* Opens the devices of the current gadget */
+static int gadget_open()
 {
     int ret;
 
-    memset(&v4l2_dev, 0, sizeof(v4l2_dev));
-    memset(&uvc_dev, 0, sizeof(uvc_dev));
+    memset(&gadget->v4l2_dev, 0, sizeof(gadget->v4l2_dev));
+    memset(&gadget->uvc_dev, 0, sizeof(gadget->uvc_dev));
 
     streaming_status_enable();
 
     /* Open the UVC device. */
-    ret = uvc_open(settings.uvc_devname, settings.nbufs);
+    ret = uvc_open(gadget->settings.uvc_devname, gadget->settings.nbufs);
     if (ret < 0) {
-        goto err;
+        return ret;
     }
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        /* Open the Frame Buffer device. */
-        ret = fb_open(settings.fb_devname);
+    if (gadget->settings.source_device != DEVICE_TYPE_V4L2) {
+        /* Open the Frame Buffer or DRM device. */
+        if (gadget->settings.source_device == DEVICE_TYPE_DRM) {
+            ret = drm_open(gadget->settings.drm_devname);
+        } else {
+            ret = fb_open(gadget->settings.fb_devname);
+        }
         if (ret < 0) {
-            goto err;
+            return ret;
+        }
+
+        fb_vsync_init();
+
+        fb_pool_start(gadget->settings.fb_threads, gadget->settings.fb_pin_threads);
+
+        if (gadget->settings.fb_staging) {
+            fb_stage_init();
+        }
+
+        if (gadget->settings.fb_damage_tracking) {
+            fb_damage_init();
         }
 
+    } else if (gadget->tee.owner && gadget->tee.owner != gadget) {
+        /* The owner opened the shared capture device before */
+        memcpy(gadget->control_mapping, gadget->tee.owner->control_mapping, sizeof(gadget->control_mapping));
+
     } else {
         /* Open the V4L2 device. */
-        ret = v4l2_open(settings.v4l2_devname, settings.nbufs);
+        ret = v4l2_open(gadget->settings.v4l2_devname, gadget->settings.nbufs);
         if (ret < 0) {
-           goto err;
+           return ret;
         }
 
         v4l2_get_available_formats();
         v4l2_get_controls();
+
+        /* Open the optional mem2mem converter or encoder. */
+        if (gadget->settings.m2m_devname && v4l2_m2m_open(gadget->settings.m2m_devname) < 0) {
+            return -EINVAL;
+        }
+
+        /* Used by the conversion stage when capture format differs */
+        fb_pool_start(gadget->settings.fb_threads, gadget->settings.fb_pin_threads);
+
+        /* The main thread keeps rewriting control_mapping values, the control thread gets its own copy */
+        if (gadget->settings.pipeline_threads) {
+            gadget->pipeline.control_mapping = malloc(sizeof(gadget->control_mapping));
+            if (gadget->pipeline.control_mapping) {
+                memcpy(gadget->pipeline.control_mapping, gadget->control_mapping, sizeof(gadget->control_mapping));
+                pipeline_thread_start(PIPELINE_CONTROL, pipeline_control_thread, &gadget->pipeline.controls);
+            }
+        }
     }
 
     /* Init UVC events. */
-    uvc_fill_streaming_control(&(uvc_dev.probe), STREAM_CONTROL_INIT, 0, 0);
-    uvc_fill_streaming_control(&(uvc_dev.commit), STREAM_CONTROL_INIT, 0, 0);
+    uvc_fill_streaming_control(&(gadget->uvc_dev.probe), STREAM_CONTROL_INIT, 0, 0, 0);
+    uvc_fill_streaming_control(&(gadget->uvc_dev.commit), STREAM_CONTROL_INIT, 0, 0, 0);
+    uvc_fill_still_control(&(gadget->uvc_still.probe), STREAM_CONTROL_INIT, 0);
+    uvc_fill_still_control(&(gadget->uvc_still.commit), STREAM_CONTROL_INIT, 0);
 
     uvc_events_subscribe();
+    return 0;
+}
 
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        processing_loop_fb_uvc();
-    } else {
-        processing_loop_v4l2_uvc();
-    } 
- 
+/* Stops the stream of the current gadget and the threads serving it */
+static void gadget_shutdown()
+{
     uvc_events_unsubscribe();
 
-    printf("\n*** UVC GADGET SHUTDOWN ***\n");
-
     uvc_handle_streamoff_event();
+    v4l2_standby_release();
+
+    pipeline_thread_stop(PIPELINE_CONTROL);
+    free(gadget->pipeline.control_mapping);
+    gadget->pipeline.control_mapping = NULL;
+    fb_pool_stop();
+    fb_stage_uninit();
+    fb_damage_uninit();
+}
 
-err:
+static void gadget_close()
+{
     v4l2_close();
+    v4l2_m2m_close();
     fb_close();
     uvc_close();
+}
+
+static void gadget_setup(struct uvc_gadget * instance, unsigned int id)
+{
+    instance->id = id;
+    instance->settings = uvc_settings_default;
+    memcpy(instance->control_mapping, control_mapping_default, sizeof(control_mapping_default));
+
+    instance->streaming_maxburst = 0;
+    instance->streaming_maxpacket = 1023;
+    instance->streaming_interval = 1;
+
+    instance->fb_vsync.fd = -1;
+    instance->fb_vsync.request_fd = -1;
+}
+
+/*
+ * Makes a gadget a tee member when an earlier one captures from the same V4L2
+ * device. The capture buffers are passed through to every member unchanged, so
+ * the group streams without conversion, mem2mem, threads and standby.
+ */
+static void gadget_tee_join(struct uvc_gadget * instance)
+{
+    struct uvc_gadget * owner = NULL;
+    unsigned int i;
+
+    for (i = 0; i < instance->id && !owner; i++) {
+        if (gadgets[i].settings.source_device == DEVICE_TYPE_V4L2 &&
+            !strcmp(gadgets[i].settings.v4l2_devname, instance->settings.v4l2_devname)
+        ) {
+            owner = (gadgets[i].tee.owner) ? gadgets[i].tee.owner : &gadgets[i];
+        }
+    }
+
+    if (instance->settings.source_device != DEVICE_TYPE_V4L2 || !owner) {
+        return;
+    }
+
+    if (!owner->tee.owner) {
+        owner->tee.owner = owner;
+        owner->tee.members[owner->tee.nmembers++] = owner;
+    }
+    instance->tee.owner = owner;
+    owner->tee.members[owner->tee.nmembers++] = instance;
+
+    for (i = 0; i < owner->tee.nmembers; i++) {
+        owner->tee.members[i]->settings.m2m_devname      = NULL;
+        owner->tee.members[i]->settings.nbufs_adaptive   = false;
+        owner->tee.members[i]->settings.pipeline_threads = false;
+        owner->tee.members[i]->settings.standby          = STANDBY_OFF;
+        owner->tee.members[i]->settings.nbufs            = min(owner->settings.nbufs, V4L2_TEE_MAX_BUFFERS);
+    }
+}
+
+/*
+ * Adds a gadget for "uvc_device,source_device" (-i). It inherits the options
+ * of the first gadget except the streaming status indication, the source type
+ * follows the device name.
+ */
+static int gadget_add(char * spec)
+{
+    struct uvc_gadget * instance = &gadgets[gadgets_count];
+    char * source = strchr(spec, ',');
+
+    if (!source || gadgets_count >= UVC_GADGETS_MAX) {
+        return -EINVAL;
+    }
+    *source++ = '\0';
+
+    gadget_setup(instance, gadgets_count);
+    instance->settings = gadgets[0].settings;
+    instance->settings.uvc_devname = spec;
+
+    if (!strncmp(source, "/dev/fb", 7)) {
+        instance->settings.fb_devname = source;
+        instance->settings.source_device = DEVICE_TYPE_FRAMEBUFFER;
+
+    } else if (!strncmp(source, "/dev/dri/", 9)) {
+        instance->settings.drm_devname = source;
+        instance->settings.source_device = DEVICE_TYPE_DRM;
+
+    } else {
+        instance->settings.v4l2_devname = source;
+        instance->settings.source_device = DEVICE_TYPE_V4L2;
+    }
+
+    instance->settings.streaming_status_pin = NULL;
+    instance->settings.streaming_status_onboard = false;
+    instance->settings.blink_on_startup = 0;
+
+    gadgets_count++;
+    gadget_tee_join(instance);
+    return 0;
+}
+
+static int init()
+{
+    unsigned int opened;
+    unsigned int i;
+
+    /* the conversion kernels are shared by every gadget */
+    rgb2yuyv_init();
+
+    for (opened = 0; opened < gadgets_count; opened++) {
+        gadget = &gadgets[opened];
+        if (gadget_open() < 0) {
+            goto err;
+        }
+    }
+
+    processing_loop_run();
+
+    printf("\n*** UVC GADGET SHUTDOWN ***\n");
+
+    for (i = 0; i < gadgets_count; i++) {
+        gadget = &gadgets[i];
+        gadget_shutdown();
+    }
+
+err:
+    /* the gadget that failed to open is closed as well */
+    for (i = 0; i < min(opened + 1, gadgets_count); i++) {
+        gadget = &gadgets[i];
+        gadget_close();
+    }
 
     printf("*** UVC GADGET EXIT ***\n");
     return 1;
@@ -2033,15 +7684,58 @@ static int configfs_read_value(const char * path)
     return strtol(buf, NULL, 10);
 }
 
+/* Reads the newline separated dwFrameInterval list in ascending order */
+static void configfs_read_intervals(const char * path, struct uvc_frame_format * frame_format)
+{
+    char buf[UVC_FRAME_INTERVALS_MAX * 12];
+    char * line = buf;
+    char * end;
+    unsigned long value;
+    unsigned int i;
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    ret = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (ret <= 0) {
+        return;
+    }
+    buf[ret] = '\0';
+
+    frame_format->frame_intervals = 0;
+    while (frame_format->frame_intervals < UVC_FRAME_INTERVALS_MAX) {
+        value = strtoul(line, &end, 10);
+        if (end == line) {
+            break;
+        }
+        line = end;
+
+        if (!value || value > UINT_MAX) {
+            continue;
+        }
+
+        for (i = frame_format->frame_intervals; i > 0 && frame_format->dwFrameInterval[i - 1] > value; i--) {
+            frame_format->dwFrameInterval[i] = frame_format->dwFrameInterval[i - 1];
+        }
+        frame_format->dwFrameInterval[i] = value;
+        frame_format->frame_intervals++;
+    }
+}
+
 static void set_uvc_format_index(enum usb_device_speed usb_speed, int video_format,
     unsigned int bFormatIndex)
 {
     int i;
-    for (i = 0; i <= last_format_index; i++) {
-        if (uvc_frame_format[i].usb_speed == usb_speed &&
-            uvc_frame_format[i].video_format == video_format
+    for (i = 0; i <= gadget->last_format_index; i++) {
+        if (gadget->uvc_frame_format[i].usb_speed == usb_speed &&
+            gadget->uvc_frame_format[i].video_format == video_format
         ) {
-            uvc_frame_format[i].bFormatIndex = bFormatIndex;
+            gadget->uvc_frame_format[i].bFormatIndex = bFormatIndex;
         }
     }
 }
@@ -2049,28 +7743,28 @@ static void set_uvc_format_index(enum usb_device_speed usb_speed, int video_form
 static void set_uvc_format_value(const char * key_word, unsigned int index, int value)
 {
     if (!strncmp(key_word, "dwDefaultFrameInterval", 22)) {
-        uvc_frame_format[index].dwDefaultFrameInterval = value;
+        gadget->uvc_frame_format[index].dwDefaultFrameInterval = value;
 
     } else if (!strncmp(key_word, "dwMaxVideoFrameBufferSize", 25)) {
-        uvc_frame_format[index].dwMaxVideoFrameBufferSize = value;
+        gadget->uvc_frame_format[index].dwMaxVideoFrameBufferSize = value;
 
     } else if (!strncmp(key_word, "dwMaxBitRate", 12)) {
-        uvc_frame_format[index].dwMaxBitRate = value;
+        gadget->uvc_frame_format[index].dwMaxBitRate = value;
 
     } else if (!strncmp(key_word, "dwMinBitRate", 12)) {
-        uvc_frame_format[index].dwMinBitRate = value;
+        gadget->uvc_frame_format[index].dwMinBitRate = value;
 
     } else if (!strncmp(key_word, "wHeight", 7)) {
-        uvc_frame_format[index].wHeight = value;
+        gadget->uvc_frame_format[index].wHeight = value;
 
     } else if (!strncmp(key_word, "wWidth", 6)) {
-        uvc_frame_format[index].wWidth = value;
+        gadget->uvc_frame_format[index].wWidth = value;
 
     } else if (!strncmp(key_word, "bmCapabilities", 14)) {
-        uvc_frame_format[index].bmCapabilities = value;
+        gadget->uvc_frame_format[index].bmCapabilities = value;
 
     } else if (!strncmp(key_word, "bFrameIndex", 11)) {
-        uvc_frame_format[index].bFrameIndex = value;
+        gadget->uvc_frame_format[index].bFrameIndex = value;
 
     }
 }
@@ -2090,14 +7784,54 @@ static int configfs_usb_speed(const char * speed)
     return USB_SPEED_UNKNOWN;
 }
 
-static int configfs_video_format(const char * format)
+/* Maps guidFormat of a frame-based format directory, 0 for unknown formats */
+static int configfs_framebased_format(const char * format_path)
+{
+    char path[PATH_MAX + 16];
+    uint8_t guid[16];
+    unsigned int i;
+    int fd;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/guidFormat", format_path);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    ret = read(fd, guid, sizeof(guid));
+    close(fd);
+
+    if (ret != sizeof(guid)) {
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(uvc_framebased_formats); i++) {
+        if (!memcmp(guid, uvc_framebased_formats[i].guid, sizeof(guid))) {
+            return uvc_framebased_formats[i].pixelformat;
+        }
+    }
+    return 0;
+}
+
+/* Frame-based formats are told by their guidFormat, the others by the name of the linked directory */
+static int configfs_video_format(const char * format_path, const char * format)
 {
+    char real_path[PATH_MAX];
+
+    if (realpath(format_path, real_path) && strstr(real_path, "/streaming/framebased/")) {
+        return configfs_framebased_format(real_path);
+    }
+
     if (!strncmp(format, "m", 1)) {
         return V4L2_PIX_FMT_MJPEG;
 
     } else if (!strncmp(format, "u", 1)) {
         return V4L2_PIX_FMT_YUYV;
 
+    } else if (!strncmp(format, "n", 1)) {
+        return V4L2_PIX_FMT_NV12;
+
     }
     return 0;
 }
@@ -2109,6 +7843,8 @@ static void configfs_fill_formats(const char * path, const char * part)
     enum usb_device_speed usb_speed;
     int video_format;
     const char * format_name;
+    char * format_path = NULL;
+    bool interval_list;
     char * copy = strdup(part);
     char * token = strtok(copy, "/");
     char * array[10];
@@ -2128,15 +7864,25 @@ static void configfs_fill_formats(const char * path, const char * part)
             goto free;
         }
 
-        video_format = configfs_video_format(array[2]);
+        /* the format directory as linked in the class header */
+        format_path = strndup(path, (part - path) + (array[2] - copy) + strlen(array[2]));
+        if (!format_path) {
+            goto free;
+        }
+
+        video_format = configfs_video_format(format_path, array[2]);
         if (video_format == 0) {
             printf("CONFIGFS: Unsupported format: (%s) %s\n", array[2], path);
             goto free;
         }
 
-        value = configfs_read_value(path);
-        if (value < 0) {
-            goto free;
+        /* a list of values, read once the frame is known */
+        interval_list = !strncmp(array[index - 1], "dwFrameInterval", 15);
+        if (!interval_list) {
+            value = configfs_read_value(path);
+            if (value < 0) {
+                goto free;
+            }
         }
 
         if (!strncmp(array[index - 1], "bFormatIndex", 12)) {
@@ -2149,29 +7895,34 @@ static void configfs_fill_formats(const char * path, const char * part)
         }
 
         if (
-            uvc_frame_format[last_format_index].usb_speed != usb_speed ||
-            uvc_frame_format[last_format_index].video_format != video_format ||
-            strncmp(uvc_frame_format[last_format_index].format_name, format_name, strlen(format_name))
+            gadget->uvc_frame_format[gadget->last_format_index].usb_speed != usb_speed ||
+            gadget->uvc_frame_format[gadget->last_format_index].video_format != video_format ||
+            strncmp(gadget->uvc_frame_format[gadget->last_format_index].format_name, format_name, strlen(format_name))
         ) {
-            if (uvc_frame_format[last_format_index].defined) {
-                last_format_index++;
+            if (gadget->uvc_frame_format[gadget->last_format_index].defined) {
+                gadget->last_format_index++;
                 
                 /* too much defined formats */
-                if (last_format_index > 29) {
+                if (gadget->last_format_index > 29) {
                     goto free;
                 }
             }
 
-            uvc_frame_format[last_format_index].usb_speed = usb_speed;
-            uvc_frame_format[last_format_index].video_format = video_format;
-            uvc_frame_format[last_format_index].format_name = strdup(format_name);
-            uvc_frame_format[last_format_index].defined = true;
+            gadget->uvc_frame_format[gadget->last_format_index].usb_speed = usb_speed;
+            gadget->uvc_frame_format[gadget->last_format_index].video_format = video_format;
+            gadget->uvc_frame_format[gadget->last_format_index].format_name = strdup(format_name);
+            gadget->uvc_frame_format[gadget->last_format_index].defined = true;
         }
 
-        set_uvc_format_value(array[index - 1], last_format_index, value);
+        if (interval_list) {
+            configfs_read_intervals(path, &gadget->uvc_frame_format[gadget->last_format_index]);
+        } else {
+            set_uvc_format_value(array[index - 1], gadget->last_format_index, value);
+        }
     }
 
 free:
+    free(format_path);
     free(copy);
 }
 
@@ -2186,13 +7937,13 @@ static void configfs_fill_streaming_params(const char* path, const char * part)
      */
 
     if (!strncmp(part, "maxburst", 8)) {
-        streaming_maxburst = clamp(value, 0, 15);
+        gadget->streaming_maxburst = clamp(value, 0, 15);
 
     } else if (!strncmp(part, "maxpacket", 9)) {
-        streaming_maxpacket = clamp(value, 1, 3072);
+        gadget->streaming_maxpacket = clamp(value, 1, 3072);
 
     } else if (!strncmp(part, "interval", 8)) {
-        streaming_interval = clamp(value, 1, 16);
+        gadget->streaming_interval = clamp(value, 1, 16);
 
     }
 }
@@ -2202,8 +7953,17 @@ static int configfs_path_check(const char* fpath, const struct stat * sb, int tf
     int uvc = find_text_pos(fpath, "/uvc");
     int streaming = find_text_pos(fpath, "streaming/class/");
     int streaming_params = find_text_pos(fpath, "/streaming_");
+    char function[80];
     (void)(tflag); /* avoid warning: unused parameter 'tflag' */
 
+    /* the function is reached through functions/ or the link in its config */
+    if (gadget->function_name) {
+        snprintf(function, sizeof(function), "/%s/", gadget->function_name);
+        if (!strstr(fpath, function)) {
+            return 0;
+        }
+    }
+
     if (!S_ISDIR(sb->st_mode)) {
         if (streaming && uvc) {
             configfs_fill_formats(fpath, fpath + streaming + 16);
@@ -2216,6 +7976,36 @@ static int configfs_path_check(const char* fpath, const struct stat * sb, int tf
     return 0;
 }
 
+/* Name of the configfs function behind a UVC device (uvc.usb0), NULL when unknown */
+static char * configfs_function_name(const char * devname)
+{
+    char path[64];
+    char name[64];
+    struct stat st;
+    int fd;
+    int ret;
+
+    if (stat(devname, &st) < 0 || !S_ISCHR(st.st_mode)) {
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/function_name", major(st.st_rdev), minor(st.st_rdev));
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    ret = read(fd, name, sizeof(name) - 1);
+    close(fd);
+
+    if (ret <= 0) {
+        return NULL;
+    }
+    name[ret] = '\0';
+    name[strcspn(name, "\n")] = '\0';
+    return strdup(name);
+}
+
 static int configfs_get_uvc_settings()
 {
     int i;
@@ -2223,21 +8013,29 @@ static int configfs_get_uvc_settings()
 
     printf("CONFIGFS: Initial path: %s\n", configfs_path);
 
+    gadget->function_name = configfs_function_name(gadget->settings.uvc_devname);
+    if (gadget->function_name) {
+        printf("CONFIGFS: Function of %s: %s\n", gadget->settings.uvc_devname, gadget->function_name);
+    } else if (gadgets_count > 1) {
+        printf("CONFIGFS: Function of %s unknown, formats of all UVC functions are used\n",
+            gadget->settings.uvc_devname);
+    }
+
     if(ftw(configfs_path, configfs_path_check, 20) == -1) {
         return -1;
     }
 
-    if (!uvc_frame_format[0].defined) {
+    if (!gadget->uvc_frame_format[0].defined) {
         return -1;
     }
 
-    for (i = 0; i <= last_format_index; i++) {
-        uvc_dump_frame_format(&uvc_frame_format[i], "CONFIGFS: UVC");
+    for (i = 0; i <= gadget->last_format_index; i++) {
+        uvc_dump_frame_format(&gadget->uvc_frame_format[i], "CONFIGFS: UVC");
     }
 
-    printf("CONFIGFS: STREAMING maxburst:  %d\n", streaming_maxburst);
-    printf("CONFIGFS: STREAMING maxpacket: %d\n", streaming_maxpacket);
-    printf("CONFIGFS: STREAMING interval:  %d\n", streaming_interval);
+    printf("CONFIGFS: STREAMING maxburst:  %d\n", gadget->streaming_maxburst);
+    printf("CONFIGFS: STREAMING maxpacket: %d\n", gadget->streaming_maxpacket);
+    printf("CONFIGFS: STREAMING interval:  %d\n", gadget->streaming_interval);
 
     return 0;
 }
@@ -2246,92 +8044,216 @@ static void usage(const char * argv0)
 {
     fprintf(stderr, "Usage: %s [options]\n", argv0);
     fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -a          Pin conversion threads to CPUs\n");
     fprintf(stderr, " -b value    Blink X times on startup (b/w 1 and 20 with led0 or GPIO pin if defined)\n");
+    fprintf(stderr, " -c          Copy framebuffer to cached memory before conversion\n");
+    fprintf(stderr, " -d          Convert only changed framebuffer tiles (damage tracking)\n");
+    fprintf(stderr, " -e device   V4L2 mem2mem converter or encoder device\n");
     fprintf(stderr, " -f device   Framebuffer device\n");
+    fprintf(stderr, " -g          Forward only the newest captured frame (low latency)\n");
     fprintf(stderr, " -h          Print this help screen and exit\n");
+    fprintf(stderr, " -i devices  Additional UVC function and its source, uvc_device,source_device (up to %d)\n",
+        UVC_GADGETS_MAX - 1);
+    fprintf(stderr, " -j value    Number of conversion threads (b/w 1 and %d)\n", FB_MAX_THREADS);
+    fprintf(stderr, " -k device   DRM device for KMS screen capture\n");
     fprintf(stderr, " -l          Use onboard led0 for streaming status indication\n");
-    fprintf(stderr, " -n value    Number of Video buffers (b/w 2 and 32)\n");
+    fprintf(stderr, " -n value    Number of Video buffers (b/w 2 and 32, or auto)\n");
     fprintf(stderr, " -p value    GPIO pin number for streaming status indication\n");
+    fprintf(stderr, " -q value    MJPEG quality for software encoding (b/w 1 and 100)\n");
     fprintf(stderr, " -r value    Framerate for framebuffer (b/w 1 and 30)\n");
+    fprintf(stderr, " -s mode     Warm standby between streams (buffers or streaming)\n");
+    fprintf(stderr, " -t value    Threaded pipeline, priority[,capture_cpu,transmit_cpu,control_cpu]\n");
     fprintf(stderr, " -u device   UVC Video Output device\n");
     fprintf(stderr, " -v device   V4L2 Video Capture device\n");
+    fprintf(stderr, " -w          Capture framebuffer on vsync\n");
     fprintf(stderr, " -x          show fps information\n");
+    fprintf(stderr, " -z filter   Framebuffer scaling filter (box or bilinear)\n");
 }
 
 static void show_settings()
 {
-    printf("SETTINGS: Number of buffers requested: %d\n", settings.nbufs);
-    printf("SETTINGS: Show FPS: %s\n", (settings.show_fps) ? "ENABLED" : "DISABLED");
-    if (settings.streaming_status_pin) {
-        printf("SETTINGS: GPIO pin for streaming status: %s\n", settings.streaming_status_pin);
+    unsigned int i;
+
+    if (gadget->settings.nbufs_adaptive) {
+        printf("SETTINGS: Number of buffers requested: auto, from %d\n", gadget->settings.nbufs);
+    } else {
+        printf("SETTINGS: Number of buffers requested: %d\n", gadget->settings.nbufs);
+    }
+    printf("SETTINGS: Show FPS: %s\n", (gadget->settings.show_fps) ? "ENABLED" : "DISABLED");
+    printf("SETTINGS: Latest frame mode: %s\n", (gadget->settings.latest_frame) ? "ENABLED" : "DISABLED");
+    if (gadget->settings.streaming_status_pin) {
+        printf("SETTINGS: GPIO pin for streaming status: %s\n", gadget->settings.streaming_status_pin);
     } else {
         printf("SETTINGS: GPIO pin for streaming status: not set\n");
     }
     printf("SETTINGS: Onboard led0 used for streaming status: %s\n",
-        (settings.streaming_status_onboard_enabled) ? "ENABLED" : "DISABLED"
+        (gadget->settings.streaming_status_onboard_enabled) ? "ENABLED" : "DISABLED"
     );
-    printf("SETTINGS: Blink on startup: %d times\n", settings.blink_on_startup);
+    printf("SETTINGS: Blink on startup: %d times\n", gadget->settings.blink_on_startup);
 
-    printf("SETTINGS: UVC device name: %s\n", settings.uvc_devname);
-    if (settings.source_device == DEVICE_TYPE_FRAMEBUFFER) {
-        printf("SETTINGS: FB device name: %s\n", settings.fb_devname);
-        printf("SETTINGS: Framerate for frame buffer: %d\n", settings.fb_framerate);
+    printf("SETTINGS: UVC device name: %s\n", gadget->settings.uvc_devname);
+    if (gadget->settings.source_device != DEVICE_TYPE_V4L2) {
+        if (gadget->settings.source_device == DEVICE_TYPE_DRM) {
+            printf("SETTINGS: DRM device name: %s\n", gadget->settings.drm_devname);
+        } else {
+            printf("SETTINGS: FB device name: %s\n", gadget->settings.fb_devname);
+        }
+        printf("SETTINGS: Framerate for frame buffer: %d\n", gadget->settings.fb_framerate);
+        printf("SETTINGS: Conversion threads for frame buffer: %d\n", gadget->settings.fb_threads);
+        printf("SETTINGS: Pin conversion threads to CPUs: %s\n",
+            (gadget->settings.fb_pin_threads) ? "ENABLED" : "DISABLED"
+        );
+        printf("SETTINGS: Staging copy for frame buffer: %s\n",
+            (gadget->settings.fb_staging) ? "ENABLED" : "DISABLED"
+        );
+        printf("SETTINGS: Damage tracking for frame buffer: %s\n",
+            (gadget->settings.fb_damage_tracking) ? "ENABLED" : "DISABLED"
+        );
+        printf("SETTINGS: MJPEG quality for frame buffer: %d\n", gadget->settings.jpeg_quality);
+        printf("SETTINGS: Vsync aligned capture for frame buffer: %s\n",
+            (gadget->settings.fb_vsync) ? "ENABLED" : "DISABLED"
+        );
+        printf("SETTINGS: Scaling filter for frame buffer: %s\n",
+            fb_scale_filter_name(gadget->settings.fb_scale_filter)
+        );
 
     } else {
-        printf("SETTINGS: V4L2 device name: %s\n", settings.v4l2_devname);
+        printf("SETTINGS: V4L2 device name: %s\n", gadget->settings.v4l2_devname);
+        if (gadget->settings.m2m_devname) {
+            printf("SETTINGS: M2M device name: %s\n", gadget->settings.m2m_devname);
+        }
+        printf("SETTINGS: Conversion threads for V4L2 device: %d\n", gadget->settings.fb_threads);
+        printf("SETTINGS: MJPEG quality for V4L2 device: %d\n", gadget->settings.jpeg_quality);
+        printf("SETTINGS: Warm standby: %s\n",
+            (gadget->settings.standby == STANDBY_STREAMING) ? "BUFFERS AND SENSOR" :
+            (gadget->settings.standby == STANDBY_BUFFERS) ? "BUFFERS" : "DISABLED"
+        );
+        if (gadget->settings.pipeline_threads) {
+            printf("SETTINGS: Threaded pipeline: priority %d, CPUs capture %d, transmit %d, control %d\n",
+                gadget->settings.pipeline_priority,
+                gadget->settings.pipeline_cpus[PIPELINE_CAPTURE],
+                gadget->settings.pipeline_cpus[PIPELINE_TRANSMIT],
+                gadget->settings.pipeline_cpus[PIPELINE_CONTROL]);
+        } else {
+            printf("SETTINGS: Threaded pipeline: DISABLED\n");
+        }
+    }
+
+    for (i = 1; i < gadgets_count; i++) {
+        printf("SETTINGS: Additional gadget %u: UVC device name: %s, source: %s%s\n", i,
+            gadgets[i].settings.uvc_devname,
+            (gadgets[i].settings.source_device == DEVICE_TYPE_V4L2) ? gadgets[i].settings.v4l2_devname :
+            (gadgets[i].settings.source_device == DEVICE_TYPE_DRM) ? gadgets[i].settings.drm_devname :
+            gadgets[i].settings.fb_devname,
+            (gadgets[i].tee.owner) ? " (shared capture, passthrough only)" : "");
     }
 }
 
 int main(int argc, char * argv[])
 {
+    char * specs[UVC_GADGETS_MAX - 1];
+    unsigned int nspecs = 0;
+    unsigned int i;
     int ret;
     int opt;
 
-    struct sigaction action;
-    CLEAR(action);
-    action.sa_handler = term;
-    sigaction(SIGTERM, &action, NULL);
-    sigaction(SIGINT, &action, NULL);
+    /* read from a signalfd by the processing loop, worker threads inherit the mask */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
 
-    ret = configfs_get_uvc_settings();
-    if (ret < 0) {
-        printf("ERROR: configfs settings for uvc gadget not found!\n");
-        return 1;
-    }
+    gadget_setup(&gadgets[0], 0);
 
-    while ((opt = getopt(argc, argv, "hlb:f:n:p:r:u:v:x")) != -1) {
+    while ((opt = getopt(argc, argv, "acdghlb:e:f:i:j:k:n:p:q:r:s:t:u:v:wxz:")) != -1) {
         switch (opt) {
+        case 'a':
+            gadget->settings.fb_pin_threads = true;
+            break;
+
         case 'b':
             if (atoi(optarg) < 1 || atoi(optarg) > 20) {
                 fprintf(stderr, "ERROR: Blink x times on startup\n");
                 goto err;
             }
-            settings.blink_on_startup = atoi(optarg);
+            gadget->settings.blink_on_startup = atoi(optarg);
+            break;
+
+        case 'c':
+            gadget->settings.fb_staging = true;
+            break;
+
+        case 'd':
+            gadget->settings.fb_damage_tracking = true;
+            break;
+
+        case 'e':
+            gadget->settings.m2m_devname = optarg;
             break;
 
         case 'f':
-            settings.fb_devname = optarg;
-            settings.source_device = DEVICE_TYPE_FRAMEBUFFER;
+            gadget->settings.fb_devname = optarg;
+            gadget->settings.source_device = DEVICE_TYPE_FRAMEBUFFER;
+            break;
+
+        case 'g':
+            gadget->settings.latest_frame = true;
             break;
 
         case 'h':
             usage(argv[0]);
             return 1;
 
+        case 'i':
+            if (nspecs >= UVC_GADGETS_MAX - 1 || !strchr(optarg, ',')) {
+                fprintf(stderr, "ERROR: Additional gadget must be uvc_device,source_device, at most %d gadgets\n",
+                    UVC_GADGETS_MAX);
+                goto err;
+            }
+            specs[nspecs++] = optarg;
+            break;
+
+        case 'j':
+            if (atoi(optarg) < 1 || atoi(optarg) > FB_MAX_THREADS) {
+                fprintf(stderr, "ERROR: Number of conversion threads value out of range\n");
+                goto err;
+            }
+            gadget->settings.fb_threads = atoi(optarg);
+            break;
+
+        case 'k':
+            gadget->settings.drm_devname = optarg;
+            gadget->settings.source_device = DEVICE_TYPE_DRM;
+            break;
+
         case 'l':
-            settings.streaming_status_onboard = true;
+            gadget->settings.streaming_status_onboard = true;
             break;
 
         case 'n':
+            if (!strcmp(optarg, "auto")) {
+                gadget->settings.nbufs_adaptive = true;
+                break;
+            }
+
             if (atoi(optarg) < 2 || atoi(optarg) > 32) {
                 fprintf(stderr, "ERROR: Number of Video buffers value out of range\n");
                 goto err;
             }
-            settings.nbufs = atoi(optarg);
+            gadget->settings.nbufs = atoi(optarg);
             break;
 
         case 'p':
-            settings.streaming_status_pin = optarg;
+            gadget->settings.streaming_status_pin = optarg;
+            break;
+
+        case 'q':
+            if (atoi(optarg) < 1 || atoi(optarg) > 100) {
+                fprintf(stderr, "ERROR: MJPEG quality value out of range\n");
+                goto err;
+            }
+            gadget->settings.jpeg_quality = atoi(optarg);
             break;
 
         case 'r':
@@ -2339,19 +8261,58 @@ int main(int argc, char * argv[])
                 fprintf(stderr, "ERROR: Framerate value out of range\n");
                 goto err;
             }
-            settings.fb_framerate = atoi(optarg);
+            gadget->settings.fb_framerate = atoi(optarg);
+            break;
+
+        case 's':
+            if (!strcmp(optarg, "buffers")) {
+                gadget->settings.standby = STANDBY_BUFFERS;
+            } else if (!strcmp(optarg, "streaming")) {
+                gadget->settings.standby = STANDBY_STREAMING;
+            } else {
+                fprintf(stderr, "ERROR: Warm standby mode must be buffers or streaming\n");
+                goto err;
+            }
+            break;
+
+        case 't':
+            gadget->settings.pipeline_threads = true;
+            if (sscanf(optarg, "%d,%d,%d,%d", &gadget->settings.pipeline_priority,
+                    &gadget->settings.pipeline_cpus[PIPELINE_CAPTURE],
+                    &gadget->settings.pipeline_cpus[PIPELINE_TRANSMIT],
+                    &gadget->settings.pipeline_cpus[PIPELINE_CONTROL]) < 1 ||
+                gadget->settings.pipeline_priority < 0 || gadget->settings.pipeline_priority > 99
+            ) {
+                fprintf(stderr, "ERROR: Threaded pipeline priority value out of range\n");
+                goto err;
+            }
             break;
 
         case 'u':
-            settings.uvc_devname = optarg;
+            gadget->settings.uvc_devname = optarg;
             break;
 
         case 'v':
-            settings.v4l2_devname = optarg;
+            gadget->settings.v4l2_devname = optarg;
+            break;
+
+        case 'w':
+            gadget->settings.fb_vsync = true;
             break;
 
         case 'x':
-            settings.show_fps = true;
+            gadget->settings.show_fps = true;
+            break;
+
+        case 'z':
+            if (!strcmp(optarg, "box")) {
+                gadget->settings.fb_scale_filter = FB_SCALE_BOX;
+            } else if (!strcmp(optarg, "bilinear")) {
+                gadget->settings.fb_scale_filter = FB_SCALE_BILINEAR;
+            } else {
+                fprintf(stderr, "ERROR: Unknown scaling filter '%s'\n", optarg);
+                goto err;
+            }
             break;
 
         default:
@@ -2360,6 +8321,30 @@ int main(int argc, char * argv[])
         }
     }
 
+    /* options apply to every gadget wherever they are given */
+    for (i = 0; i < nspecs; i++) {
+        if (gadget_add(specs[i]) < 0) {
+            fprintf(stderr, "ERROR: Can't add gadget %s\n", specs[i]);
+            goto err;
+        }
+    }
+
+    for (i = 0; i < gadgets_count; i++) {
+        gadget = &gadgets[i];
+
+        ret = configfs_get_uvc_settings();
+        if (ret < 0) {
+            printf("ERROR: configfs settings for uvc gadget %s not found!\n", gadget->settings.uvc_devname);
+            return 1;
+        }
+
+        if (gadgets_count > 1) {
+            snprintf(gadget->label, sizeof(gadget->label), "%s: ",
+                (gadget->function_name) ? gadget->function_name : gadget->settings.uvc_devname);
+        }
+    }
+
+    gadget = &gadgets[0];
     show_settings();
     return init();
 
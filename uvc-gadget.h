@@ -16,6 +16,8 @@
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define abs_diff(a, b) (((a) > (b)) ? (a) - (b) : (b) - (a))
 
 #define clamp(val, min, max)                        \
     ({                                              \
@@ -103,6 +105,7 @@ enum stream_control_action {
     STREAM_CONTROL_INIT,
     STREAM_CONTROL_MIN,
     STREAM_CONTROL_MAX,
+    STREAM_CONTROL_DEF,
     STREAM_CONTROL_SET,
 };
 
@@ -111,12 +114,16 @@ struct buffer {
     struct v4l2_buffer buf;
     void * start;
     size_t length;
+    int dmabuf_fd;
 };
 
 /* ---------------------------------------------------------------------------
  * UVC specific stuff
  */
 
+/* dwFrameInterval lists up to this many intervals per frame */
+#define UVC_FRAME_INTERVALS_MAX 32
+
 struct uvc_frame_format {
     bool defined;
 
@@ -134,13 +141,21 @@ struct uvc_frame_format {
     unsigned int wHeight;
     unsigned int wWidth;
     unsigned int bmCapabilities;
-    
-    unsigned int dwFrameInterval;
+
+    /* ascending, in 100 ns units */
+    unsigned int dwFrameInterval[UVC_FRAME_INTERVALS_MAX];
+    unsigned int frame_intervals;
 };
 
-int last_format_index = 0;
+/* guidFormat of the frame-based formats passed through from the capture device */
+struct uvc_guid_format {
+    uint8_t guid[16];
+    unsigned int pixelformat;
+};
 
-struct uvc_frame_format uvc_frame_format[30];
+static const struct uvc_guid_format uvc_framebased_formats[] = {
+    { { 'H', '2', '6', '4', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 }, V4L2_PIX_FMT_H264 },
+};
 
 enum uvc_frame_format_getter {
     FORMAT_INDEX_MIN,
@@ -149,21 +164,17 @@ enum uvc_frame_format_getter {
     FRAME_INDEX_MAX,
 };
 
-unsigned int streaming_maxburst = 0;
-unsigned int streaming_maxpacket = 1023;
-unsigned int streaming_interval = 1;
-
 /* ---------------------------------------------------------------------------
  * V4L2 and UVC device instances
  */
 
-bool uvc_shutdown_requested = false;
-
 /* device type */
 enum device_type {
     DEVICE_TYPE_UVC,
     DEVICE_TYPE_V4L2,
     DEVICE_TYPE_FRAMEBUFFER,
+    DEVICE_TYPE_DRM,
+    DEVICE_TYPE_M2M,
 };
 
 /* Represents a V4L2 based video capture device */
@@ -180,6 +191,30 @@ struct v4l2_device {
     unsigned int nbufs;
     unsigned int buffer_type;
     unsigned int memory_type;
+    bool dmabuf_exported;
+
+    /* v4l2 format applied by v4l2_apply_format */
+    unsigned int pixelformat;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bytesperline;
+
+    /* lower bound of the requested sizeimage, sizes compressed buffers for still images */
+    unsigned int min_sizeimage;
+
+    /* last request of v4l2_apply_format, repeating it skips S_FMT */
+    bool format_cached;
+    unsigned int requested_pixelformat;
+    unsigned int requested_width;
+    unsigned int requested_height;
+    unsigned int requested_sizeimage;
+    unsigned int format_applied;
+    unsigned int format_skipped;
+
+    /* last request of v4l2_set_frame_interval and the interval in effect */
+    bool interval_cached;
+    unsigned int requested_interval;
+    unsigned int frame_interval;
 
     /* v4l2 buffer queue and dequeue counters */
     unsigned long long int qbuf_count;
@@ -206,25 +241,317 @@ struct v4l2_device {
     unsigned int fb_height;
     unsigned int fb_bpp;
     unsigned int fb_line_length;
+    unsigned int fb_yres_virtual;
+    bool fb_bgr;
+    bool fb_vsync;
     void * fb_memory;
 
+    /* UVC buffer of a dropped frame, filled again instead of dequeuing one */
+    bool fb_held;
+    struct v4l2_buffer fb_held_buf;
+    unsigned long long fb_dropped;
+
     double last_time_video_process;
-    int buffers_processed;
+    /* -x statistics, updated by the pipeline threads, read and reset by the main thread */
+    unsigned int buffers_processed;
+    unsigned long long process_time_ns;
+    unsigned long long frames_dropped;
+};
+
+/*
+ * V4L2 mem2mem converter or encoder between the capture device and the UVC
+ * device. Its OUTPUT and CAPTURE queues share one file descriptor.
+ */
+struct v4l2_m2m {
+    bool enabled;
+    struct v4l2_device output;
+    struct v4l2_device capture;
+};
+
+/*
+ * Adaptive buffer count (-n auto) for V4L2 passthrough. Capture buffers are
+ * added while streaming when frames are lost for lack of a queued buffer, the
+ * count used at the next stream on shrinks again after a stable stream.
+ */
+#define V4L2_ADAPTIVE_MAX_BUFFERS 32
+#define V4L2_ADAPTIVE_GROW_INTERVAL 1000
+#define V4L2_ADAPTIVE_STABLE_TIME 10000
+
+struct v4l2_adaptive {
+    bool enabled;
+    unsigned int count;
+    unsigned int last_sequence;
+    bool have_sequence;
+    unsigned long long underruns;
+    unsigned int grown;
+    double last_grow;
+    double last_underrun;
+    double started;
+    double last_dequeue;
+    double interval;
+    double jitter;
+};
+
+/*
+ * Warm standby (-s). Capture buffers stay allocated and mapped across UVC
+ * STREAMOFF/STREAMON, with STANDBY_STREAMING the sensor keeps running too.
+ * A commit of another format releases them.
+ */
+enum v4l2_standby_mode {
+    STANDBY_OFF,
+    STANDBY_BUFFERS,
+    STANDBY_STREAMING,
 };
 
-static struct v4l2_device v4l2_dev;
-static struct v4l2_device uvc_dev;
-static struct v4l2_device fb_dev;
+struct v4l2_standby {
+    bool warm;
+    bool parked;
+    double streamon_time;
+    bool warm_start;
+};
+
+/*
+ * Format committed by the host. Probe/commit rounds only record it, devices
+ * are configured at STREAMON and the capture side is negotiated again only
+ * when the format differs from the last negotiation.
+ */
+struct format_state {
+    bool committed;
+    unsigned int pixelformat;
+    unsigned int width;
+    unsigned int height;
+    unsigned int interval;
+    unsigned int commits;
+
+    bool negotiated;
+    unsigned int negotiated_pixelformat;
+    unsigned int negotiated_width;
+    unsigned int negotiated_height;
+    unsigned int negotiations;
+    unsigned int negotiations_skipped;
+};
+
+/*
+ * Frame pacing
+ *
+ * Used when the capture device can't run at the committed frame interval.
+ * Every captured frame adds its interval to the phase and is sent once for
+ * each output interval that fits in, so surplus frames are dropped and missing
+ * ones duplicated evenly.
+ */
+#define V4L2_PACING_MAX_COPIES 4
+
+struct v4l2_pacing {
+    bool enabled;
+    unsigned int input;
+    unsigned int output;
+    unsigned long long phase;
+    unsigned long long dropped;
+    unsigned long long duplicated;
+};
+
+/*
+ * Threaded pipeline (-t). The capture and transmit threads move buffer indices
+ * through single-producer/single-consumer rings, the main thread answers
+ * control requests and passes V4L2 control writes to the control thread.
+ */
+#define PIPELINE_RING_SIZE 64
+
+struct pipeline_item {
+    unsigned int index;
+    unsigned int value;
+};
+
+struct pipeline_ring {
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+    struct pipeline_item items[PIPELINE_RING_SIZE];
+    int wakefd;
+};
+
+enum pipeline_thread_type {
+    PIPELINE_CAPTURE,
+    PIPELINE_TRANSMIT,
+    PIPELINE_CONTROL,
+    PIPELINE_THREADS
+};
+
+struct pipeline_thread {
+    pthread_t thread;
+    int wakefd;
+    bool started;
+    bool stop;
+};
+
+struct pipeline {
+    bool enabled;
+    /* filled buffers, capture -> transmit */
+    struct pipeline_ring ready;
+    /* buffers the host is done with, transmit -> capture */
+    struct pipeline_ring spent;
+    /* mapping index and value of V4L2 control writes, main -> control */
+    struct pipeline_ring controls;
+    /* copy of control_mapping taken before the control thread starts, only read by it */
+    struct control_mapping_pair * control_mapping;
+    struct pipeline_thread threads[PIPELINE_THREADS];
+};
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer conversion worker pool
+ */
+
+#define FB_MAX_THREADS 16
+
+/* Converts lines [first_line, last_line) of the current frame */
+typedef void (* fb_stripe_fn)(void * data, unsigned int first_line, unsigned int last_line);
+
+struct fb_worker {
+    pthread_t thread;
+    /* instance the worker converts for */
+    struct uvc_gadget * gadget;
+    unsigned int index;
+    unsigned int first_line;
+    unsigned int last_line;
+};
+
+struct fb_worker_pool {
+    struct fb_worker workers[FB_MAX_THREADS];
+    unsigned int nworkers;
+    unsigned int line_align;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;
+    unsigned int pending;
+    bool shutdown;
+
+    fb_stripe_fn job;
+    void * job_data;
+    /* stripes of the running job take scratch buffer slots in turn */
+    unsigned int next_slot;
+};
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer damage tracking
+ */
+
+#define FB_TILE_WIDTH 64
+#define FB_TILE_HEIGHT 16
+
+struct fb_damage_tracker {
+    bool enabled;
+    bool valid;
+
+    /* copy of the framebuffer content the YUYV image was converted from */
+    uint8_t * shadow;
+    /* YUYV image of the shadow content */
+    uint8_t * yuyv;
+
+    unsigned int tiles_x;
+    unsigned int tiles_y;
+    unsigned long tiles_converted;
+    unsigned long tiles_processed;
+};
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer staging
+ */
+
+#define FB_STAGE_SIZE (64 * 1024)
+
+struct fb_stage {
+    bool enabled;
+    /* framebuffer lines copied to the staging buffer at once */
+    unsigned int lines;
+    unsigned int slots;
+    uint8_t * buffers[FB_MAX_THREADS];
+};
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer vsync
+ *
+ * The shared loop never blocks on a vsync. DRM reports the requested vblank as
+ * an event on the device fd, FBIO_WAITFORVSYNC is waited for by a thread of
+ * the gadget which signals an eventfd. Either fd is the LOOP_VSYNC source.
+ */
+
+struct fb_vsync {
+    /* readable once the requested vsync happened */
+    int fd;
+    bool pending;
+
+    /* framebuffer devices only */
+    int request_fd;
+    pthread_t thread;
+    bool started;
+    bool stop;
+    int error;
+};
+
+/* ---------------------------------------------------------------------------
+ * DRM/KMS screen capture
+ */
+
+#ifdef DRM_CAPTURE
+
+#define DRM_MAX_SCANOUT_BUFFERS 3
+
+struct drm_scanout_buffer {
+    uint32_t fb_id;
+    int dmabuf_fd;
+    void * memory;
+    size_t size;
+    unsigned int offset;
+};
+
+struct drm_capture {
+    uint32_t crtc_id;
+    unsigned int crtc_index;
+    uint32_t pixel_format;
+
+    /* mapped dma-bufs of recently scanned out framebuffers */
+    struct drm_scanout_buffer buffers[DRM_MAX_SCANOUT_BUFFERS];
+    unsigned int next_buffer;
+    /* buffer the current frame is converted from */
+    struct drm_scanout_buffer * current;
+};
+
+#endif /* DRM_CAPTURE */
+
+/* ---------------------------------------------------------------------------
+ * Framebuffer scaling
+ */
+
+enum fb_scale_filter {
+    FB_SCALE_BOX,
+    FB_SCALE_BILINEAR,
+};
 
 struct uvc_settings {
     char * uvc_devname;
     char * v4l2_devname;
     char * fb_devname;
+    char * drm_devname;
+    char * m2m_devname;
     enum device_type source_device;
     unsigned int nbufs;
+    bool nbufs_adaptive;
     bool show_fps;
+    bool latest_frame;
+    enum v4l2_standby_mode standby;
+    bool pipeline_threads;
+    int pipeline_priority;
+    int pipeline_cpus[PIPELINE_THREADS];
     bool fb_grayscale;
     unsigned int fb_framerate;
+    unsigned int fb_threads;
+    bool fb_pin_threads;
+    bool fb_damage_tracking;
+    bool fb_staging;
+    bool fb_vsync;
+    enum fb_scale_filter fb_scale_filter;
+    unsigned int jpeg_quality;
     bool streaming_status_onboard;
     bool streaming_status_onboard_enabled;
     char * streaming_status_pin;
@@ -232,20 +559,64 @@ struct uvc_settings {
     unsigned int blink_on_startup;
 };
 
-struct uvc_settings settings = {
+static const struct uvc_settings uvc_settings_default = {
     .uvc_devname = "/dev/video1",
     .v4l2_devname = "/dev/video0",
     .source_device = DEVICE_TYPE_V4L2,
     .nbufs = 2,
+    .nbufs_adaptive = false,
     .fb_framerate = 25,
+    .fb_threads = 1,
+    .fb_pin_threads = false,
+    .fb_damage_tracking = false,
+    .fb_staging = false,
+    .fb_vsync = false,
+    .fb_scale_filter = FB_SCALE_BOX,
+    .jpeg_quality = 80,
     .fb_grayscale = false,
     .show_fps = false,
+    .latest_frame = false,
+    .standby = STANDBY_OFF,
+    .pipeline_threads = false,
+    .pipeline_priority = 0,
+    .pipeline_cpus = { -1, -1, -1 },
     .streaming_status_onboard = false,
     .streaming_status_onboard_enabled = false,
     .streaming_status_enabled = false,
     .blink_on_startup = 0
 };
 
+/*
+ * epoll processing loop. Interest in each fd follows the state of its queue,
+ * so level triggered readiness is only reported for work that can be done.
+ */
+enum processing_loop_source {
+    LOOP_SIGNAL,
+    LOOP_TIMER,
+    LOOP_UVC,
+    LOOP_V4L2,
+    LOOP_M2M,
+    LOOP_VSYNC,
+    LOOP_SOURCES
+};
+
+/* fds of one gadget, the signal and timer slots are only used by the shared loop */
+struct processing_loop_fds {
+    int fds[LOOP_SOURCES];
+    uint32_t events[LOOP_SOURCES];
+    uint32_t ready[LOOP_SOURCES];
+};
+
+struct processing_loop {
+    int epfd;
+    struct processing_loop_fds shared;
+    double deadline;
+    double last_time_blink;
+    bool blink_state;
+};
+
+static struct processing_loop processing_loop;
+
 struct control_mapping_pair {
     unsigned int type;
     unsigned int uvc;
@@ -264,7 +635,7 @@ struct control_mapping_pair {
     int v4l2_maximum;
 };
 
-struct control_mapping_pair control_mapping[] = {
+static const struct control_mapping_pair control_mapping_default[] = {
 	{
         .type = UVC_VC_PROCESSING_UNIT,
 		.uvc = UVC_PU_BACKLIGHT_COMPENSATION_CONTROL,
@@ -484,7 +855,9 @@ struct control_mapping_pair control_mapping[] = {
 	}
 };
 
-int control_mapping_size = sizeof(control_mapping) / sizeof(* control_mapping);
+#define CONTROL_MAPPING_SIZE (sizeof(control_mapping_default) / sizeof(* control_mapping_default))
+
+int control_mapping_size = CONTROL_MAPPING_SIZE;
 
 /*
  * RGB to YUYV conversion 
@@ -586,13 +959,343 @@ unsigned int mult_18[256] = {128, 146, 164, 182, 200, 218, 236, 254, 272, 290, 3
     4520, 4538, 4556, 4574, 4592, 4610, 4628, 4646, 4664, 4682, 4700, 4718
 };
 
-#define rgb2yvyu(r1, g1, b1, r2, g2, b2)                                                 \
+/* Two RGB pixels to one little-endian Y0 Cb Y1 Cr word */
+#define rgb2yuyv_pair(r1, g1, b1, r2, g2, b2)                                            \
     ({                                                                                   \
         uint8_t r12 = (r1 + r2) >> 1;                                                    \
         uint8_t g12 = (g1 + g2) >> 1;                                                    \
         uint8_t b12 = (b1 + b2) >> 1;                                                    \
         (uint8_t) ((r1 >> 2) + (g1 >> 1) + (b1 >> 3) + 16) +                             \
-        ((uint8_t)(((mult_112[r12] - mult_94[g12] -  mult_18[b12]) >> 8) + 128) << 8) +  \
+        ((uint8_t)(((-mult_38[r12] - mult_74[g12] + mult_112[b12]) >> 8) + 128) << 8) +  \
         ((uint8_t)((r2 >> 2) + (g2 >> 1) + (b2 >> 3) + 16) << 16) +                      \
-        ((uint8_t)(((-mult_38[r12] - mult_74[g12] + mult_112[b12]) >> 8) + 128) << 24);  \
+        ((uint8_t)(((mult_112[r12] - mult_94[g12] -  mult_18[b12]) >> 8) + 128) << 24);  \
     })
+
+/*
+ * RGB to YUYV line conversion kernels
+ *
+ * Every kernel converts one line of 'width' framebuffer pixels to 'width * 2'
+ * bytes of packed YUYV. The scalar kernels are the reference implementation,
+ * vectorized kernels have to produce bit-exact output.
+ */
+
+typedef void (* rgb2yuyv_line_fn)(uint8_t * dst, const uint8_t * src, unsigned int width);
+
+struct rgb2yuyv_kernels {
+    const char * name;
+    rgb2yuyv_line_fn line16;
+    rgb2yuyv_line_fn line24;
+    rgb2yuyv_line_fn line32;
+    rgb2yuyv_line_fn line24_bgr;
+    rgb2yuyv_line_fn line32_bgr;
+};
+
+/*
+ * Framebuffer scaler, resamples framebuffer lines to the committed frame size
+ * right before they are converted to YUYV.
+ */
+
+struct fb_scaler {
+    bool enabled;
+    enum fb_scale_filter filter;
+
+    /* output frame size */
+    unsigned int width;
+    unsigned int height;
+
+    /* bytes per pixel of the lines handed to the conversion kernel */
+    unsigned int channels;
+    rgb2yuyv_line_fn convert;
+
+    /* per output column: source columns and bilinear weight or box reciprocal */
+    unsigned int * x_first;
+    unsigned int * x_last;
+    uint32_t * x_factor;
+
+    /* per stripe scratch lines, see fb_pool_slot() */
+    unsigned int slots;
+    uint8_t * unpacked[FB_MAX_THREADS];
+    uint16_t * rows[FB_MAX_THREADS];
+    uint8_t * line[FB_MAX_THREADS];
+};
+
+/*
+ * NV12 output, frames are converted to YUYV first and repacked to a Y plane
+ * and an interleaved UV plane with chroma of every line pair averaged.
+ */
+
+struct fb_nv12_output {
+    bool enabled;
+    unsigned int width;
+    unsigned int height;
+    uint8_t * yuyv;
+};
+
+/*
+ * Conversion stage between the V4L2 capture device and the UVC device, used
+ * when the capture device cannot produce the committed UVC format. Converted
+ * frames go to UVC buffers owned by the stage, 'free' lists buffers that are
+ * not queued to the UVC device.
+ */
+
+#define V4L2_CONVERT_MAX_BUFFERS 32
+
+typedef void (* v4l2_convert_line_fn)(uint8_t * dst, const uint8_t * src, unsigned int line);
+
+struct v4l2_convert {
+    bool enabled;
+    unsigned int src_format;
+    unsigned int dst_format;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    v4l2_convert_line_fn convert;
+    rgb2yuyv_line_fn rgb;
+    bool direct;
+    uint8_t * yuyv;
+    unsigned int free[V4L2_CONVERT_MAX_BUFFERS];
+    unsigned int nfree;
+    unsigned long long dropped;
+};
+
+/*
+ * Baseline JPEG encoder
+ *
+ * Encodes packed YUYV as YCbCr 4:2:2 JPEG. Every MCU row (16x8 pixels per MCU)
+ * is a separate restart interval, so MCU rows can be encoded in parallel and
+ * concatenated afterwards.
+ */
+
+#define JPEG_MCU_WIDTH 16
+#define JPEG_MCU_HEIGHT 8
+#define JPEG_HEADER_SIZE 1024
+
+struct jpeg_encoder {
+    bool enabled;
+    unsigned int width;
+    unsigned int height;
+    unsigned int quality;
+    unsigned int mcus_x;
+    unsigned int mcus_y;
+
+    float fdtbl_y[64];
+    float fdtbl_c[64];
+
+    uint8_t header[JPEG_HEADER_SIZE];
+    unsigned int header_size;
+
+    /* entropy coded data of every MCU row */
+    uint8_t * rows;
+    unsigned int row_capacity;
+    unsigned int * row_size;
+    bool * row_overflow;
+
+    /* YUYV frame buffer for callers that have no packed YUYV frame of their own */
+    uint8_t * yuyv;
+};
+
+struct jpeg_bit_writer {
+    uint8_t * buf;
+    unsigned int size;
+    unsigned int capacity;
+    uint32_t acc;
+    unsigned int count;
+    bool overflow;
+};
+
+/* natural order -> zigzag order */
+static const uint8_t jpeg_zigzag[64] = {
+    0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42,
+    3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63
+};
+
+/* ITU-T T.81 Annex K quantization tables, natural order */
+static const uint8_t jpeg_std_quant_y[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const uint8_t jpeg_std_quant_c[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+
+/* ITU-T T.81 Annex K huffman tables */
+static const uint8_t jpeg_dc_y_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t jpeg_dc_c_bits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t jpeg_dc_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t jpeg_ac_y_bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t jpeg_ac_y_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t jpeg_ac_c_bits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t jpeg_ac_c_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+/* ---------------------------------------------------------------------------
+ * Still image capture
+ *
+ * Method 2: the host selects a still frame with STILL_PROBE/STILL_COMMIT and
+ * sets STILL_IMAGE_TRIGGER, the next frame on the video pipe is the still
+ * image. MJPEG streams of framebuffer sources render it at the size of any
+ * still capable frame of the format (bmCapabilities D0) into a buffer of its
+ * own, with a scaler and encoder of its own, so the video stream keeps its
+ * setup. The UVC buffers of such streams are sized for the largest still
+ * frame. Other streams can't change the frame size on the fly, the still image
+ * is the next video frame. Method 3 needs a bulk still endpoint the gadget
+ * doesn't have, it is served like method 2.
+ */
+#define UVC_FRAME_CAP_STILL 0x01
+
+enum uvc_still_trigger {
+    STILL_TRIGGER_NORMAL = 0,
+    STILL_TRIGGER_TRANSMIT = 1,
+    STILL_TRIGGER_TRANSMIT_BULK = 2,
+    STILL_TRIGGER_ABORT = 3,
+};
+
+struct uvc_still_control {
+    uint8_t bFormatIndex;
+    uint8_t bFrameIndex;
+    uint8_t bCompressionIndex;
+    uint32_t dwMaxVideoFrameSize;
+    uint32_t dwMaxPayloadTransferSize;
+} __attribute__((__packed__));
+
+struct uvc_still {
+    struct uvc_still_control probe;
+    struct uvc_still_control commit;
+    /* committed still frame, 0 before the first STILL_COMMIT */
+    unsigned int width;
+    unsigned int height;
+    enum uvc_still_trigger trigger;
+
+    struct fb_scaler scaler;
+    struct jpeg_encoder jpeg;
+    uint8_t * buffer;
+    unsigned int capacity;
+
+    unsigned long long sent;
+    unsigned long long dropped;
+};
+
+/* ---------------------------------------------------------------------------
+ * Gadget instances
+ *
+ * One process serves up to UVC_GADGETS_MAX UVC functions, each paired with its
+ * own source. All state of a stream lives in struct uvc_gadget and the code
+ * reaches the instance it works for through the thread local 'gadget'. The
+ * processing loop sets it before handling the events of an instance, pipeline
+ * and conversion threads set it once when they start.
+ */
+#define UVC_GADGETS_MAX 4
+
+/*
+ * Tee
+ *
+ * Gadgets naming the same capture device share it, the first of them owns the
+ * device. Each captured buffer is queued to the UVC devices of all streaming
+ * members at once and goes back to the camera when every one of them dequeued
+ * it. The camera streams while any member does, in the format of the member
+ * that started it, so only passthrough formats can be shared.
+ */
+#define V4L2_TEE_MAX_BUFFERS 32
+
+struct v4l2_tee {
+    /* every member: the owner of the capture device, NULL outside of a tee */
+    struct uvc_gadget * owner;
+    bool streaming;
+    /* capture buffers queued to the UVC device of the member, by index */
+    uint32_t held;
+
+    /* owner: the group, owner first */
+    struct uvc_gadget * members[UVC_GADGETS_MAX];
+    unsigned int nmembers;
+    unsigned int streaming_members;
+    unsigned int refcount[V4L2_TEE_MAX_BUFFERS];
+    unsigned int pixelformat;
+    unsigned int width;
+    unsigned int height;
+    unsigned long long frames;
+    unsigned long long queued;
+};
+
+struct uvc_gadget {
+    unsigned int id;
+    /* configfs function of the UVC device (uvc.usb0), NULL when unknown */
+    char * function_name;
+    /* prefix of the statistics lines, empty with a single gadget */
+    char label[32];
+
+    struct uvc_settings settings;
+    struct control_mapping_pair control_mapping[CONTROL_MAPPING_SIZE];
+
+    struct uvc_frame_format uvc_frame_format[30];
+    int last_format_index;
+    unsigned int streaming_maxburst;
+    unsigned int streaming_maxpacket;
+    unsigned int streaming_interval;
+    bool uvc_shutdown_requested;
+
+    struct v4l2_device v4l2_dev;
+    struct v4l2_device uvc_dev;
+    struct v4l2_device fb_dev;
+    struct v4l2_m2m v4l2_m2m;
+    struct v4l2_adaptive v4l2_adaptive;
+    struct v4l2_standby v4l2_standby;
+    struct format_state format_state;
+    struct v4l2_pacing v4l2_pacing;
+    struct v4l2_convert v4l2_convert;
+    struct jpeg_encoder v4l2_jpeg;
+    struct pipeline pipeline;
+    struct v4l2_tee tee;
+    struct uvc_still uvc_still;
+
+    struct fb_worker_pool fb_pool;
+    struct fb_damage_tracker fb_damage;
+    struct fb_stage fb_stage;
+    struct fb_vsync fb_vsync;
+    struct fb_scaler fb_scaler;
+    struct fb_nv12_output fb_nv12;
+    struct jpeg_encoder fb_jpeg;
+#ifdef DRM_CAPTURE
+    struct drm_capture drm_capture;
+#endif
+
+    struct processing_loop_fds loop;
+    /* framebuffer frame pacing, in ms */
+    double next_frame_time;
+};
+
+static struct uvc_gadget gadgets[UVC_GADGETS_MAX];
+static unsigned int gadgets_count = 1;
+static __thread struct uvc_gadget * gadget = &gadgets[0];